@@ -187,6 +187,12 @@ grub_archelp_dir(struct grub_archelp_data* data,
 					info.mtime = mtime;
 					info.mtimeset = 1;
 				}
+				if (!info.dir && (mode & GRUB_ARCHELP_ATTR_TYPE) != GRUB_ARCHELP_ATTR_LNK
+					&& arcops->get_size)
+				{
+					info.sizeset = 1;
+					info.size = arcops->get_size(data);
+				}
 				if (hook(n, &info, hook_data))
 				{
 					grub_free(name);
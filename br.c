@@ -123,7 +123,7 @@ grub_br_get_fs_type(grub_disk_t disk)
 	if (data)
 	{
 		fat_size = data->fat_size;
-		grub_free(data);
+		grub_fat_unmount(data);
 	}
 	switch (fat_size)
 	{
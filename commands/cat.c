@@ -13,6 +13,7 @@ static grub_err_t cmd_cat(struct grub_command* cmd, int argc, char* argv[])
 	file = grub_file_open(argv[0], GRUB_FILE_TYPE_CAT | GRUB_FILE_TYPE_NO_DECOMPRESS);
 	if (!file)
 		return grub_error(GRUB_ERR_BAD_FILENAME, "bad file");
+	/* Lines come from the buffered reader of FILE, carriage returns removed.  */
 	while (1)
 	{
 		line = grub_file_getline(file);
@@ -22,7 +23,8 @@ static grub_err_t cmd_cat(struct grub_command* cmd, int argc, char* argv[])
 		grub_free(line);
 	}
 
-	return 0;
+	grub_file_close(file);
+	return grub_errno;
 }
 
 static void
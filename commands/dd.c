@@ -7,14 +7,42 @@
 #include "command.h"
 #include "misc.h"
 
+/* Blocks are copied in chunks of up to this size, so large reads can keep
+   several disk requests in flight.  */
+#define DD_CHUNK_SIZE (4 * 1024 * 1024)
+
+/* The filesystem of the input if it is a whole volume such as (hd0,1),
+   and the filesystem can tell which parts of the volume it uses.  */
+static grub_fs_t
+dd_volume_fs(grub_file_t in)
+{
+	struct grub_fs_block* blocks;
+	grub_uint64_t sectors;
+	grub_fs_t fs;
+
+	if (in->fs != &grub_fs_blocklist || !in->disk)
+		return NULL;
+	/* One block covering the volume from its first byte.  */
+	blocks = in->data;
+	sectors = grub_disk_native_sectors(in->disk);
+	if (blocks[0].offset != 0 || sectors == GRUB_DISK_SIZE_UNKNOWN
+		|| in->size != (sectors << GRUB_DISK_SECTOR_BITS))
+		return NULL;
+	fs = grub_fs_probe(in->disk);
+	grub_errno = GRUB_ERR_NONE;
+	return (fs && fs->fs_query_used) ? fs : NULL;
+}
+
 static grub_err_t
 cmd_dd(struct grub_command* cmd, int argc, char* argv[])
 {
 	(void)cmd;
 	int i;
 	grub_file_t in = 0, out = 0;
-	grub_uint32_t bs = 512;
+	grub_uint32_t bs = 512, chunk;
 	grub_uint64_t count = 0, skip = 0, seek = 0;
+	int sparse = 0;
+	grub_fs_t vol_fs = NULL;
 	grub_uint8_t* data = NULL;
 	HANDLE* hVolList = NULL;
 	for (i = 0; i < argc; i++)
@@ -57,6 +85,8 @@ cmd_dd(struct grub_command* cmd, int argc, char* argv[])
 			skip = grub_strtoull(&argv[i][5], NULL, 0);
 		else if (grub_strncmp(argv[i], "seek=", 5) == 0)
 			seek = grub_strtoull(&argv[i][5], NULL, 0);
+		else if (grub_strcmp(argv[i], "conv=sparse") == 0)
+			sparse = 1;
 		else
 		{
 			grub_error(GRUB_ERR_BAD_ARGUMENT, "invalid argument %s", argv[i]);
@@ -68,10 +98,12 @@ cmd_dd(struct grub_command* cmd, int argc, char* argv[])
 		grub_error(GRUB_ERR_BAD_ARGUMENT, "missing %s file", in ? "input" : "output");
 		goto fail;
 	}
-	data = grub_malloc(bs);
+	chunk = bs * (DD_CHUNK_SIZE / bs);
+	data = grub_malloc(chunk);
 	if (!data)
 	{
 		grub_error(GRUB_ERR_OUT_OF_MEMORY, "can't allocate buffer");
+		goto fail;
 	}
 
 	count *= bs;
@@ -97,23 +129,52 @@ cmd_dd(struct grub_command* cmd, int argc, char* argv[])
 		count = out->size - seek;
 	}
 
+	/* Free space of a volume is skipped like holes.  It doesn't read as
+	   zeros, so the output keeps its old data there.  */
+	if (sparse)
+		vol_fs = dd_volume_fs(in);
+
 	if (out->disk->dev->id == GRUB_DISK_WINDISK_ID)
 		hVolList = LockDriveById(out->disk->id);
 
 	while (count)
 	{
 		grub_uint32_t copy_bs;
-		copy_bs = (bs > count) ? count : bs;
-		/* read */
+		grub_uint64_t run;
+		int allocated, used;
+		copy_bs = (chunk > count) ? (grub_uint32_t)count : chunk;
+		if (vol_fs)
+		{
+			if (grub_fs_query_used(vol_fs, in->disk, skip, copy_bs, &run, &used))
+				break;
+			copy_bs = (grub_uint32_t)run;
+			if (!used)
+			{
+				skip += copy_bs;
+				seek += copy_bs;
+				count -= copy_bs;
+				continue;
+			}
+		}
+		/* read, holes of the input are known to be zeros */
 		grub_file_seek(in, skip);
-		grub_file_read(in, data, copy_bs);
-		if (grub_errno)
+		if (grub_file_query_allocated(in, skip, copy_bs, &run, &allocated))
 			break;
-		/* write */
-		grub_file_seek(out, seek);
-		grub_blocklist_write(out, (char*)data, copy_bs);
+		copy_bs = (grub_uint32_t)run;
+		if (allocated)
+			grub_file_read(in, data, copy_bs);
+		else
+			grub_memset(data, 0, copy_bs);
 		if (grub_errno)
 			break;
+		/* write */
+		if (allocated || !sparse)
+		{
+			grub_file_seek(out, seek);
+			grub_blocklist_write(out, (char*)data, copy_bs);
+			if (grub_errno)
+				break;
+		}
 
 		skip += copy_bs;
 		seek += copy_bs;
@@ -142,6 +203,9 @@ help_dd(struct grub_command* cmd)
 	grub_printf("  count=N         Specify number of blocks to copy.\n");
 	grub_printf("  skip=N          Skip N bytes at input.\n");
 	grub_printf("  seek=N          Skip N bytes at output.\n");
+	grub_printf("  conv=sparse     Leave the output untouched where the input has holes,\n");
+	grub_printf("                  or where an input volume has free space.  Free space\n");
+	grub_printf("                  keeps whatever the output already holds.\n");
 }
 
 struct grub_command grub_cmd_dd =
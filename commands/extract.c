@@ -18,6 +18,10 @@ cmd_extract(struct grub_command* cmd, int argc, char* argv[])
 	char* buf = NULL;
 	grub_size_t copy_size = 8ULL * 1024 * 1024; // 8MB
 	DWORD dwout;
+	LARGE_INTEGER li;
+	grub_uint64_t run;
+	int allocated;
+	int sparse = 0;
 	if (argc < 2 || (argc < 3 && grub_strcmp(argv[0], "-d") == 0))
 	{
 		grub_error(GRUB_ERR_BAD_ARGUMENT, "missing argument");
@@ -57,21 +61,57 @@ cmd_extract(struct grub_command* cmd, int argc, char* argv[])
 	{
 		if (file->offset + copy_size > file->size)
 			copy_size = file->size - file->offset;
-		if (grub_file_read(file, buf, copy_size) != (grub_ssize_t)copy_size)
+		if (grub_file_query_allocated(file, file->offset, copy_size, &run, &allocated))
+			goto fail;
+		/* Holes of the source are skipped, leaving holes in the output.  The
+		   output is made sparse only once the first hole shows up, and gets
+		   the zeros written when it can't be.  */
+		if (!allocated && !sparse)
+			sparse = DeviceIoControl(fd, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &dwout, NULL) ? 1 : -1;
+		if (!allocated && sparse < 0)
+		{
+			grub_file_seek(file, file->offset + run);
+			grub_memset(buf, 0, (grub_size_t)run);
+			if (!WriteFile(fd, buf, (DWORD)run, &dwout, NULL) || dwout != run)
+			{
+				grub_error(GRUB_ERR_WRITE_ERROR, "file write error %u", GetLastError());
+				goto fail;
+			}
+			grub_printf("%llu%%\n", file->offset * 100 / file->size);
+			continue;
+		}
+		if (!allocated)
+		{
+			grub_file_seek(file, file->offset + run);
+			li.QuadPart = file->offset;
+			if (!SetFilePointerEx(fd, li, NULL, FILE_BEGIN))
+			{
+				grub_error(GRUB_ERR_WRITE_ERROR, "file seek error %u", GetLastError());
+				goto fail;
+			}
+			grub_printf("%llu%%\n", file->offset * 100 / file->size);
+			continue;
+		}
+		if (grub_file_read(file, buf, (grub_size_t)run) != (grub_ssize_t)run)
 		{
 			grub_error(GRUB_ERR_READ_ERROR, "file read error");
 			goto fail;
 		}
-		if (!WriteFile(fd, buf, (DWORD)copy_size, &dwout, NULL) || dwout != copy_size)
+		if (!WriteFile(fd, buf, (DWORD)run, &dwout, NULL) || dwout != run)
 		{
 			grub_error(GRUB_ERR_WRITE_ERROR, "file write error %u", GetLastError());
 			goto fail;
 		}
 		grub_printf("%llu%%\n", file->offset * 100 / file->size);
 	}
+	/* A trailing hole only moved the file pointer.  */
+	if (!SetEndOfFile(fd))
+		grub_error(GRUB_ERR_WRITE_ERROR, "file write error %u", GetLastError());
 fail:
 	if (file)
 		grub_file_close(file);
+	if (fd != INVALID_HANDLE_VALUE)
+		grub_disk_cache_invalidate_all();
 	CHECK_CLOSE_HANDLE(fd);
 	if (buf)
 		grub_free(buf);
@@ -9,7 +9,7 @@ hash_file(grub_file_t file, const gcry_md_spec_t* hash, void* result)
 {
 	void* context;
 	grub_uint8_t* readbuf;
-#define BUF_SIZE 4096
+#define BUF_SIZE (4 * 1024 * 1024)
 	readbuf = grub_malloc(BUF_SIZE);
 	if (!readbuf)
 		return grub_errno;
@@ -21,7 +21,19 @@ hash_file(grub_file_t file, const gcry_md_spec_t* hash, void* result)
 	while (1)
 	{
 		grub_ssize_t r;
-		r = grub_file_read(file, readbuf, BUF_SIZE);
+		grub_uint64_t run;
+		int allocated;
+		/* Holes are hashed as zeros without reading them.  */
+		if (grub_file_query_allocated(file, file->offset, BUF_SIZE, &run, &allocated))
+			goto fail;
+		if (allocated)
+			r = grub_file_read(file, readbuf, (grub_size_t)run);
+		else
+		{
+			r = (grub_ssize_t)run;
+			grub_memset(readbuf, 0, r);
+			grub_file_seek(file, file->offset + r);
+		}
 		if (r < 0)
 			goto fail;
 		if (r == 0)
@@ -15,10 +15,17 @@ static grub_err_t cmd_help(struct grub_command* cmd, int argc, char* argv[])
 			grub_printf("%s not found\n", argv[0]);
 		return 0;
 	}
-	grub_printf("diskfire [-d=DEBUG] [-m=FILE ...] COMMAND\n");
+	grub_printf("diskfire [-d=DEBUG] [-m=FILE ...] [-c=SIZE] [-r=SIZE] [-q=N] [-p=FILE] [--stats] [--writeback] [--direct] COMMAND\n");
 	grub_printf("OPTIONS:\n");
 	grub_printf("  -d=DEBUG  Set debug conditions.\n");
 	grub_printf("  -m=FILE   Make a virtual drive (ldX) from a file.\n");
+	grub_printf("  -c=SIZE   Set disk cache size (K/M/G). [default=32M]\n");
+	grub_printf("  -r=SIZE   Set maximum readahead size, 0 to disable. [default=512K]\n");
+	grub_printf("  -q=N      Set number of disk reads kept in flight (1~64). [default=4]\n");
+	grub_printf("  -p=FILE   Keep filesystem probe results in FILE across runs.\n");
+	grub_printf("  --stats   Print disk cache and I/O statistics at exit.\n");
+	grub_printf("  --writeback  Buffer and merge disk writes until the disk is closed.\n");
+	grub_printf("  --direct  Stream bulk reads around the disk cache and the system file cache.\n");
 	grub_printf("COMMANDS:\n\n");
 	FOR_COMMANDS(p)
 	{
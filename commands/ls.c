@@ -38,7 +38,7 @@ ls_print_disk_info(const char* name)
 			if (fs->fs_label)
 			{
 				char* label;
-				(fs->fs_label) (disk, &label);
+				grub_fs_label(fs, disk, &label);
 				if (grub_errno == GRUB_ERR_NONE)
 				{
 					if (label && grub_strlen(label))
@@ -50,7 +50,7 @@ ls_print_disk_info(const char* name)
 			if (fs->fs_uuid)
 			{
 				char* uuid;
-				(fs->fs_uuid) (disk, &uuid);
+				grub_fs_uuid(fs, disk, &uuid);
 				if (grub_errno == GRUB_ERR_NONE)
 				{
 					if (uuid && grub_strlen(uuid))
@@ -83,7 +83,9 @@ ls_print_disk_info(const char* name)
 static grub_err_t
 ls_print_file_info(const char* filename, const struct grub_dirhook_info* info, const char *dirname)
 {
-	if (!info->dir)
+	if (!info->dir && info->sizeset)
+		grub_printf("%-12s", grub_get_human_size(info->size, d_human_sizes, 1024));
+	else if (!info->dir)
 	{
 		grub_file_t file;
 		grub_size_t pathlen = grub_strlen(dirname) + grub_strlen(filename) + 2;
@@ -102,6 +102,8 @@ pbr_backup(grub_disk_t disk, const char* dest, grub_disk_addr_t sectors)
 	}
 
 	CHECK_CLOSE_HANDLE(fd);
+	/* The file was written behind the back of the disk cache.  */
+	grub_disk_cache_invalidate_all();
 	return grub_errno;
 }
 
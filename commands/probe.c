@@ -58,7 +58,7 @@ static grub_err_t probe_fsuuid(grub_disk_t disk)
 	if (fs && fs->fs_uuid)
 	{
 		char* uuid;
-		(fs->fs_uuid) (disk, &uuid);
+		grub_fs_uuid(fs, disk, &uuid);
 		if (grub_errno == GRUB_ERR_NONE && uuid)
 		{
 			if (grub_strlen(uuid))
@@ -77,7 +77,7 @@ static grub_err_t probe_label(grub_disk_t disk)
 	if (fs && fs->fs_label)
 	{
 		char* label;
-		(fs->fs_label) (disk, &label);
+		grub_fs_label(fs, disk, &label);
 		if (grub_errno == GRUB_ERR_NONE && label)
 		{
 			if (grub_strlen(label))
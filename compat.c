@@ -219,14 +219,14 @@ grub_strndup(const char* s, grub_size_t n)
 
 #define GRUB_ERROR_STACK_SIZE	10
 
-grub_err_t grub_errno;
-char grub_errmsg[GRUB_MAX_ERRMSG];
+GRUB_THREAD_LOCAL grub_err_t grub_errno;
+GRUB_THREAD_LOCAL char grub_errmsg[GRUB_MAX_ERRMSG];
 int grub_err_printed_errors;
 
-static struct grub_error_saved grub_error_stack_items[GRUB_ERROR_STACK_SIZE];
+static GRUB_THREAD_LOCAL struct grub_error_saved grub_error_stack_items[GRUB_ERROR_STACK_SIZE];
 
-static int grub_error_stack_pos;
-static int grub_error_stack_assert;
+static GRUB_THREAD_LOCAL int grub_error_stack_pos;
+static GRUB_THREAD_LOCAL int grub_error_stack_assert;
 
 grub_err_t
 grub_error(grub_err_t n, const char* fmt, ...)
@@ -320,6 +320,36 @@ grub_get_time_ms(void)
 	return GetTickCount64();
 }
 
+static INIT_ONCE grub_time_once = INIT_ONCE_STATIC_INIT;
+static LARGE_INTEGER grub_time_freq;
+
+static BOOL CALLBACK
+grub_time_init(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+	(void)once;
+	(void)param;
+	(void)context;
+	if (!QueryPerformanceFrequency(&grub_time_freq))
+		grub_time_freq.QuadPart = 0;
+	return TRUE;
+}
+
+grub_uint64_t
+grub_get_time_us(void)
+{
+	LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	/* Called from the I/O threads too.  */
+	InitOnceExecuteOnce(&grub_time_once, grub_time_init, NULL, NULL);
+	freq = grub_time_freq;
+	if (!freq.QuadPart)
+		return GetTickCount64() * 1000;
+	QueryPerformanceCounter(&now);
+	return (grub_uint64_t)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (grub_uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
 static grub_uint32_t next = 42;
 
 grub_uint32_t
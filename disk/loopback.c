@@ -2,7 +2,9 @@
 #include "compat.h"
 #include "disk.h"
 #include "file.h"
+#include "fs.h"
 #include "command.h"
+#include "misc.h"
 
 struct grub_loopback
 {
@@ -10,8 +12,78 @@ struct grub_loopback
 	grub_file_t file;
 	struct grub_loopback* next;
 	unsigned long id;
+	/* Read-only view of the whole file, for plain host files.  */
+	HANDLE mapping;
+	const char* view;
+	/* The disk holding the file, see disk_backing.  */
+	unsigned long backing_dev;
+	unsigned long backing_disk;
 };
 
+/* Find the disk holding the file of DEV, which writes to that disk may
+   change.  */
+static void
+loopback_find_backing(struct grub_loopback* dev)
+{
+	grub_file_t file = dev->file;
+	char path[MAX_PATH];
+	DWORD len, drive;
+
+	if (file->disk)
+	{
+		dev->backing_dev = file->disk->dev->id;
+		dev->backing_disk = file->disk->id;
+		return;
+	}
+	/* A host file lives on the drive holding its volume.  Assume any drive
+	   if the volume can't be resolved.  */
+	dev->backing_dev = GRUB_DISK_WINDISK_ID;
+	dev->backing_disk = GRUB_DISK_ANY_ID;
+	if (file->name[0] == '(')
+		return;
+	len = GetFullPathNameA(file->name, sizeof(path), path, NULL);
+	if (len && len < sizeof(path) && grub_isalpha(path[0]) && path[1] == ':'
+		&& GetDriveByLetter((char)grub_toupper(path[0]), &drive))
+		dev->backing_disk = drive;
+}
+
+/* Map a plain host file, so that disk reads are served straight from the
+   system cache.  Files that can't be mapped are read as usual.  */
+static void
+loopback_map(struct grub_loopback* dev)
+{
+	grub_file_t file = dev->file;
+
+	/* Unbuffered mode keeps bulk reads out of the system cache.  */
+	if (file->fs != &grub_fs_winfile || grub_disk_get_unbuffered()
+		|| file->size == GRUB_FILE_SIZE_UNKNOWN
+		|| file->size == 0 || file->size > (grub_uint64_t)(grub_size_t)-1)
+		return;
+
+	dev->mapping = CreateFileMappingA(grub_fs_winfile_handle(file), NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!dev->mapping)
+		return;
+	dev->view = MapViewOfFile(dev->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!dev->view)
+	{
+		CloseHandle(dev->mapping);
+		dev->mapping = NULL;
+		return;
+	}
+	grub_dprintf("loop", "%s mapped at %p\n", dev->devname, dev->view);
+}
+
+static void
+loopback_unmap(struct grub_loopback* dev)
+{
+	if (dev->view)
+		UnmapViewOfFile(dev->view);
+	if (dev->mapping)
+		CloseHandle(dev->mapping);
+	dev->view = NULL;
+	dev->mapping = NULL;
+}
+
 static struct grub_loopback* loopback_list;
 static unsigned long last_id = 0;
 
@@ -35,6 +107,7 @@ grub_err_t loopback_delete(const char* name)
 	*prev = dev->next;
 
 	grub_free(dev->devname);
+	loopback_unmap(dev);
 	grub_file_close(dev->file);
 	grub_free(dev);
 
@@ -72,6 +145,8 @@ loopback_add(const char* name)
 
 	newdev->file = file;
 	newdev->id = last_id++;
+	loopback_map(newdev);
+	loopback_find_backing(newdev);
 
 	/* Add the new entry to the list.  */
 	newdev->next = loopback_list;
@@ -123,6 +198,11 @@ loopback_open(const char* name, grub_disk_t disk)
 	disk->id = dev->id;
 
 	disk->data = dev;
+	if (dev->view)
+	{
+		disk->map = dev->view;
+		disk->map_size = dev->file->size;
+	}
 
 	return 0;
 }
@@ -139,8 +219,7 @@ loopback_read(grub_disk_t disk, grub_disk_addr_t sector, grub_size_t size, char*
 	grub_file_t file = ((struct grub_loopback*)disk->data)->file;
 	grub_off_t pos;
 
-	grub_file_seek(file, sector << GRUB_DISK_SECTOR_BITS);
-	grub_file_read(file, buf, size << GRUB_DISK_SECTOR_BITS);
+	grub_file_pread(file, buf, size << GRUB_DISK_SECTOR_BITS, sector << GRUB_DISK_SECTOR_BITS);
 	if (grub_errno)
 		return grub_errno;
 
@@ -167,6 +246,51 @@ loopback_write(grub_disk_t disk, grub_disk_addr_t sector, grub_size_t size, cons
 	return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "loopback write is not supported");
 }
 
+static int
+loopback_backing(unsigned long disk_id, unsigned long* dev_id, unsigned long* backing_id)
+{
+	struct grub_loopback* dev;
+
+	for (dev = loopback_list; dev; dev = dev->next)
+	{
+		if (dev->id == disk_id)
+		{
+			*dev_id = dev->backing_dev;
+			*backing_id = dev->backing_disk;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static grub_err_t
+loopback_query_allocated(grub_disk_t disk, grub_disk_addr_t sector, grub_disk_addr_t size,
+	grub_disk_addr_t* run, int* allocated)
+{
+	grub_file_t file = ((struct grub_loopback*)disk->data)->file;
+	grub_uint64_t bytes;
+
+	/* Past the end of the file.  */
+	if ((sector << GRUB_DISK_SECTOR_BITS) >= file->size)
+	{
+		*run = size;
+		*allocated = 1;
+		return GRUB_ERR_NONE;
+	}
+	if (grub_file_query_allocated(file, sector << GRUB_DISK_SECTOR_BITS,
+		size << GRUB_DISK_SECTOR_BITS, &bytes, allocated) != GRUB_ERR_NONE)
+		return grub_errno;
+	/* Only whole sectors of a hole are reported.  */
+	*run = *allocated ? (bytes + GRUB_DISK_SECTOR_SIZE - 1) >> GRUB_DISK_SECTOR_BITS
+		: bytes >> GRUB_DISK_SECTOR_BITS;
+	if (!*run)
+	{
+		*run = 1;
+		*allocated = 1;
+	}
+	return GRUB_ERR_NONE;
+}
+
 struct grub_disk_dev grub_loopback_dev =
 {
 	.name = "loopback",
@@ -176,6 +300,8 @@ struct grub_disk_dev grub_loopback_dev =
 	.disk_close = loopback_close,
 	.disk_read = loopback_read,
 	.disk_write = loopback_write,
+	.disk_query_allocated = loopback_query_allocated,
+	.disk_backing = loopback_backing,
 	.next = 0
 };
 
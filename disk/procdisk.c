@@ -48,6 +48,17 @@ procdisk_write(grub_disk_t disk, grub_disk_addr_t sector, grub_size_t size, cons
 	return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "procdisk write is not supported");
 }
 
+static grub_err_t
+procdisk_query_allocated(grub_disk_t disk, grub_disk_addr_t sector, grub_disk_addr_t size,
+	grub_disk_addr_t* run, int* allocated)
+{
+	(void)disk;
+	(void)sector;
+	*run = size;
+	*allocated = 0;
+	return GRUB_ERR_NONE;
+}
+
 struct grub_disk_dev grub_procdisk_dev =
 {
 	.name = "proc",
@@ -57,5 +68,6 @@ struct grub_disk_dev grub_procdisk_dev =
 	.disk_close = procdisk_close,
 	.disk_read = procdisk_read,
 	.disk_write = procdisk_write,
+	.disk_query_allocated = procdisk_query_allocated,
 	.next = 0
 };
@@ -43,22 +43,41 @@ windisk_iterate(grub_disk_iterate_hook_t hook, void* hook_data)
 	return 0;
 }
 
+struct windisk_data
+{
+	HANDLE dh;
+	/* Opened with FILE_FLAG_OVERLAPPED on the first asynchronous read.  */
+	HANDLE async;
+	/* The drive refused the reopen, use synchronous reads only.  */
+	BOOL async_failed;
+};
+
 static grub_err_t
 windisk_open(const char* name, struct grub_disk* disk)
 {
 	DWORD drive;
-	HANDLE* data;
+	HANDLE dh;
+	struct windisk_data* data;
 
 	if (!windisk_get_drive(name, &drive))
 		return grub_errno;
 
-	data = GetHandleById(drive);
-	if (data == INVALID_HANDLE_VALUE)
+	dh = GetHandleById(drive);
+	if (dh == INVALID_HANDLE_VALUE)
 		return grub_error(GRUB_ERR_UNKNOWN_DEVICE, "invalid windisk");
 
+	data = grub_zalloc(sizeof(*data));
+	if (!data)
+	{
+		CHECK_CLOSE_HANDLE(dh);
+		return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+	}
+	data->dh = dh;
+	data->async = INVALID_HANDLE_VALUE;
+
 	disk->id = drive;
 	disk->log_sector_size = GRUB_DISK_SECTOR_BITS;
-	disk->total_sectors = GetDriveSize(data) >> GRUB_DISK_SECTOR_BITS;
+	disk->total_sectors = GetDriveSize(dh) >> GRUB_DISK_SECTOR_BITS;
 	disk->max_agglomerate = 1048576 >> (GRUB_DISK_SECTOR_BITS
 		+ GRUB_DISK_CACHE_BITS);
 
@@ -70,14 +89,29 @@ windisk_open(const char* name, struct grub_disk* disk)
 static void
 windisk_close(struct grub_disk* disk)
 {
-	HANDLE* data = disk->data;
-	CHECK_CLOSE_HANDLE(data);
+	struct windisk_data* data = disk->data;
+	CHECK_CLOSE_HANDLE(data->async);
+	CHECK_CLOSE_HANDLE(data->dh);
+	grub_free(data);
+}
+
+static grub_uint64_t
+windisk_media_id(struct grub_disk* disk)
+{
+	HANDLE dh = ((struct windisk_data*)disk->data)->dh;
+	ULONG count = 0;
+	DWORD dwsize = 0;
+	/* The media change count of removable drives.  */
+	if (!DeviceIoControl(dh, IOCTL_STORAGE_CHECK_VERIFY2, NULL, 0,
+		&count, sizeof(count), &dwsize, NULL) || dwsize < sizeof(count))
+		return 0;
+	return count;
 }
 
 static grub_err_t
 windisk_read(struct grub_disk* disk, grub_disk_addr_t sector, grub_size_t size, char* buf)
 {
-	HANDLE dh = disk->data;
+	HANDLE dh = ((struct windisk_data*)disk->data)->dh;
 	__int64 distance = sector << GRUB_DISK_SECTOR_BITS;
 	LARGE_INTEGER li = { 0 };
 	DWORD dwsize;
@@ -96,10 +130,75 @@ windisk_read(struct grub_disk* disk, grub_disk_addr_t sector, grub_size_t size,
 	return grub_error(GRUB_ERR_READ_ERROR, "failure reading sector 0x%llx from %s", sector, disk->name);
 }
 
+static grub_err_t
+windisk_submit(struct grub_disk* disk, struct grub_disk_request* req)
+{
+	struct windisk_data* data = disk->data;
+	OVERLAPPED* ov;
+	__int64 distance = req->sector << GRUB_DISK_SECTOR_BITS;
+
+	if (req->size > (DWORD_MAX >> GRUB_DISK_SECTOR_BITS))
+		return grub_error(GRUB_ERR_OUT_OF_RANGE, "attempt to read more than 4GB data");
+	if (data->async_failed)
+		return grub_error(GRUB_ERR_IO, "no overlapped i/o on %s", disk->name);
+	if (data->async == INVALID_HANDLE_VALUE)
+	{
+		data->async = ReOpenFile(data->dh, GENERIC_READ,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED);
+		if (data->async == INVALID_HANDLE_VALUE)
+		{
+			data->async_failed = TRUE;
+			return grub_error(GRUB_ERR_IO, "can't reopen %s for overlapped i/o", disk->name);
+		}
+	}
+
+	ov = grub_zalloc(sizeof(*ov));
+	if (!ov)
+		return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+	/* Several requests are in flight on the handle, so each needs its own event.  */
+	ov->hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (!ov->hEvent)
+	{
+		grub_free(ov);
+		return grub_error(GRUB_ERR_OUT_OF_MEMORY, "can't create event");
+	}
+	ov->Offset = (DWORD)distance;
+	ov->OffsetHigh = (DWORD)(distance >> 32);
+	grub_dprintf("windisk", "windisk submit %s sector 0x%llx size 0x%llx\n", disk->name, req->sector, req->size);
+	if (!ReadFile(data->async, req->buf, (DWORD)(req->size << GRUB_DISK_SECTOR_BITS), NULL, ov)
+		&& GetLastError() != ERROR_IO_PENDING)
+	{
+		grub_dprintf("windisk", "windisk readfile failed %u\n", GetLastError());
+		CloseHandle(ov->hEvent);
+		grub_free(ov);
+		return grub_error(GRUB_ERR_READ_ERROR, "failure reading sector 0x%llx from %s", req->sector, disk->name);
+	}
+	req->data = ov;
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+windisk_wait(struct grub_disk* disk, struct grub_disk_request* req)
+{
+	struct windisk_data* data = disk->data;
+	OVERLAPPED* ov = req->data;
+	DWORD dwsize = 0;
+	BOOL ok;
+
+	ok = GetOverlappedResult(data->async, ov, &dwsize, TRUE);
+	CloseHandle(ov->hEvent);
+	grub_free(ov);
+	req->data = NULL;
+	if (ok && dwsize == (DWORD)(req->size << GRUB_DISK_SECTOR_BITS))
+		return GRUB_ERR_NONE;
+	grub_dprintf("windisk", "windisk overlapped read failed %u\n", GetLastError());
+	return grub_error(GRUB_ERR_READ_ERROR, "failure reading sector 0x%llx from %s", req->sector, disk->name);
+}
+
 static grub_err_t
 windisk_write(struct grub_disk* disk, grub_disk_addr_t sector, grub_size_t size, const char* buf)
 {
-	HANDLE dh = disk->data;
+	HANDLE dh = ((struct windisk_data*)disk->data)->dh;
 	__int64 distance = sector << GRUB_DISK_SECTOR_BITS;
 	LARGE_INTEGER li = { 0 };
 	DWORD dwsize;
@@ -125,5 +224,8 @@ struct grub_disk_dev grub_windisk_dev =
 	.disk_close = windisk_close,
 	.disk_read = windisk_read,
 	.disk_write = windisk_write,
+	.disk_submit = windisk_submit,
+	.disk_wait = windisk_wait,
+	.disk_media_id = windisk_media_id,
 	.next = 0
 };
@@ -1,5 +1,6 @@
 ﻿// SPDX-License-Identifier: GPL-3.0-or-later
 #include <stdio.h>
+#include <errno.h>
 #include "command.h"
 #include "misc.h"
 #include "fs.h"
@@ -35,6 +36,36 @@ static void procfs_init(void)
 	proc_add("zero", NULL, dd_zero_read);
 }
 
+/* Parse a size with an optional K, M or G suffix.  */
+static grub_err_t
+get_size(const char* str, grub_uint64_t* size)
+{
+	const char* p = NULL;
+	grub_uint64_t sz;
+	unsigned shift = 0;
+
+	if (!grub_isdigit(*str))
+		return grub_error(GRUB_ERR_BAD_ARGUMENT, "invalid size %s", str);
+	errno = 0;
+	sz = grub_strtoull(str, &p, 0);
+	if (errno == ERANGE)
+		return grub_error(GRUB_ERR_BAD_ARGUMENT, "size %s is too large", str);
+	if (*p == 'K' || *p == 'k')
+		shift = 10;
+	else if (*p == 'M' || *p == 'm')
+		shift = 20;
+	else if (*p == 'G' || *p == 'g')
+		shift = 30;
+	if (shift)
+		p++;
+	if (*p)
+		return grub_error(GRUB_ERR_BAD_ARGUMENT, "invalid size %s", str);
+	if (sz > (~0ULL >> shift))
+		return grub_error(GRUB_ERR_BAD_ARGUMENT, "size %s is too large", str);
+	*size = sz << shift;
+	return GRUB_ERR_NONE;
+}
+
 static char** args_init(int argc, wchar_t* u16_argv[])
 {
 	int i;
@@ -66,6 +97,8 @@ static void args_fini(int argc, char* u8_argv[])
 int wmain(int argc, wchar_t *argv[])
 {
 	int i;
+	int show_stats = 0;
+	grub_uint64_t size;
 	char** u8_argv = NULL;
 	grub_command_t p = NULL;
 	u8_argv = args_init(argc, argv);
@@ -104,6 +137,40 @@ int wmain(int argc, wchar_t *argv[])
 			if (loopback_add(&u8_argv[i][3]))
 				goto fini;
 		}
+		else if (_stricmp(u8_argv[i], "--stats") == 0)
+		{
+			show_stats = 1;
+		}
+		else if (_stricmp(u8_argv[i], "--writeback") == 0)
+		{
+			grub_disk_set_writeback(1);
+		}
+		else if (_stricmp(u8_argv[i], "--direct") == 0)
+		{
+			grub_disk_set_unbuffered(1);
+		}
+		else if (_strnicmp(u8_argv[i], "-c=", 3) == 0 && u8_argv[i][3])
+		{
+			if (get_size(&u8_argv[i][3], &size)
+				|| grub_disk_cache_set_size(size))
+				goto fini;
+		}
+		else if (_strnicmp(u8_argv[i], "-r=", 3) == 0 && u8_argv[i][3])
+		{
+			if (get_size(&u8_argv[i][3], &size)
+				|| grub_disk_set_readahead(size))
+				goto fini;
+		}
+		else if (_strnicmp(u8_argv[i], "-p=", 3) == 0 && u8_argv[i][3])
+		{
+			if (grub_fs_probe_cache_load(&u8_argv[i][3]))
+				goto fini;
+		}
+		else if (_strnicmp(u8_argv[i], "-q=", 3) == 0 && u8_argv[i][3])
+		{
+			if (grub_disk_set_queue_depth(grub_strtoul(&u8_argv[i][3], NULL, 0)))
+				goto fini;
+		}
 		else if ((p = grub_command_find(u8_argv[i])) != NULL)
 		{
 			int new_argc = argc - i - 1;
@@ -118,6 +185,10 @@ int wmain(int argc, wchar_t *argv[])
 fini:
 	if (grub_errno)
 		grub_print_error();
+	grub_fs_probe_cache_save();
+	grub_fs_mount_flush();
+	if (show_stats)
+		grub_disk_stats_print();
 	if (gDriveList)
 		free(gDriveList);
 	args_fini(argc, u8_argv);
@@ -19,15 +19,55 @@
 #include "compat.h"
 #include "disk.h"
 #include "partition.h"
+#include "file.h"
+#include "command.h"
 
 grub_disk_dev_t grub_disk_dev_list;
 
-#define	GRUB_CACHE_TIMEOUT 2
+struct grub_disk_cache* grub_disk_cache_table = NULL;
 
-/* The last time the disk was used.  */
-static grub_uint64_t grub_last_time = 0;
+/* The size of the cache in bytes, and the number of sets it is made of.  */
+static grub_uint64_t grub_disk_cache_size = GRUB_DISK_CACHE_DEFAULT_SIZE;
+unsigned grub_disk_cache_sets = 0;
 
-struct grub_disk_cache grub_disk_cache_table[GRUB_DISK_CACHE_NUM];
+/* Backing storage of all cache units, one GRUB_DISK_CACHE_SIZE sector block
+   per unit of grub_disk_cache_table, allocated together with the table.  */
+static char* grub_disk_cache_pool = NULL;
+
+/* The largest readahead window, in cache units.  */
+static unsigned int grub_disk_readahead_max =
+	GRUB_DISK_READAHEAD_DEFAULT_SIZE >> (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS);
+
+/* The number of reads kept in flight by devices with disk_submit.  */
+static unsigned int grub_disk_queue_depth = GRUB_DISK_QUEUE_DEPTH_DEFAULT;
+
+/* Whether newly opened disks buffer their writes.  */
+static int grub_disk_writeback_default = 0;
+
+/* Whether newly opened disks and host files read in bulk without caching.  */
+static int grub_disk_unbuffered_default = 0;
+
+/* Free buffers of the aligned buffer pool.  */
+#define GRUB_DISK_BUFFER_POOL_MAX 16
+static void* grub_disk_buffer_pool[GRUB_DISK_BUFFER_POOL_MAX];
+static unsigned int grub_disk_buffer_pool_count = 0;
+static SRWLOCK grub_disk_buffer_lock = SRWLOCK_INIT;
+
+/* Incremented on each cache access, used to find the least recently used
+   unit of a set.  */
+static grub_uint64_t grub_disk_cache_clock = 0;
+
+/* The sets of the cache are split into shards, each guarded by its own lock.
+   Lookups take it shared, anything changing a unit takes it exclusive.  */
+#define GRUB_DISK_CACHE_SHARDS 64
+static SRWLOCK grub_disk_cache_locks[GRUB_DISK_CACHE_SHARDS];
+
+/* Guards the allocation of the cache table and pool.  */
+static SRWLOCK grub_disk_cache_alloc_lock = SRWLOCK_INIT;
+
+static struct grub_disk_stats* grub_disk_stats_list = NULL;
+/* Guards the insertion of new devices into grub_disk_stats_list.  */
+static SRWLOCK grub_disk_stats_lock = SRWLOCK_INIT;
 
 struct part_ent
 {
@@ -130,6 +170,329 @@ grub_disk_iterate(grub_disk_iterate_hook_t hook, void* hook_data)
 	return 0;
 }
 
+/* Return the statistics of the device DEV_ID/DISK_ID, creating them if
+   needed.  Return NULL if out of memory.  */
+static struct grub_disk_stats*
+grub_disk_stats_get(unsigned long dev_id, unsigned long disk_id)
+{
+	static GRUB_THREAD_LOCAL struct grub_disk_stats* last = NULL;
+	struct grub_disk_stats* stats;
+
+	if (last && last->dev_id == dev_id && last->disk_id == disk_id)
+		return last;
+
+	/* Entries are never removed, so the list can be walked while another
+	   thread pushes a new head.  */
+	for (stats = grub_disk_stats_list; stats; stats = stats->next)
+	{
+		if (stats->dev_id == dev_id && stats->disk_id == disk_id)
+			break;
+	}
+
+	if (!stats)
+	{
+		AcquireSRWLockExclusive(&grub_disk_stats_lock);
+		for (stats = grub_disk_stats_list; stats; stats = stats->next)
+		{
+			if (stats->dev_id == dev_id && stats->disk_id == disk_id)
+				break;
+		}
+		if (!stats)
+		{
+			stats = grub_zalloc(sizeof(*stats));
+			if (stats)
+			{
+				stats->dev_id = dev_id;
+				stats->disk_id = disk_id;
+				stats->next = grub_disk_stats_list;
+				MemoryBarrier();
+				grub_disk_stats_list = stats;
+			}
+		}
+		ReleaseSRWLockExclusive(&grub_disk_stats_lock);
+		if (!stats)
+			return NULL;
+	}
+
+	last = stats;
+	return stats;
+}
+
+/* Counters are shared by all threads using a device.  */
+static void
+grub_disk_stats_add(grub_uint64_t* counter, grub_uint64_t n)
+{
+	InterlockedExchangeAdd64((LONG64 volatile*)counter, (LONG64)n);
+}
+
+/* Raise the maximum *COUNTER to N without losing a larger value stored
+   by another thread.  */
+static void
+grub_disk_stats_max(grub_uint64_t* counter, grub_uint64_t n)
+{
+	grub_uint64_t old = *(volatile grub_uint64_t*)counter;
+
+	while (n > old)
+	{
+		grub_uint64_t cur = (grub_uint64_t)InterlockedCompareExchange64(
+			(LONG64 volatile*)counter, (LONG64)n, (LONG64)old);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+/* Wrappers of the device read and write functions keeping statistics.  */
+static grub_err_t
+grub_disk_dev_read(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_size_t size, char* buf)
+{
+	grub_err_t err;
+	grub_uint64_t start;
+
+	if (!disk->stats)
+		return disk->dev->disk_read(disk, sector, size, buf);
+
+	start = grub_get_time_us();
+	err = disk->dev->disk_read(disk, sector, size, buf);
+	grub_disk_stats_add(&disk->stats->read_time_us, grub_get_time_us() - start);
+	grub_disk_stats_add(&disk->stats->read_requests, 1);
+	grub_disk_stats_add(&disk->stats->read_bytes, (grub_uint64_t)size << disk->log_sector_size);
+	return err;
+}
+
+grub_err_t
+grub_disk_set_queue_depth(unsigned depth)
+{
+	if (!depth || depth > GRUB_DISK_QUEUE_DEPTH_MAX)
+		return grub_error(GRUB_ERR_BAD_ARGUMENT, "invalid queue depth");
+	grub_disk_queue_depth = depth;
+	return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_disk_read_requests(grub_disk_t disk, struct grub_disk_request* reqs,
+	grub_size_t n)
+{
+	grub_err_t err = GRUB_ERR_NONE;
+	grub_size_t head, tail, i;
+	grub_uint64_t start = 0;
+	int submit;
+
+	if (!disk->dev->disk_submit || grub_disk_queue_depth < 2 || n < 2)
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (grub_disk_dev_read(disk, reqs[i].sector, reqs[i].size, reqs[i].buf) != GRUB_ERR_NONE)
+				return grub_errno;
+		}
+		return GRUB_ERR_NONE;
+	}
+
+	if (disk->stats)
+		start = grub_get_time_us();
+
+	/* Keep the queue full until all requests are submitted or one can't be,
+	   then wait for everything still in flight.  */
+	head = tail = 0;
+	submit = 1;
+	while (tail < head || (head < n && submit))
+	{
+		if (submit && head < n && head - tail < grub_disk_queue_depth)
+		{
+			if (disk->dev->disk_submit(disk, &reqs[head]) != GRUB_ERR_NONE)
+			{
+				grub_errno = GRUB_ERR_NONE;
+				submit = 0;
+			}
+			else
+				head++;
+			continue;
+		}
+		if (disk->dev->disk_wait(disk, &reqs[tail]) != GRUB_ERR_NONE && err == GRUB_ERR_NONE)
+			err = grub_errno;
+		tail++;
+	}
+
+	if (disk->stats)
+	{
+		grub_disk_stats_add(&disk->stats->read_time_us, grub_get_time_us() - start);
+		grub_disk_stats_add(&disk->stats->read_requests, head);
+		for (i = 0; i < head; i++)
+			grub_disk_stats_add(&disk->stats->read_bytes, (grub_uint64_t)reqs[i].size << disk->log_sector_size);
+	}
+
+	if (err != GRUB_ERR_NONE)
+	{
+		grub_errno = err;
+		return err;
+	}
+
+	/* The device could not start a request, read the rest synchronously
+	   as before asynchronous reads existed.  */
+	for (i = head; i < n; i++)
+	{
+		if (grub_disk_dev_read(disk, reqs[i].sector, reqs[i].size, reqs[i].buf) != GRUB_ERR_NONE)
+			return grub_errno;
+	}
+	return GRUB_ERR_NONE;
+}
+
+/* Whether the data of the disk DEV_ID/DISK_ID is stored on the disk
+   BACK_DEV/BACK_DISK, directly or through other disks.  */
+static int
+grub_disk_backed_by(unsigned long dev_id, unsigned long disk_id,
+	unsigned long back_dev, unsigned long back_disk)
+{
+	grub_disk_dev_t dev;
+	unsigned depth;
+
+	/* Bound the walk in case loopback files form a cycle.  */
+	for (depth = 0; depth < 16; depth++)
+	{
+		FOR_DISKDEVS(dev)
+		{
+			if (dev->id == dev_id)
+				break;
+		}
+		if (!dev || !dev->disk_backing
+			|| !dev->disk_backing(disk_id, &dev_id, &disk_id))
+			return 0;
+		if (dev_id == back_dev
+			&& (disk_id == GRUB_DISK_ANY_ID || disk_id == back_disk))
+			return 1;
+	}
+	return 0;
+}
+
+/* Make the cached data of the disks aliasing DISK stale: loopback disks
+   whose file lives on DISK, and the disks holding the file of DISK.
+   Partitions share the entry of their disk.  */
+static void
+grub_disk_cache_invalidate_aliases(grub_disk_t disk)
+{
+	struct grub_disk_stats* stats;
+	unsigned long dev_id = disk->dev->id;
+
+	for (stats = grub_disk_stats_list; stats; stats = stats->next)
+	{
+		if (stats->dev_id == dev_id && stats->disk_id == disk->id)
+			continue;
+		if (grub_disk_backed_by(stats->dev_id, stats->disk_id, dev_id, disk->id)
+			|| grub_disk_backed_by(dev_id, disk->id, stats->dev_id, stats->disk_id))
+			InterlockedIncrement((LONG volatile*)&stats->generation);
+	}
+}
+
+static grub_err_t
+grub_disk_dev_write(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_size_t size, const char* buf)
+{
+	grub_err_t err;
+	grub_uint64_t start;
+
+	grub_disk_cache_invalidate_aliases(disk);
+
+	if (!disk->stats)
+		return disk->dev->disk_write(disk, sector, size, buf);
+
+	start = grub_get_time_us();
+	err = disk->dev->disk_write(disk, sector, size, buf);
+	grub_disk_stats_add(&disk->stats->write_time_us, grub_get_time_us() - start);
+	grub_disk_stats_add(&disk->stats->write_requests, 1);
+	grub_disk_stats_add(&disk->stats->write_bytes, (grub_uint64_t)size << disk->log_sector_size);
+	return err;
+}
+
+static char*
+grub_disk_stats_text(void)
+{
+	struct grub_disk_stats* stats;
+	char* text;
+	char* line;
+	char* p;
+	grub_size_t len;
+
+	text = grub_xasprintf("cache %llu KiB, %u sets * %u ways\n"
+		"%-8s %10s %10s %10s %10s %14s %10s %10s %14s %10s %8s %10s %8s %8s %10s\n",
+		(unsigned long long) (grub_disk_cache_size >> 10),
+		grub_disk_cache_sets, GRUB_DISK_CACHE_WAYS,
+		"DEVICE", "HITS", "MISSES", "EVICTIONS",
+		"READS", "READ_BYTES", "READ_MS",
+		"WRITES", "WRITE_BYTES", "WRITE_MS",
+		"AGGL", "AGGL_UNITS", "AGGL_MAX", "RA", "RA_UNITS");
+	if (!text)
+		return NULL;
+
+	for (stats = grub_disk_stats_list; stats; stats = stats->next)
+	{
+		line = grub_xasprintf("%-8s %10llu %10llu %10llu %10llu %14llu %10llu %10llu %14llu %10llu %8llu %10llu %8llu %8llu %10llu\n",
+			stats->name ? stats->name : "?",
+			stats->cache_hits, stats->cache_misses, stats->cache_evictions,
+			stats->read_requests, stats->read_bytes, stats->read_time_us / 1000,
+			stats->write_requests, stats->write_bytes, stats->write_time_us / 1000,
+			stats->agglomerate_reads, stats->agglomerate_units, stats->agglomerate_max,
+			stats->readahead_reads, stats->readahead_units);
+		if (!line)
+			break;
+		len = grub_strlen(text);
+		p = grub_realloc(text, len + grub_strlen(line) + 1);
+		if (!p)
+		{
+			grub_free(line);
+			break;
+		}
+		text = p;
+		grub_strcpy(text + len, line);
+		grub_free(line);
+	}
+
+	return text;
+}
+
+void
+grub_disk_stats_print(void)
+{
+	char* text = grub_disk_stats_text();
+	if (!text)
+		return;
+	grub_printf("%s", text);
+	grub_free(text);
+}
+
+/* The contents of (proc)/diskstats, taken when the file is opened.  The
+   text is shared by all opens, so it is replaced and copied under the
+   stats lock.  */
+static grub_off_t
+grub_disk_stats_proc_read(struct grub_file* file, void* data, grub_size_t sz)
+{
+	static char* text = NULL;
+	char* old;
+	grub_size_t len;
+
+	if (!data)
+	{
+		char* fresh = grub_disk_stats_text();
+
+		AcquireSRWLockExclusive(&grub_disk_stats_lock);
+		old = text;
+		text = fresh;
+		len = text ? grub_strlen(text) : 0;
+		ReleaseSRWLockExclusive(&grub_disk_stats_lock);
+		grub_free(old);
+		return len;
+	}
+
+	grub_memset(data, 0, sz);
+	AcquireSRWLockShared(&grub_disk_stats_lock);
+	len = text ? grub_strlen(text) : 0;
+	if (file->offset < len)
+		grub_memcpy(data, text + file->offset,
+			(len - file->offset < sz) ? (grub_size_t)(len - file->offset) : sz);
+	ReleaseSRWLockShared(&grub_disk_stats_lock);
+	return len;
+}
+
 /* This function performs three tasks:
    - Make sectors disk relative from partition relative.
    - Normalize offset to be less than the sector size.
@@ -188,153 +551,536 @@ transform_sector(grub_disk_t disk, grub_disk_addr_t sector)
 	return sector >> (disk->log_sector_size - GRUB_DISK_SECTOR_BITS);
 }
 
-static unsigned
-grub_disk_cache_get_index(unsigned long dev_id, unsigned long disk_id,
-	grub_disk_addr_t sector)
+/* Read UNITS cache units at the 512B sector SECTOR into BUF, split into
+   requests of up to max_agglomerate units.  */
+static grub_err_t
+grub_disk_read_units(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_disk_addr_t units, char* buf)
 {
-	return ((dev_id * 524287UL + disk_id * 2606459UL
-		+ ((unsigned)(sector >> GRUB_DISK_CACHE_BITS)))
-		% GRUB_DISK_CACHE_NUM);
+	struct grub_disk_request reqs[GRUB_DISK_QUEUE_DEPTH_MAX];
+	grub_size_t n = 0;
+
+	while (units)
+	{
+		grub_disk_addr_t len = units;
+
+		if (len > disk->max_agglomerate)
+			len = disk->max_agglomerate;
+		if (n == GRUB_DISK_QUEUE_DEPTH_MAX)
+		{
+			if (grub_disk_read_requests(disk, reqs, n) != GRUB_ERR_NONE)
+				return grub_errno;
+			n = 0;
+		}
+		reqs[n].sector = transform_sector(disk, sector);
+		reqs[n].size = len << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS
+			- disk->log_sector_size);
+		reqs[n].buf = buf;
+		reqs[n].data = NULL;
+		n++;
+
+		sector += len << GRUB_DISK_CACHE_BITS;
+		buf += len << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS);
+		units -= len;
+	}
+
+	return grub_disk_read_requests(disk, reqs, n);
 }
 
-static void
-grub_disk_cache_invalidate(unsigned long dev_id, unsigned long disk_id,
-	grub_disk_addr_t sector)
+static int
+grub_disk_cache_alloc(void)
 {
-	unsigned cache_index;
-	struct grub_disk_cache* cache;
+	grub_uint64_t sets;
+	struct grub_disk_cache* table;
+	char* pool;
 
-	sector &= ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1);
-	cache_index = grub_disk_cache_get_index(dev_id, disk_id, sector);
-	cache = grub_disk_cache_table + cache_index;
+	if (grub_disk_cache_table)
+		return 1;
 
-	if (cache->dev_id == dev_id && cache->disk_id == disk_id
-		&& cache->sector == sector && cache->data)
+	AcquireSRWLockExclusive(&grub_disk_cache_alloc_lock);
+	if (grub_disk_cache_table)
 	{
-		cache->lock = 1;
-		grub_free(cache->data);
-		cache->data = 0;
-		cache->lock = 0;
+		ReleaseSRWLockExclusive(&grub_disk_cache_alloc_lock);
+		return 1;
+	}
+
+	sets = grub_disk_cache_size / ((grub_uint64_t)GRUB_DISK_CACHE_WAYS
+		* (GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS));
+	if (sets == 0)
+		sets = 1;
+	if (sets > GRUB_UINT_MAX / GRUB_DISK_CACHE_WAYS)
+		sets = GRUB_UINT_MAX / GRUB_DISK_CACHE_WAYS;
+
+	table = grub_calloc((grub_size_t)sets * GRUB_DISK_CACHE_WAYS,
+		sizeof(struct grub_disk_cache));
+	/* Page aligned.  The whole pool is committed here, so the full cache
+	   size is charged against the commit limit up front.  */
+	pool = VirtualAlloc(NULL,
+		((grub_size_t)sets * GRUB_DISK_CACHE_WAYS) << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS),
+		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!table || !pool)
+	{
+		/* Run without a cache rather than failing the read.  */
+		grub_free(table);
+		if (pool)
+			VirtualFree(pool, 0, MEM_RELEASE);
+		grub_errno = GRUB_ERR_NONE;
+		ReleaseSRWLockExclusive(&grub_disk_cache_alloc_lock);
+		return 0;
 	}
+	grub_disk_cache_pool = pool;
+	grub_disk_cache_sets = (unsigned)sets;
+	/* Other threads test the table without the lock.  */
+	MemoryBarrier();
+	grub_disk_cache_table = table;
+	ReleaseSRWLockExclusive(&grub_disk_cache_alloc_lock);
+	grub_dprintf("disk", "cache: %u sets * %u ways\n",
+		grub_disk_cache_sets, GRUB_DISK_CACHE_WAYS);
+	return 1;
+}
+
+grub_err_t
+grub_disk_cache_set_size(grub_uint64_t size)
+{
+	if (size < ((grub_uint64_t)GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS))
+		return grub_error(GRUB_ERR_BAD_ARGUMENT, "cache size too small");
+
+	AcquireSRWLockExclusive(&grub_disk_cache_alloc_lock);
+	grub_free(grub_disk_cache_table);
+	grub_disk_cache_table = NULL;
+	if (grub_disk_cache_pool)
+		VirtualFree(grub_disk_cache_pool, 0, MEM_RELEASE);
+	grub_disk_cache_pool = NULL;
+	grub_disk_cache_sets = 0;
+	grub_disk_cache_size = size;
+	ReleaseSRWLockExclusive(&grub_disk_cache_alloc_lock);
+
+	return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_disk_set_readahead(grub_uint64_t size)
+{
+	size >>= (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS);
+	if (size > GRUB_DISK_MAX_MAX_AGGLOMERATE)
+		return grub_error(GRUB_ERR_BAD_ARGUMENT, "readahead size too large");
+	grub_disk_readahead_max = (unsigned int)size;
+	return GRUB_ERR_NONE;
 }
 
 void
-grub_disk_cache_invalidate_all(void)
+grub_disk_set_writeback(int enable)
 {
-	unsigned i;
+	grub_disk_writeback_default = enable;
+}
 
-	for (i = 0; i < GRUB_DISK_CACHE_NUM; i++)
-	{
-		struct grub_disk_cache* cache = grub_disk_cache_table + i;
+void
+grub_disk_set_unbuffered(int enable)
+{
+	grub_disk_unbuffered_default = enable;
+}
 
-		if (cache->data && !cache->lock)
-		{
-			grub_free(cache->data);
-			cache->data = 0;
-		}
-	}
+int
+grub_disk_get_unbuffered(void)
+{
+	return grub_disk_unbuffered_default;
 }
 
-static char*
-grub_disk_cache_fetch(unsigned long dev_id, unsigned long disk_id,
-	grub_disk_addr_t sector)
+void*
+grub_disk_buffer_get(void)
 {
-	struct grub_disk_cache* cache;
-	unsigned cache_index;
+	void* buf = NULL;
+
+	AcquireSRWLockExclusive(&grub_disk_buffer_lock);
+	if (grub_disk_buffer_pool_count)
+		buf = grub_disk_buffer_pool[--grub_disk_buffer_pool_count];
+	ReleaseSRWLockExclusive(&grub_disk_buffer_lock);
+
+	/* Page aligned.  */
+	if (!buf)
+		buf = VirtualAlloc(NULL, GRUB_DISK_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	return buf;
+}
 
-	cache_index = grub_disk_cache_get_index(dev_id, disk_id, sector);
-	cache = grub_disk_cache_table + cache_index;
+void
+grub_disk_buffer_put(void* buf)
+{
+	if (!buf)
+		return;
 
-	if (cache->dev_id == dev_id && cache->disk_id == disk_id
-		&& cache->sector == sector)
+	AcquireSRWLockExclusive(&grub_disk_buffer_lock);
+	if (grub_disk_buffer_pool_count < GRUB_DISK_BUFFER_POOL_MAX)
 	{
-		cache->lock = 1;
-		return cache->data;
+		grub_disk_buffer_pool[grub_disk_buffer_pool_count++] = buf;
+		buf = NULL;
 	}
+	ReleaseSRWLockExclusive(&grub_disk_buffer_lock);
 
-	return 0;
+	if (buf)
+		VirtualFree(buf, 0, MEM_RELEASE);
 }
 
-static void
-grub_disk_cache_unlock(unsigned long dev_id, unsigned long disk_id,
+/* Return the set SECTOR maps to.  */
+static unsigned
+grub_disk_cache_set_index(unsigned long dev_id, unsigned long disk_id,
 	grub_disk_addr_t sector)
 {
-	struct grub_disk_cache* cache;
-	unsigned cache_index;
+	return ((dev_id * 524287UL + disk_id * 2606459UL
+		+ ((unsigned)(sector >> GRUB_DISK_CACHE_BITS)))
+		% grub_disk_cache_sets);
+}
 
-	cache_index = grub_disk_cache_get_index(dev_id, disk_id, sector);
-	cache = grub_disk_cache_table + cache_index;
+/* Return the lock of the shard holding the set SET_INDEX.  */
+static SRWLOCK*
+grub_disk_cache_shard(unsigned set_index)
+{
+	return &grub_disk_cache_locks[set_index % GRUB_DISK_CACHE_SHARDS];
+}
 
-	if (cache->dev_id == dev_id && cache->disk_id == disk_id
-		&& cache->sector == sector)
-		cache->lock = 0;
+/* Return the lock of the shard holding the unit CACHE.  */
+static SRWLOCK*
+grub_disk_cache_unit_shard(struct grub_disk_cache* cache)
+{
+	return grub_disk_cache_shard((unsigned)((cache - grub_disk_cache_table)
+		/ GRUB_DISK_CACHE_WAYS));
 }
 
-static grub_err_t
-grub_disk_cache_store(unsigned long dev_id, unsigned long disk_id,
-	grub_disk_addr_t sector, const char* data)
+/* Return the first unit of the set SECTOR maps to.  */
+static struct grub_disk_cache*
+grub_disk_cache_get_set(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
 {
-	unsigned cache_index;
-	struct grub_disk_cache* cache;
+	unsigned set_index;
 
-	cache_index = grub_disk_cache_get_index(dev_id, disk_id, sector);
-	cache = grub_disk_cache_table + cache_index;
+	set_index = grub_disk_cache_set_index(dev_id, disk_id, sector);
 
-	cache->lock = 1;
-	grub_free(cache->data);
-	cache->data = 0;
-	cache->lock = 0;
+	return grub_disk_cache_table + (grub_size_t)set_index * GRUB_DISK_CACHE_WAYS;
+}
 
-	cache->data = grub_malloc(GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS);
-	if (!cache->data)
-		return grub_errno;
+/* Find the unit holding SECTOR, or NULL.  The shard lock must be held.  */
+static struct grub_disk_cache*
+grub_disk_cache_lookup(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
+{
+	struct grub_disk_cache* cache;
+	unsigned i;
 
-	grub_memcpy(cache->data, data,
-		GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS);
-	cache->dev_id = dev_id;
-	cache->disk_id = disk_id;
-	cache->sector = sector;
+	cache = grub_disk_cache_get_set(dev_id, disk_id, sector);
+	for (i = 0; i < GRUB_DISK_CACHE_WAYS; i++, cache++)
+	{
+		if (cache->data && cache->dev_id == dev_id
+			&& cache->disk_id == disk_id && cache->sector == sector)
+			return cache;
+	}
 
-	return GRUB_ERR_NONE;
+	return NULL;
 }
 
-static const char*
-find_part_sep(const char* name)
+/* Drop the unit holding SECTOR.  A unit being filled for it is dropped when
+   the fill completes.  The shard lock must be held exclusively.  */
+static void
+grub_disk_cache_drop(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
 {
-	const char* p = name;
-	char c;
+	struct grub_disk_cache* cache;
+	unsigned i;
 
-	while ((c = *p++) != '\0')
+	cache = grub_disk_cache_get_set(dev_id, disk_id, sector);
+	for (i = 0; i < GRUB_DISK_CACHE_WAYS; i++, cache++)
 	{
-		if (c == '\\' && *p == ',')
-			p++;
-		else if (c == ',')
-			return p - 1;
+		if (cache->dev_id != dev_id || cache->disk_id != disk_id
+			|| cache->sector != sector)
+			continue;
+		cache->data = 0;
+		if (cache->lock)
+			cache->dropped = 1;
 	}
-	return NULL;
 }
 
-grub_disk_t
-grub_disk_open(const char* name)
+static void
+grub_disk_cache_invalidate(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
 {
-	const char* p;
-	grub_disk_t disk;
-	char* raw = (char*)name;
-	grub_uint64_t current_time;
-	grub_disk_dev_t dev;
+	SRWLOCK* lock;
 
-	if (!name)
-		return 0;
+	if (!grub_disk_cache_table)
+		return;
 
-	grub_dprintf("disk", "Opening %s...\n", name);
+	sector &= ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1);
+	lock = grub_disk_cache_shard(grub_disk_cache_set_index(dev_id, disk_id, sector));
+	AcquireSRWLockExclusive(lock);
+	grub_disk_cache_drop(dev_id, disk_id, sector);
+	ReleaseSRWLockExclusive(lock);
+}
 
-	disk = (grub_disk_t)grub_zalloc(sizeof(*disk));
-	if (!disk)
-		return 0;
-	disk->log_sector_size = GRUB_DISK_SECTOR_BITS;
-	/* Default 1MiB of maximum agglomerate.  */
+void
+grub_disk_cache_invalidate_all(void)
+{
+	struct grub_disk_stats* stats;
+
+	AcquireSRWLockShared(&grub_disk_stats_lock);
+	for (stats = grub_disk_stats_list; stats; stats = stats->next)
+		InterlockedIncrement((LONG volatile*)&stats->generation);
+	ReleaseSRWLockShared(&grub_disk_stats_lock);
+}
+
+static grub_uint32_t
+grub_disk_cache_generation(unsigned long dev_id, unsigned long disk_id)
+{
+	struct grub_disk_stats* stats = grub_disk_stats_get(dev_id, disk_id);
+
+	return stats ? stats->generation : 0;
+}
+
+/* Copy SIZE bytes from byte OFFSET of the unit of SECTOR into BUF.  Return
+   0 if the unit is not cached or is stale.  */
+static int
+grub_disk_cache_read(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector, grub_size_t offset, grub_size_t size, void* buf)
+{
+	struct grub_disk_cache* cache;
+	struct grub_disk_stats* stats;
+	SRWLOCK* lock;
+	int hit = 0;
+
+	stats = grub_disk_stats_get(dev_id, disk_id);
+	if (grub_disk_cache_table)
+	{
+		lock = grub_disk_cache_shard(grub_disk_cache_set_index(dev_id, disk_id, sector));
+		AcquireSRWLockShared(lock);
+		cache = grub_disk_cache_lookup(dev_id, disk_id, sector);
+		if (cache && (!stats || cache->generation == stats->generation))
+		{
+			grub_memcpy(buf, cache->data + offset, size);
+			InterlockedExchange64((LONG64 volatile*)&cache->last_use,
+				InterlockedIncrement64((LONG64 volatile*)&grub_disk_cache_clock));
+			hit = 1;
+		}
+		ReleaseSRWLockShared(lock);
+	}
+
+	if (stats)
+		grub_disk_stats_add(hit ? &stats->cache_hits : &stats->cache_misses, 1);
+	return hit;
+}
+
+/* Return whether the unit of SECTOR is cached.  */
+static int
+grub_disk_cache_contains(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
+{
+	struct grub_disk_cache* cache;
+	SRWLOCK* lock;
+	int found;
+
+	if (!grub_disk_cache_table)
+		return 0;
+
+	lock = grub_disk_cache_shard(grub_disk_cache_set_index(dev_id, disk_id, sector));
+	AcquireSRWLockShared(lock);
+	cache = grub_disk_cache_lookup(dev_id, disk_id, sector);
+	found = (cache && cache->generation == grub_disk_cache_generation(dev_id, disk_id));
+	ReleaseSRWLockShared(lock);
+	return found;
+}
+
+/* Copy SIZE bytes of BUF to byte OFFSET of the unit of SECTOR, if cached.  */
+static void
+grub_disk_cache_write(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector, grub_size_t offset, grub_size_t size, const char* buf)
+{
+	struct grub_disk_cache* cache;
+	SRWLOCK* lock;
+	unsigned i;
+
+	if (!grub_disk_cache_table)
+		return;
+
+	lock = grub_disk_cache_shard(grub_disk_cache_set_index(dev_id, disk_id, sector));
+	AcquireSRWLockExclusive(lock);
+	cache = grub_disk_cache_get_set(dev_id, disk_id, sector);
+	for (i = 0; i < GRUB_DISK_CACHE_WAYS; i++, cache++)
+	{
+		if (cache->dev_id != dev_id || cache->disk_id != disk_id
+			|| cache->sector != sector)
+			continue;
+		/* A fill in flight may have read the old data.  */
+		if (cache->lock)
+			cache->dropped = 1;
+		else if (cache->data)
+			grub_memcpy(cache->data + offset, buf, size);
+	}
+	ReleaseSRWLockExclusive(lock);
+}
+
+/* Pick the unit of the set SECTOR maps to that should receive it: the unit
+   already holding it, a free unit or the least recently used one.  */
+static struct grub_disk_cache*
+grub_disk_cache_victim(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
+{
+	struct grub_disk_cache* cache;
+	struct grub_disk_cache* victim = NULL;
+	unsigned i;
+
+	cache = grub_disk_cache_get_set(dev_id, disk_id, sector);
+	for (i = 0; i < GRUB_DISK_CACHE_WAYS; i++, cache++)
+	{
+		if (cache->lock)
+		{
+			/* Another thread is already reading it.  */
+			if (cache->dev_id == dev_id && cache->disk_id == disk_id
+				&& cache->sector == sector)
+				return NULL;
+			continue;
+		}
+		if (cache->data && cache->dev_id == dev_id
+			&& cache->disk_id == disk_id && cache->sector == sector)
+			return cache;
+		if (!cache->data)
+		{
+			if (!victim || victim->data)
+				victim = cache;
+		}
+		else if (!victim || (victim->data && cache->last_use < victim->last_use))
+			victim = cache;
+	}
+
+	return victim;
+}
+
+/* Return the buffer of the pool backing CACHE.  */
+static char*
+grub_disk_cache_buffer(struct grub_disk_cache* cache)
+{
+	return grub_disk_cache_pool + ((grub_size_t)(cache - grub_disk_cache_table)
+		<< (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS));
+}
+
+/* Take a unit for SECTOR out of its set and lock it, so that the caller can
+   fill grub_disk_cache_buffer() directly.  The old contents of the unit are
+   dropped.  Return NULL if there is no unit available, or if another thread
+   is filling the unit of SECTOR.  */
+static struct grub_disk_cache*
+grub_disk_cache_reserve(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
+{
+	struct grub_disk_cache* cache;
+	grub_uint32_t generation;
+	SRWLOCK* lock;
+
+	if (!grub_disk_cache_alloc())
+		return NULL;
+
+	/* Taken before the device is read, so that a change of the device
+	   during the read makes the unit stale.  */
+	generation = grub_disk_cache_generation(dev_id, disk_id);
+
+	lock = grub_disk_cache_shard(grub_disk_cache_set_index(dev_id, disk_id, sector));
+	AcquireSRWLockExclusive(lock);
+	cache = grub_disk_cache_victim(dev_id, disk_id, sector);
+	if (cache)
+	{
+		if (cache->data && (cache->dev_id != dev_id || cache->disk_id != disk_id
+			|| cache->sector != sector))
+		{
+			struct grub_disk_stats* stats = grub_disk_stats_get(dev_id, disk_id);
+			if (stats)
+				grub_disk_stats_add(&stats->cache_evictions, 1);
+		}
+
+		cache->dev_id = dev_id;
+		cache->disk_id = disk_id;
+		cache->sector = sector;
+		cache->generation = generation;
+		cache->data = 0;
+		cache->dropped = 0;
+		cache->lock = 1;
+	}
+	ReleaseSRWLockExclusive(lock);
+	return cache;
+}
+
+/* Publish a unit filled after grub_disk_cache_reserve.  */
+static void
+grub_disk_cache_commit(struct grub_disk_cache* cache)
+{
+	SRWLOCK* lock = grub_disk_cache_unit_shard(cache);
+
+	AcquireSRWLockExclusive(lock);
+	if (!cache->dropped)
+	{
+		cache->data = grub_disk_cache_buffer(cache);
+		cache->last_use = InterlockedIncrement64((LONG64 volatile*)&grub_disk_cache_clock);
+	}
+	cache->lock = 0;
+	ReleaseSRWLockExclusive(lock);
+}
+
+/* Give back a reserved unit without publishing it.  */
+static void
+grub_disk_cache_release(struct grub_disk_cache* cache)
+{
+	SRWLOCK* lock = grub_disk_cache_unit_shard(cache);
+
+	AcquireSRWLockExclusive(lock);
+	cache->lock = 0;
+	ReleaseSRWLockExclusive(lock);
+}
+
+static void
+grub_disk_cache_store(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector, const char* data)
+{
+	struct grub_disk_cache* cache;
+
+	cache = grub_disk_cache_reserve(dev_id, disk_id, sector);
+	if (!cache)
+		return;
+
+	grub_memcpy(grub_disk_cache_buffer(cache), data,
+		GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS);
+	grub_disk_cache_commit(cache);
+}
+
+static const char*
+find_part_sep(const char* name)
+{
+	const char* p = name;
+	char c;
+
+	while ((c = *p++) != '\0')
+	{
+		if (c == '\\' && *p == ',')
+			p++;
+		else if (c == ',')
+			return p - 1;
+	}
+	return NULL;
+}
+
+grub_disk_t
+grub_disk_open(const char* name)
+{
+	const char* p;
+	grub_disk_t disk;
+	char* raw = (char*)name;
+	grub_disk_dev_t dev;
+
+	if (!name)
+		return 0;
+
+	grub_dprintf("disk", "Opening %s...\n", name);
+
+	disk = (grub_disk_t)grub_zalloc(sizeof(*disk));
+	if (!disk)
+		return 0;
+	disk->log_sector_size = GRUB_DISK_SECTOR_BITS;
+	/* Default 1MiB of maximum agglomerate.  */
 	disk->max_agglomerate = 1048576 >> (GRUB_DISK_SECTOR_BITS
 		+ GRUB_DISK_CACHE_BITS);
+	/* No unit was read yet, so the first read doesn't count as sequential.  */
+	disk->ra_last = GRUB_DISK_RA_NONE;
 
 	p = find_part_sep(name);
 	if (p)
@@ -379,6 +1125,30 @@ grub_disk_open(const char* name)
 	}
 
 	disk->dev = dev;
+	disk->writeback = grub_disk_writeback_default;
+	disk->unbuffered = grub_disk_unbuffered_default;
+
+	disk->stats = grub_disk_stats_get(dev->id, disk->id);
+	if (disk->stats && !disk->stats->name)
+		disk->stats->name = grub_strdup(disk->name);
+
+	/* Keep what is cached of the device unless it changed since it was
+	   last opened.  */
+	if (disk->stats)
+	{
+		grub_uint64_t media_id = dev->disk_media_id ? dev->disk_media_id(disk) : 0;
+
+		if (disk->stats->total_sectors != disk->total_sectors
+			|| disk->stats->log_sector_size != disk->log_sector_size
+			|| disk->stats->media_id != media_id)
+		{
+			grub_dprintf("disk", "%s changed, dropping its cache\n", disk->name);
+			InterlockedIncrement((LONG volatile*)&disk->stats->generation);
+			disk->stats->total_sectors = disk->total_sectors;
+			disk->stats->log_sector_size = disk->log_sector_size;
+			disk->stats->media_id = media_id;
+		}
+	}
 
 	if (p)
 	{
@@ -392,16 +1162,6 @@ grub_disk_open(const char* name)
 		}
 	}
 
-	/* The cache will be invalidated about 2 seconds after a device was
-	   closed.  */
-	current_time = grub_get_time_ms();
-
-	if (current_time > (grub_last_time
-		+ GRUB_CACHE_TIMEOUT * 1000))
-		grub_disk_cache_invalidate_all();
-
-	grub_last_time = current_time;
-
 fail:
 
 	if (raw && raw != name)
@@ -426,22 +1186,100 @@ grub_disk_close(grub_disk_t disk)
 	grub_partition_t part;
 	grub_dprintf("disk", "Closing %s.\n", disk->name);
 
+	if (disk->dev && disk->wb_len)
+		grub_disk_sync(disk);
+
 	if (disk->dev && disk->dev->disk_close)
 		(disk->dev->disk_close) (disk);
 
-	/* Reset the timer.  */
-	grub_last_time = grub_get_time_ms();
-
 	while (disk->partition)
 	{
 		part = disk->partition->parent;
 		grub_free(disk->partition);
 		disk->partition = part;
 	}
+	grub_free(disk->ra_buf);
+	grub_free(disk->wb_buf);
 	grub_free((void*)disk->name);
 	grub_free(disk);
 }
 
+/* Read ahead from the cache unit SECTOR, which missed the cache, while a
+   sequential stream is detected.  The window doubles on each miss of the
+   stream, up to grub_disk_readahead_max and disk->max_agglomerate, and stops
+   at the first unit that is already cached.  All units read are stored in
+   the cache.  Return the number of units read, 0 if nothing was read ahead.  */
+static unsigned int
+grub_disk_readahead(grub_disk_t disk, grub_disk_addr_t sector)
+{
+	unsigned int window, n, i;
+	grub_disk_addr_t total;
+
+	if (!disk->ra_seq || disk->unbuffered)
+	{
+		disk->ra_window = 0;
+		return 0;
+	}
+
+	window = disk->ra_window ? disk->ra_window << 1 : 2;
+	if (window > grub_disk_readahead_max)
+		window = grub_disk_readahead_max;
+	if (window > disk->max_agglomerate)
+		window = disk->max_agglomerate;
+	disk->ra_window = window;
+
+	if (disk->total_sectors != GRUB_DISK_SIZE_UNKNOWN)
+	{
+		total = disk->total_sectors << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS);
+		if (sector >= total)
+			return 0;
+		if (((total - sector) >> GRUB_DISK_CACHE_BITS) < window)
+			window = (unsigned int)((total - sector) >> GRUB_DISK_CACHE_BITS);
+	}
+
+	for (n = 1; n < window; n++)
+	{
+		if (grub_disk_cache_contains(disk->dev->id, disk->id,
+			sector + ((grub_disk_addr_t)n << GRUB_DISK_CACHE_BITS)))
+			break;
+	}
+	if (n < 2)
+		return 0;
+
+	if (disk->ra_buf_size < n)
+	{
+		grub_free(disk->ra_buf);
+		disk->ra_buf_size = 0;
+		disk->ra_buf = grub_malloc((grub_size_t)window << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS));
+		if (!disk->ra_buf)
+			return 0;
+		disk->ra_buf_size = window;
+	}
+
+	if (grub_disk_dev_read(disk, transform_sector(disk, sector),
+		(grub_size_t)n << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS - disk->log_sector_size),
+		disk->ra_buf) != GRUB_ERR_NONE)
+	{
+		grub_errno = GRUB_ERR_NONE;
+		return 0;
+	}
+
+	if (disk->stats)
+	{
+		grub_disk_stats_add(&disk->stats->readahead_reads, 1);
+		grub_disk_stats_add(&disk->stats->readahead_units, n);
+	}
+
+	for (i = 0; i < n; i++)
+		grub_disk_cache_store(disk->dev->id, disk->id,
+			sector + ((grub_disk_addr_t)i << GRUB_DISK_CACHE_BITS),
+			disk->ra_buf + ((grub_size_t)i << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS)));
+
+	grub_dprintf("disk", "readahead %s sector 0x%llx units %u\n", disk->name,
+		(unsigned long long) sector, n);
+	return n;
+}
+
 /* Small read (less than cache size and not pass across cache unit boundaries).
    sector is already adjusted and is divisible by cache unit size.
  */
@@ -449,44 +1287,43 @@ static grub_err_t
 grub_disk_read_small_real(grub_disk_t disk, grub_disk_addr_t sector,
 	grub_off_t offset, grub_size_t size, void* buf)
 {
-	char* data;
 	char* tmp_buf;
+	struct grub_disk_cache* cache;
 
 	/* Fetch the cache.  */
-	data = grub_disk_cache_fetch(disk->dev->id, disk->id, sector);
-	if (data)
+	if (grub_disk_cache_read(disk->dev->id, disk->id, sector, offset, size, buf))
+		return GRUB_ERR_NONE;
+
+	/* Read a whole window if this continues a sequential stream.  */
+	if (grub_disk_readahead(disk, sector))
 	{
-		/* Just copy it!  */
-		grub_memcpy(buf, data + offset, size);
-		grub_disk_cache_unlock(disk->dev->id, disk->id, sector);
+		grub_memcpy(buf, disk->ra_buf + offset, size);
 		return GRUB_ERR_NONE;
 	}
 
-	/* Allocate a temporary buffer.  */
-	tmp_buf = grub_malloc(GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS);
-	if (!tmp_buf)
-		return grub_errno;
-
-	/* Otherwise read data from the disk actually.  */
+	/* Otherwise read data from the disk actually, straight into a unit of
+	   the cache.  */
 	if (disk->total_sectors == GRUB_DISK_SIZE_UNKNOWN
 		|| sector + GRUB_DISK_CACHE_SIZE
 		< (disk->total_sectors << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS)))
 	{
-		grub_err_t err;
-		err = disk->dev->disk_read(disk, transform_sector(disk, sector),
-			1ULL << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS - disk->log_sector_size), tmp_buf);
-		if (!err)
+		cache = grub_disk_cache_reserve(disk->dev->id, disk->id, sector);
+		if (cache)
 		{
-			/* Copy it and store it in the disk cache.  */
-			grub_memcpy(buf, tmp_buf + offset, size);
-			grub_disk_cache_store(disk->dev->id, disk->id,
-				sector, tmp_buf);
-			grub_free(tmp_buf);
-			return GRUB_ERR_NONE;
+			grub_err_t err;
+			tmp_buf = grub_disk_cache_buffer(cache);
+			err = grub_disk_dev_read(disk, transform_sector(disk, sector),
+				1ULL << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS - disk->log_sector_size), tmp_buf);
+			if (!err)
+			{
+				grub_memcpy(buf, tmp_buf + offset, size);
+				grub_disk_cache_commit(cache);
+				return GRUB_ERR_NONE;
+			}
+			grub_disk_cache_release(cache);
 		}
 	}
 
-	grub_free(tmp_buf);
 	grub_errno = GRUB_ERR_NONE;
 
 	{
@@ -507,7 +1344,7 @@ grub_disk_read_small_real(grub_disk_t disk, grub_disk_addr_t sector,
 		if (!tmp_buf)
 			return grub_errno;
 
-		if (disk->dev->disk_read(disk, transform_sector(disk, aligned_sector),
+		if (grub_disk_dev_read(disk, transform_sector(disk, aligned_sector),
 			num, tmp_buf))
 		{
 			grub_error_push();
@@ -522,6 +1359,30 @@ grub_disk_read_small_real(grub_disk_t disk, grub_disk_addr_t sector,
 	}
 }
 
+/* Call the read hook of DISK for SIZE bytes read at byte OFFSET of the
+   sector SECTOR, a cache unit at most at a time, since the hook takes an
+   unsigned length.  */
+static void
+grub_disk_call_read_hook(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_off_t offset, grub_size_t size, char* buf)
+{
+	grub_uint64_t pos = (sector << GRUB_DISK_SECTOR_BITS) + offset;
+	grub_size_t len;
+
+	while (size)
+	{
+		len = GRUB_DISK_CACHE_SIZE << GRUB_DISK_SECTOR_BITS;
+		if (len > size)
+			len = size;
+		(disk->read_hook) (pos >> GRUB_DISK_SECTOR_BITS,
+			(unsigned)(pos & (GRUB_DISK_SECTOR_SIZE - 1)), (unsigned)len,
+			buf, disk->read_hook_data);
+		pos += len;
+		buf += len;
+		size -= len;
+	}
+}
+
 static grub_err_t
 grub_disk_read_small(grub_disk_t disk, grub_disk_addr_t sector,
 	grub_off_t offset, grub_size_t size, void* buf)
@@ -538,21 +1399,87 @@ grub_disk_read_small(grub_disk_t disk, grub_disk_addr_t sector,
 	return err;
 }
 
-/* Read data from the disk.  */
-grub_err_t
-grub_disk_read(grub_disk_t disk, grub_disk_addr_t sector,
+/* Read from a disk mapped in memory.  SECTOR is already adjusted.  */
+static grub_err_t
+grub_disk_read_mapped(grub_disk_t disk, grub_disk_addr_t sector,
 	grub_off_t offset, grub_size_t size, void* buf)
 {
-	/* First of all, check if the region is within the disk.  */
-	if (grub_disk_adjust_range(disk, &sector, &offset, size) != GRUB_ERR_NONE)
+	grub_uint64_t pos = (sector << GRUB_DISK_SECTOR_BITS) + offset;
+	grub_size_t len = 0;
+
+	if (pos < disk->map_size)
 	{
-		grub_error_push();
-		grub_dprintf("disk", "Read out of range: sector 0x%llx (%s).\n",
-			(unsigned long long) sector, grub_errmsg);
-		grub_error_pop();
-		return grub_errno;
+		len = size;
+		if (len > disk->map_size - pos)
+			len = (grub_size_t)(disk->map_size - pos);
+		/* A page of the view can fail to load, e.g. if the file shrank.  */
+		__try
+		{
+			grub_memcpy(buf, disk->map + pos, len);
+		}
+		__except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ?
+			EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+		{
+			return grub_error(GRUB_ERR_READ_ERROR, "failure reading sector 0x%llx from %s",
+				(unsigned long long) sector, disk->name);
+		}
+	}
+	/* The end of the last sector past the end of the data reads as zeros.  */
+	if (len < size)
+		grub_memset((char*)buf + len, 0, size - len);
+
+	if (disk->stats)
+	{
+		grub_disk_stats_add(&disk->stats->read_requests, 1);
+		grub_disk_stats_add(&disk->stats->read_bytes, size);
+	}
+
+	if (disk->read_hook)
+		grub_disk_call_read_hook(disk, sector, offset, size, buf);
+
+	return GRUB_ERR_NONE;
+}
+
+/* Copy the part of the write-back buffer overlapping the SIZE bytes read
+   at byte POS of the disk into BUF.  Dirty data stays private to the
+   handle that wrote it until it is flushed.  */
+static void
+grub_disk_writeback_overlay(grub_disk_t disk, grub_uint64_t pos,
+	grub_size_t size, void* buf)
+{
+	grub_uint64_t start = disk->wb_sector << GRUB_DISK_SECTOR_BITS;
+	grub_uint64_t end = start + disk->wb_len;
+	grub_uint64_t from, to;
+
+	if (!disk->wb_len || pos >= end || pos + size <= start)
+		return;
+	from = (pos > start) ? pos : start;
+	to = (pos + size < end) ? pos + size : end;
+	grub_memcpy((char*)buf + (from - pos), disk->wb_buf + (from - start),
+		(grub_size_t)(to - from));
+}
+
+/* Read from the device or the cache.  SECTOR is already adjusted.  */
+static grub_err_t
+grub_disk_read_real(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_off_t offset, grub_size_t size, void* buf)
+{
+	if (disk->map)
+		return grub_disk_read_mapped(disk, sector, offset, size, buf);
+
+	/* Track sequential access: the stream goes on if this read starts in
+	   the last cache unit read or in the one following it.  */
+	{
+		grub_disk_addr_t first, last;
+
+		first = sector & ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1);
+		last = (sector + ((offset + size + GRUB_DISK_SECTOR_SIZE - 1) >> GRUB_DISK_SECTOR_BITS) - 1)
+			& ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1);
+		disk->ra_seq = (first == disk->ra_last
+			|| first == disk->ra_last + GRUB_DISK_CACHE_SIZE);
+		if (size)
+			disk->ra_last = last;
 	}
-	grub_dprintf("disk", "disk read %s sector 0x%llx+0x%llx size 0x%llx\n", disk->name, sector, offset, size);
 	/* First read until first cache boundary.   */
 	if (offset || (sector & (GRUB_DISK_CACHE_SIZE - 1)))
 	{
@@ -581,47 +1508,47 @@ grub_disk_read(grub_disk_t disk, grub_disk_addr_t sector,
 	/* Until SIZE is zero...  */
 	while (size >= (GRUB_DISK_CACHE_SIZE << GRUB_DISK_SECTOR_BITS))
 	{
-		char* data = NULL;
-		grub_disk_addr_t agglomerate;
+		grub_disk_addr_t agglomerate, agglomerate_max;
 		grub_err_t err;
+		int cached = 0;
+
+		/* Devices with asynchronous reads get several requests at once.  */
+		agglomerate_max = disk->max_agglomerate;
+		if (disk->dev->disk_submit)
+			agglomerate_max *= grub_disk_queue_depth;
 
 		/* agglomerate read until we find a first cached entry.  */
 		for (agglomerate = 0; agglomerate
 			< (size >> (GRUB_DISK_SECTOR_BITS + GRUB_DISK_CACHE_BITS))
-			&& agglomerate < disk->max_agglomerate;
+			&& agglomerate < agglomerate_max;
 			agglomerate++)
 		{
-			data = grub_disk_cache_fetch(disk->dev->id, disk->id,
+			cached = grub_disk_cache_read(disk->dev->id, disk->id,
 				sector + (agglomerate
-					<< GRUB_DISK_CACHE_BITS));
-			if (data)
+					<< GRUB_DISK_CACHE_BITS), 0,
+				GRUB_DISK_CACHE_SIZE << GRUB_DISK_SECTOR_BITS,
+				(char*)buf + (agglomerate << (GRUB_DISK_CACHE_BITS
+					+ GRUB_DISK_SECTOR_BITS)));
+			if (cached)
 				break;
 		}
 
-		if (data)
-		{
-			grub_memcpy((char*)buf
-				+ (agglomerate << (GRUB_DISK_CACHE_BITS
-					+ GRUB_DISK_SECTOR_BITS)),
-				data, GRUB_DISK_CACHE_SIZE << GRUB_DISK_SECTOR_BITS);
-			grub_disk_cache_unlock(disk->dev->id, disk->id,
-				sector + (agglomerate
-					<< GRUB_DISK_CACHE_BITS));
-		}
-
 		if (agglomerate)
 		{
 			grub_disk_addr_t i;
 
-			err = disk->dev->disk_read(disk, transform_sector(disk, sector),
-				agglomerate << (GRUB_DISK_CACHE_BITS
-					+ GRUB_DISK_SECTOR_BITS
-					- disk->log_sector_size),
-				buf);
+			if (disk->stats)
+			{
+				grub_disk_stats_add(&disk->stats->agglomerate_reads, 1);
+				grub_disk_stats_add(&disk->stats->agglomerate_units, agglomerate);
+				grub_disk_stats_max(&disk->stats->agglomerate_max, agglomerate);
+			}
+
+			err = grub_disk_read_units(disk, sector, agglomerate, buf);
 			if (err)
 				return err;
 
-			for (i = 0; i < agglomerate; i++)
+			for (i = 0; i < agglomerate && !disk->unbuffered; i++)
 				grub_disk_cache_store(disk->dev->id, disk->id,
 					sector + (i << GRUB_DISK_CACHE_BITS),
 					(char*)buf
@@ -640,7 +1567,7 @@ grub_disk_read(grub_disk_t disk, grub_disk_addr_t sector,
 				+ (agglomerate << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS));
 		}
 
-		if (data)
+		if (cached)
 		{
 			if (disk->read_hook)
 				(disk->read_hook) (sector, 0, (GRUB_DISK_CACHE_SIZE << GRUB_DISK_SECTOR_BITS),
@@ -663,6 +1590,524 @@ grub_disk_read(grub_disk_t disk, grub_disk_addr_t sector,
 	return grub_errno;
 }
 
+grub_err_t
+grub_disk_read(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_off_t offset, grub_size_t size, void* buf)
+{
+	/* First of all, check if the region is within the disk.  */
+	if (grub_disk_adjust_range(disk, &sector, &offset, size) != GRUB_ERR_NONE)
+	{
+		grub_error_push();
+		grub_dprintf("disk", "Read out of range: sector 0x%llx (%s).\n",
+			(unsigned long long) sector, grub_errmsg);
+		grub_error_pop();
+		return grub_errno;
+	}
+	grub_dprintf("disk", "disk read %s sector 0x%llx+0x%llx size 0x%llx\n", disk->name, sector, offset, size);
+
+	if (grub_disk_read_real(disk, sector, offset, size, buf) != GRUB_ERR_NONE)
+		return grub_errno;
+
+	/* Dirty data of this handle isn't on the device yet.  */
+	grub_disk_writeback_overlay(disk, (sector << GRUB_DISK_SECTOR_BITS) + offset, size, buf);
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_disk_dev_readv(grub_disk_t disk, const struct grub_disk_range* ranges,
+	grub_size_t n)
+{
+	grub_err_t err;
+	grub_uint64_t start;
+	grub_size_t i;
+
+	if (!disk->stats)
+		return disk->dev->disk_readv(disk, ranges, n);
+
+	start = grub_get_time_us();
+	err = disk->dev->disk_readv(disk, ranges, n);
+	grub_disk_stats_add(&disk->stats->read_time_us, grub_get_time_us() - start);
+	grub_disk_stats_add(&disk->stats->read_requests, 1);
+	for (i = 0; i < n; i++)
+		grub_disk_stats_add(&disk->stats->read_bytes, ranges[i].size);
+	return err;
+}
+
+/* A piece of a range waiting for the data of a pending run.  */
+struct grub_disk_readv_piece
+{
+	char* dest;
+	grub_size_t offset;
+	grub_size_t len;
+};
+
+/* Context for grub_disk_readv.  */
+struct grub_disk_readv_ctx
+{
+	grub_disk_t disk;
+
+	/* Runs of consecutive cache units to be read from the device.  SECTOR
+	   is the first unit, SIZE is in bytes and BUF points into BUF below.  */
+	struct grub_disk_range* runs;
+	grub_size_t nruns;
+	grub_size_t max_runs;
+
+	char* buf;
+	grub_size_t buf_size;
+	grub_size_t buf_used;
+
+	struct grub_disk_readv_piece* pieces;
+	grub_size_t npieces;
+	grub_size_t max_pieces;
+};
+
+static int
+grub_disk_range_cmp(const void* p1, const void* p2)
+{
+	const struct grub_disk_range* r1 = p1;
+	const struct grub_disk_range* r2 = p2;
+	grub_uint64_t pos1 = (r1->sector << GRUB_DISK_SECTOR_BITS) + r1->offset;
+	grub_uint64_t pos2 = (r2->sector << GRUB_DISK_SECTOR_BITS) + r2->offset;
+
+	return (pos1 > pos2) - (pos1 < pos2);
+}
+
+/* Read all pending runs, store them in the cache and hand the pieces over.  */
+static grub_err_t
+grub_disk_readv_flush(struct grub_disk_readv_ctx* ctx)
+{
+	grub_disk_t disk = ctx->disk;
+	grub_size_t i;
+	grub_disk_addr_t j;
+
+	if (!ctx->nruns)
+		return GRUB_ERR_NONE;
+
+	if (disk->dev->disk_readv)
+	{
+		for (i = 0; i < ctx->nruns; i++)
+			ctx->runs[i].sector = transform_sector(disk, ctx->runs[i].sector);
+		if (grub_disk_dev_readv(disk, ctx->runs, ctx->nruns) != GRUB_ERR_NONE)
+			return grub_errno;
+		for (i = 0; i < ctx->nruns; i++)
+			ctx->runs[i].sector = grub_disk_from_native_sector(disk, ctx->runs[i].sector);
+	}
+	else
+	{
+		struct grub_disk_request* reqs;
+
+		reqs = grub_calloc(ctx->nruns, sizeof(*reqs));
+		if (!reqs)
+			return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+		for (i = 0; i < ctx->nruns; i++)
+		{
+			reqs[i].sector = transform_sector(disk, ctx->runs[i].sector);
+			reqs[i].size = ctx->runs[i].size >> disk->log_sector_size;
+			reqs[i].buf = ctx->runs[i].buf;
+		}
+		grub_disk_read_requests(disk, reqs, ctx->nruns);
+		grub_free(reqs);
+		if (grub_errno != GRUB_ERR_NONE)
+			return grub_errno;
+	}
+
+	for (i = 0; i < ctx->nruns && !disk->unbuffered; i++)
+	{
+		for (j = 0; j < (ctx->runs[i].size >> (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS)); j++)
+			grub_disk_cache_store(disk->dev->id, disk->id,
+				ctx->runs[i].sector + (j << GRUB_DISK_CACHE_BITS),
+				(char*)ctx->runs[i].buf + (j << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS)));
+	}
+
+	for (i = 0; i < ctx->npieces; i++)
+		grub_memcpy(ctx->pieces[i].dest, ctx->buf + ctx->pieces[i].offset,
+			ctx->pieces[i].len);
+
+	ctx->nruns = 0;
+	ctx->npieces = 0;
+	ctx->buf_used = 0;
+	return GRUB_ERR_NONE;
+}
+
+/* Make the cache unit UNIT part of a pending run and queue LEN bytes of it,
+   from byte OFFSET, to be copied into DEST.  */
+static grub_err_t
+grub_disk_readv_queue(struct grub_disk_readv_ctx* ctx, grub_disk_addr_t unit,
+	grub_size_t offset, grub_size_t len, char* dest)
+{
+	const grub_size_t unit_size = GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS;
+	struct grub_disk_range* run = NULL;
+	grub_size_t pos;
+	grub_size_t i;
+
+	/* Ranges are sorted, so UNIT can only be in one of the last runs.  */
+	for (i = ctx->nruns; i > 0; i--)
+	{
+		run = &ctx->runs[i - 1];
+		if (unit >= run->sector
+			&& unit < run->sector + ((run->size / unit_size) << GRUB_DISK_CACHE_BITS))
+			break;
+		if (unit > run->sector)
+		{
+			i = 0;
+			break;
+		}
+	}
+
+	if (i)
+		pos = ((char*)run->buf - ctx->buf) + (grub_size_t)(((unit - run->sector) >> GRUB_DISK_CACHE_BITS) * unit_size);
+	else
+	{
+		if (ctx->buf_used + unit_size > ctx->buf_size)
+		{
+			if (grub_disk_readv_flush(ctx) != GRUB_ERR_NONE)
+				return grub_errno;
+		}
+
+		run = ctx->nruns ? &ctx->runs[ctx->nruns - 1] : NULL;
+		if (run && unit == run->sector + ((run->size / unit_size) << GRUB_DISK_CACHE_BITS)
+			&& run->size / unit_size < ctx->disk->max_agglomerate)
+			run->size += unit_size;
+		else
+		{
+			if (ctx->nruns == ctx->max_runs)
+			{
+				grub_size_t max = ctx->max_runs ? ctx->max_runs * 2 : 16;
+				struct grub_disk_range* runs = grub_realloc(ctx->runs, max * sizeof(*runs));
+				if (!runs)
+					return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+				ctx->runs = runs;
+				ctx->max_runs = max;
+			}
+			run = &ctx->runs[ctx->nruns++];
+			run->sector = unit;
+			run->offset = 0;
+			run->size = unit_size;
+			run->buf = ctx->buf + ctx->buf_used;
+		}
+		pos = ctx->buf_used;
+		ctx->buf_used += unit_size;
+	}
+
+	if (ctx->npieces == ctx->max_pieces)
+	{
+		grub_size_t max = ctx->max_pieces ? ctx->max_pieces * 2 : 64;
+		struct grub_disk_readv_piece* pieces = grub_realloc(ctx->pieces, max * sizeof(*pieces));
+		if (!pieces)
+			return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+		ctx->pieces = pieces;
+		ctx->max_pieces = max;
+	}
+	ctx->pieces[ctx->npieces].dest = dest;
+	ctx->pieces[ctx->npieces].offset = pos + offset;
+	ctx->pieces[ctx->npieces].len = len;
+	ctx->npieces++;
+
+	return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_disk_readv(grub_disk_t disk, const struct grub_disk_range* ranges,
+	grub_size_t n)
+{
+	struct grub_disk_readv_ctx ctx = { .disk = disk };
+	struct grub_disk_range* sorted;
+	grub_disk_addr_t total = GRUB_DISK_SIZE_UNKNOWN;
+	grub_size_t i;
+
+	if (!n)
+		return GRUB_ERR_NONE;
+
+	sorted = grub_calloc(n, sizeof(*sorted));
+	if (!sorted)
+		return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+
+	for (i = 0; i < n; i++)
+	{
+		sorted[i] = ranges[i];
+		if (grub_disk_adjust_range(disk, &sorted[i].sector, &sorted[i].offset,
+			sorted[i].size) != GRUB_ERR_NONE)
+			goto fail;
+	}
+
+	if (disk->map)
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (grub_disk_read_mapped(disk, sorted[i].sector, sorted[i].offset,
+				sorted[i].size, sorted[i].buf) != GRUB_ERR_NONE)
+				break;
+		}
+		goto fail;
+	}
+
+	grub_qsort(sorted, n, sizeof(*sorted), grub_disk_range_cmp);
+
+	ctx.buf_size = GRUB_DISK_READV_SIZE;
+	ctx.buf = grub_malloc(ctx.buf_size);
+	if (!ctx.buf)
+	{
+		grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+		goto fail;
+	}
+
+	if (disk->total_sectors != GRUB_DISK_SIZE_UNKNOWN)
+		total = disk->total_sectors << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS);
+
+	for (i = 0; i < n; i++)
+	{
+		grub_uint64_t pos = (sorted[i].sector << GRUB_DISK_SECTOR_BITS) + sorted[i].offset;
+		grub_size_t left = sorted[i].size;
+		char* dest = sorted[i].buf;
+
+		while (left)
+		{
+			grub_disk_addr_t unit;
+			grub_size_t unit_offset, len;
+
+			unit = (pos >> GRUB_DISK_SECTOR_BITS) & ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1);
+			unit_offset = (grub_size_t)(pos - (unit << GRUB_DISK_SECTOR_BITS));
+			len = (GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS) - unit_offset;
+			if (len > left)
+				len = left;
+
+			if (!grub_disk_cache_read(disk->dev->id, disk->id, unit, unit_offset, len, dest))
+			{
+				if (total != GRUB_DISK_SIZE_UNKNOWN && unit + GRUB_DISK_CACHE_SIZE >= total)
+				{
+					/* The last unit of the disk may be partial.  */
+					if (grub_disk_read_small_real(disk, unit, unit_offset, len, dest) != GRUB_ERR_NONE)
+						goto fail;
+				}
+				else if (grub_disk_readv_queue(&ctx, unit, unit_offset, len, dest) != GRUB_ERR_NONE)
+					goto fail;
+			}
+
+			pos += len;
+			dest += len;
+			left -= len;
+		}
+	}
+
+	if (grub_disk_readv_flush(&ctx) != GRUB_ERR_NONE)
+		goto fail;
+
+	if (disk->read_hook)
+	{
+		for (i = 0; i < n; i++)
+			grub_disk_call_read_hook(disk, sorted[i].sector, sorted[i].offset,
+				sorted[i].size, sorted[i].buf);
+	}
+
+fail:
+	if (grub_errno == GRUB_ERR_NONE)
+	{
+		for (i = 0; i < n; i++)
+			grub_disk_writeback_overlay(disk,
+				(sorted[i].sector << GRUB_DISK_SECTOR_BITS) + sorted[i].offset,
+				sorted[i].size, sorted[i].buf);
+	}
+	grub_free(ctx.runs);
+	grub_free(ctx.pieces);
+	grub_free(ctx.buf);
+	grub_free(sorted);
+	return grub_errno;
+}
+
+grub_err_t
+grub_disk_query_allocated(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_off_t offset, grub_uint64_t size, grub_uint64_t* run, int* allocated)
+{
+	grub_uint64_t pos, end;
+	grub_disk_addr_t native, count;
+	unsigned log = disk->log_sector_size;
+
+	*run = size;
+	*allocated = 1;
+
+	if (!size || !disk->dev->disk_query_allocated)
+		return GRUB_ERR_NONE;
+
+	if (grub_disk_adjust_range(disk, &sector, &offset, size) != GRUB_ERR_NONE)
+		return grub_errno;
+
+	pos = (sector << GRUB_DISK_SECTOR_BITS) + offset;
+
+	/* Dirty data isn't on the device yet.  */
+	if (disk->wb_len
+		&& pos + size > (disk->wb_sector << GRUB_DISK_SECTOR_BITS)
+		&& pos < (disk->wb_sector << GRUB_DISK_SECTOR_BITS) + disk->wb_len
+		&& grub_disk_sync(disk) != GRUB_ERR_NONE)
+		return grub_errno;
+
+	native = pos >> log;
+	count = ((pos + size + (1ULL << log) - 1) >> log) - native;
+	if ((disk->dev->disk_query_allocated) (disk, native, count, &count, allocated) != GRUB_ERR_NONE)
+		return grub_errno;
+
+	end = (native + count) << log;
+	if (end <= pos)
+		*allocated = 1;
+	else if (end - pos < size)
+		*run = end - pos;
+	return GRUB_ERR_NONE;
+}
+
+/* Copy SIZE bytes of BUF, written at byte OFFSET of the 512B sector SECTOR,
+   into the cache units holding them.  */
+static void
+grub_disk_cache_update(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_off_t offset, grub_size_t size, const char* buf)
+{
+	grub_uint64_t pos = (sector << GRUB_DISK_SECTOR_BITS) + offset;
+
+	while (size)
+	{
+		grub_disk_addr_t unit;
+		grub_size_t unit_offset, len;
+
+		unit = (pos >> GRUB_DISK_SECTOR_BITS) & ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1);
+		unit_offset = (grub_size_t)(pos - (unit << GRUB_DISK_SECTOR_BITS));
+		len = (GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS) - unit_offset;
+		if (len > size)
+			len = size;
+
+		grub_disk_cache_write(disk->dev->id, disk->id, unit, unit_offset, len, buf);
+
+		pos += len;
+		buf += len;
+		size -= len;
+	}
+}
+
+/* Drop the cache units covering NUM native sectors from SECTOR.  */
+static void
+grub_disk_cache_invalidate_range(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_size_t num)
+{
+	grub_disk_addr_t end;
+
+	end = sector + ((grub_disk_addr_t)num << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS));
+	for (sector &= ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1); sector < end;
+		sector += GRUB_DISK_CACHE_SIZE)
+		grub_disk_cache_invalidate(disk->dev->id, disk->id, sector);
+}
+
+grub_err_t
+grub_disk_sync(grub_disk_t disk)
+{
+	grub_size_t num;
+
+	if (!disk->wb_len)
+		return GRUB_ERR_NONE;
+
+	num = disk->wb_len >> disk->log_sector_size;
+	disk->wb_len = 0;
+	grub_dprintf("disk", "flush %s sector 0x%llx sectors 0x%llx\n", disk->name,
+		(unsigned long long) disk->wb_sector, (unsigned long long) num);
+
+	if (grub_disk_dev_write(disk, transform_sector(disk, disk->wb_sector),
+		num, disk->wb_buf) != GRUB_ERR_NONE)
+	{
+		/* A failed write may have reached part of the range.  */
+		grub_disk_cache_invalidate_range(disk, disk->wb_sector, num);
+		return grub_errno;
+	}
+
+	/* Only data the device has got is shared with other handles.  */
+	grub_disk_cache_update(disk, disk->wb_sector, 0,
+		num << disk->log_sector_size, disk->wb_buf);
+	return GRUB_ERR_NONE;
+}
+
+/* Read the native sector at byte POS of the disk into the write-back
+   buffer, which must already extend to it.  */
+static grub_err_t
+grub_disk_writeback_fill(grub_disk_t disk, grub_uint64_t pos)
+{
+	grub_partition_t part;
+	grub_uint64_t start;
+	grub_err_t err;
+
+	start = ALIGN_DOWN(pos, 1ULL << disk->log_sector_size);
+	part = disk->partition;
+	disk->partition = 0;
+	err = grub_disk_read(disk, start >> GRUB_DISK_SECTOR_BITS, 0,
+		(grub_size_t)1 << disk->log_sector_size,
+		disk->wb_buf + (start - (disk->wb_sector << GRUB_DISK_SECTOR_BITS)));
+	disk->partition = part;
+	return err;
+}
+
+/* Buffered counterpart of grub_disk_write.  Writes are merged into one
+   dirty extent while they overlap or follow it, and only the sectors
+   partially covered at the ends of the extent are read from the disk.  The
+   range is already adjusted.  */
+static grub_err_t
+grub_disk_writeback(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_off_t offset, grub_size_t size, const char* buf)
+{
+	grub_uint64_t pos = (sector << GRUB_DISK_SECTOR_BITS) + offset;
+	grub_size_t sector_size = (grub_size_t)1 << disk->log_sector_size;
+
+	if (!disk->wb_buf)
+	{
+		disk->wb_size = (grub_size_t)disk->max_agglomerate
+			<< (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS);
+		if (disk->wb_size > GRUB_DISK_WRITEBACK_SIZE)
+			disk->wb_size = GRUB_DISK_WRITEBACK_SIZE;
+		if (disk->wb_size < sector_size)
+			disk->wb_size = sector_size;
+		disk->wb_buf = grub_malloc(disk->wb_size);
+		if (!disk->wb_buf)
+			return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+	}
+
+	while (size)
+	{
+		grub_uint64_t start, end, old_end, new_end;
+		grub_size_t len;
+
+		start = disk->wb_sector << GRUB_DISK_SECTOR_BITS;
+		if (!disk->wb_len || pos < start || pos > start + disk->wb_len
+			|| pos >= start + disk->wb_size)
+		{
+			if (grub_disk_sync(disk) != GRUB_ERR_NONE)
+				return grub_errno;
+			start = ALIGN_DOWN(pos, (grub_uint64_t)sector_size);
+			disk->wb_sector = start >> GRUB_DISK_SECTOR_BITS;
+		}
+
+		len = disk->wb_size - (grub_size_t)(pos - start);
+		if (len > size)
+			len = size;
+		end = pos + len;
+		old_end = start + disk->wb_len;
+		new_end = ALIGN_UP(end, (grub_uint64_t)sector_size);
+
+		if (new_end > old_end)
+		{
+			grub_uint64_t tail = ALIGN_DOWN(end, (grub_uint64_t)sector_size);
+
+			/* Sectors entering the extent but not fully written.  */
+			if (pos > old_end && grub_disk_writeback_fill(disk, old_end))
+				return grub_errno;
+			if (end < new_end && tail >= old_end && !(pos > old_end && tail == old_end)
+				&& grub_disk_writeback_fill(disk, tail))
+				return grub_errno;
+			disk->wb_len = (grub_size_t)(new_end - start);
+		}
+
+		grub_memcpy(disk->wb_buf + (pos - start), buf, len);
+
+		pos = end;
+		buf += len;
+		size -= len;
+	}
+
+	return GRUB_ERR_NONE;
+}
+
 grub_err_t
 grub_disk_write(grub_disk_t disk, grub_disk_addr_t sector,
 	grub_off_t offset, grub_size_t size, const void* buf)
@@ -675,6 +2120,9 @@ grub_disk_write(grub_disk_t disk, grub_disk_addr_t sector,
 	if (grub_disk_adjust_range(disk, &sector, &offset, size) != GRUB_ERR_NONE)
 		return -1;
 
+	if (disk->writeback)
+		return grub_disk_writeback(disk, sector, offset, size, buf);
+
 	aligned_sector = (sector & ~((1ULL << (disk->log_sector_size
 		- GRUB_DISK_SECTOR_BITS)) - 1));
 	real_offset = (unsigned) (offset + ((sector - aligned_sector) << GRUB_DISK_SECTOR_BITS));
@@ -711,15 +2159,15 @@ grub_disk_write(grub_disk_t disk, grub_disk_addr_t sector,
 
 			grub_memcpy(tmp_buf + real_offset, buf, len);
 
-			grub_disk_cache_invalidate(disk->dev->id, disk->id, sector);
-
-			if (disk->dev->disk_write(disk, transform_sector(disk, sector),
+			if (grub_disk_dev_write(disk, transform_sector(disk, sector),
 				1, tmp_buf) != GRUB_ERR_NONE)
 			{
+				grub_disk_cache_invalidate_range(disk, sector, 1);
 				grub_free(tmp_buf);
 				goto finish;
 			}
 
+			grub_disk_cache_update(disk, sector, real_offset, len, buf);
 			grub_free(tmp_buf);
 
 			sector += (1ULL << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS));
@@ -741,17 +2189,19 @@ grub_disk_write(grub_disk_t disk, grub_disk_addr_t sector,
 				n = ((grub_uint64_t)(disk->max_agglomerate)
 					<< (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS
 						- disk->log_sector_size));
+			len = n << disk->log_sector_size;
 
-			if (disk->dev->disk_write(disk, transform_sector(disk, sector),
+			if (grub_disk_dev_write(disk, transform_sector(disk, sector),
 				n, buf) != GRUB_ERR_NONE)
-				goto finish;
-
-			while (n--)
 			{
-				grub_disk_cache_invalidate(disk->dev->id, disk->id, sector);
-				sector += (1ULL << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS));
+				grub_disk_cache_invalidate_range(disk, sector, n);
+				goto finish;
 			}
 
+			/* Keep cached copies current instead of dropping them.  */
+			grub_disk_cache_update(disk, sector, 0, len, buf);
+
+			sector += (grub_disk_addr_t)n << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS);
 			buf = (const char*)buf + len;
 			size -= len;
 		}
@@ -779,4 +2229,5 @@ grub_disk_dev_init(void)
 	grub_disk_dev_register(&grub_procdisk_dev);
 	grub_disk_dev_register(&grub_loopback_dev);
 	grub_disk_dev_register(&grub_windisk_dev);
+	proc_add("diskstats", NULL, grub_disk_stats_proc_read);
 }
@@ -166,6 +166,65 @@ grub_file_read(grub_file_t file, void* buf, grub_size_t len)
 	return res;
 }
 
+grub_err_t
+grub_file_query_allocated(grub_file_t file, grub_off_t offset,
+	grub_uint64_t len, grub_uint64_t* run, int* allocated)
+{
+	if (offset >= file->size)
+		len = 0;
+	else if (len > file->size - offset)
+		len = file->size - offset;
+
+	*run = len;
+	*allocated = 1;
+
+	if (!len || !file->fs->fs_query_allocated)
+		return GRUB_ERR_NONE;
+
+	if ((file->fs->fs_query_allocated) (file, offset, len, run, allocated) != GRUB_ERR_NONE)
+		return grub_errno;
+
+	/* Don't let a confused backend stall the caller.  */
+	if (*run == 0 || *run > len)
+	{
+		*run = len;
+		*allocated = 1;
+	}
+	return GRUB_ERR_NONE;
+}
+
+grub_ssize_t
+grub_file_pread(grub_file_t file, void* buf, grub_size_t len, grub_off_t offset)
+{
+	grub_ssize_t res;
+	grub_off_t old;
+
+	if (offset > file->size)
+	{
+		grub_error(GRUB_ERR_OUT_OF_RANGE, "attempt to read past the end of file");
+		return -1;
+	}
+
+	if (len > file->size - offset)
+		len = file->size - offset;
+
+	/* Prevent an overflow.  */
+	if ((grub_ssize_t)len < 0)
+		len >>= 1;
+
+	if (len == 0)
+		return 0;
+
+	if (file->fs->fs_pread)
+		return (file->fs->fs_pread) (file, buf, len, offset);
+
+	old = file->offset;
+	file->offset = offset;
+	res = grub_file_read(file, buf, len);
+	file->offset = old;
+	return res;
+}
+
 void
 grub_file_close(grub_file_t file)
 {
@@ -174,6 +233,7 @@ grub_file_close(grub_file_t file)
 
 	if (file->disk)
 		grub_disk_close(file->disk);
+	grub_file_reader_free(file->reader);
 	grub_free(file->name);
 	grub_free(file);
 }
@@ -195,59 +255,157 @@ grub_file_seek(grub_file_t file, grub_off_t offset)
 	return old;
 }
 
-char*
-grub_file_getline(grub_file_t file)
+struct grub_file_reader
 {
-	char c;
-	grub_size_t pos = 0;
-	char* cmdline;
-	int have_newline = 0;
-	grub_size_t max_len = 64;
+	grub_file_t file;
+	/* SIZE bytes of buffer, plus one for the terminator.  */
+	char* buf;
+	grub_size_t size;
+	/* The buffer holds LEN bytes of the file from offset BASE.  */
+	grub_off_t base;
+	grub_size_t len;
+	/* The byte replaced by the terminator of the last line.  */
+	char* term;
+	char saved;
+};
+
+grub_file_reader_t
+grub_file_reader_new(grub_file_t file, grub_size_t block_size)
+{
+	grub_file_reader_t reader;
+
+	if (!block_size)
+		block_size = GRUB_FILE_READER_BLOCK_SIZE;
+	reader = grub_zalloc(sizeof(*reader));
+	if (!reader)
+		return NULL;
+	reader->buf = grub_malloc(block_size + 1);
+	if (!reader->buf)
+	{
+		grub_free(reader);
+		return NULL;
+	}
+	reader->file = file;
+	reader->size = block_size;
+	return reader;
+}
 
-	/* Initially locate some space.  */
-	cmdline = grub_malloc(max_len);
-	if (!cmdline)
-		return 0;
+void
+grub_file_reader_free(grub_file_reader_t reader)
+{
+	if (!reader)
+		return;
+	grub_free(reader->buf);
+	grub_free(reader);
+}
 
-	while (1)
+const char*
+grub_file_reader_line(grub_file_reader_t reader, grub_size_t* len)
+{
+	grub_file_t file = reader->file;
+	grub_size_t start, scanned = 0, n;
+	char* line;
+	char* nl;
+
+	if (reader->term)
 	{
-		if (grub_file_read(file, &c, 1) != 1)
-			break;
+		*reader->term = reader->saved;
+		reader->term = NULL;
+	}
 
-		/* Skip all carriage returns.  */
-		if (c == '\r')
-			continue;
+	/* Drop the buffer if the file was read or seeked elsewhere.  */
+	if (file->offset < reader->base || file->offset > reader->base + reader->len)
+	{
+		reader->base = file->offset;
+		reader->len = 0;
+	}
+	start = (grub_size_t)(file->offset - reader->base);
 
+	while (1)
+	{
+		grub_ssize_t got;
 
-		if (pos + 1 >= max_len)
+		nl = grub_memchr(reader->buf + start + scanned, '\n', reader->len - start - scanned);
+		if (nl)
 		{
-			char* old_cmdline = cmdline;
-			max_len = max_len * 2;
-			cmdline = grub_realloc(cmdline, max_len);
-			if (!cmdline)
-			{
-				grub_free(old_cmdline);
-				return 0;
-			}
+			n = nl - (reader->buf + start);
+			file->offset = reader->base + (nl - reader->buf) + 1;
+			break;
 		}
+		scanned = reader->len - start;
 
-		if (c == '\n')
+		/* Keep the partial line and make room after it.  */
+		if (start)
+		{
+			grub_memmove(reader->buf, reader->buf + start, scanned);
+			reader->base += start;
+			reader->len = scanned;
+			start = 0;
+		}
+		if (reader->len == reader->size)
 		{
-			have_newline = 1;
+			char* buf = grub_realloc(reader->buf, reader->size * 2 + 1);
+			if (!buf)
+				return NULL;
+			reader->buf = buf;
+			reader->size *= 2;
+		}
+
+		got = grub_file_pread(file, reader->buf + reader->len,
+			reader->size - reader->len, reader->base + reader->len);
+		if (got < 0)
+			return NULL;
+		if (got == 0)
+		{
+			/* The last line has no line ending.  */
+			if (!scanned)
+				return NULL;
+			n = scanned;
+			file->offset = reader->base + reader->len;
 			break;
 		}
+		reader->len += got;
+	}
+
+	line = reader->buf + start;
+	if (n && line[n - 1] == '\r')
+		n--;
+	reader->term = line + n;
+	reader->saved = line[n];
+	line[n] = '\0';
+	*len = n;
+	return line;
+}
 
-		cmdline[pos++] = c;
+char*
+grub_file_getline(grub_file_t file)
+{
+	const char* line;
+	grub_size_t len, i, pos = 0;
+	char* cmdline;
+
+	if (!file->reader)
+	{
+		file->reader = grub_file_reader_new(file, 0);
+		if (!file->reader)
+			return 0;
 	}
 
-	cmdline[pos] = '\0';
+	line = grub_file_reader_line(file->reader, &len);
+	if (!line)
+		return 0;
 
-	/* If the buffer is empty, don't return anything at all.  */
-	if (pos == 0 && !have_newline)
+	cmdline = grub_malloc(len + 1);
+	if (!cmdline)
+		return 0;
+
+	/* Skip all carriage returns.  */
+	for (i = 0; i < len; i++)
 	{
-		grub_free(cmdline);
-		cmdline = 0;
+		if (line[i] != '\r')
+			cmdline[pos++] = line[i];
 	}
+	cmdline[pos] = '\0';
 
 	return cmdline;
 }
@@ -21,33 +21,742 @@ probe_dummy_iter(const char* filename,
 	return 1;
 }
 
+/* Probe results of one disk, kept across runs in the probe cache file.  */
+struct grub_fs_probe_entry
+{
+	struct grub_fs_probe_entry* next;
+	/* The disk name, with the partition if any.  */
+	char* key;
+	/* Identity of the data the results were taken from.  */
+	grub_uint64_t sectors;
+	grub_uint64_t start;
+	grub_uint32_t fingerprint;
+	/* Whether FS is known; FS is NULL for an unknown filesystem.  */
+	int probed;
+	char* fs;
+	/* NULL if not known yet, grub_fs_probe_absent if there is none.  */
+	char* uuid;
+	char* label;
+	/* Set once the fingerprint was checked in this run, with the state of
+	   the device at that time.  */
+	int checked;
+	grub_uint64_t checked_writes;
+	grub_uint32_t checked_generation;
+};
+
+/* The fingerprint covers every byte the probe reads, which holds the
+   partition tables and the superblocks up to those of btrfs and reiserfs.  */
+#define GRUB_FS_PROBE_FINGERPRINT_SIZE GRUB_FS_PROBE_SIZE
+
+static char* grub_fs_probe_cache_path = NULL;
+static struct grub_fs_probe_entry* grub_fs_probe_cache = NULL;
+static int grub_fs_probe_cache_dirty = 0;
+
+/* A label or UUID the filesystem doesn't have, as opposed to an empty one.  */
+static char grub_fs_probe_absent[] = "";
+
+static void
+grub_fs_probe_string_free(char* str)
+{
+	if (str != grub_fs_probe_absent)
+		grub_free(str);
+}
+
+static void
+grub_fs_probe_entry_reset(struct grub_fs_probe_entry* entry)
+{
+	entry->probed = 0;
+	grub_fs_probe_string_free(entry->fs);
+	grub_fs_probe_string_free(entry->uuid);
+	grub_fs_probe_string_free(entry->label);
+	entry->fs = entry->uuid = entry->label = NULL;
+}
+
+/* Parse a field saved by grub_fs_probe_cache_save: "-", "!" for an absent
+   value, or "=VALUE".  */
+static int
+grub_fs_probe_cache_field(char* field, char** value)
+{
+	*value = NULL;
+	if (field[0] == '-' && !field[1])
+		return 1;
+	if (field[0] == '!' && !field[1])
+	{
+		*value = grub_fs_probe_absent;
+		return 1;
+	}
+	if (field[0] != '=')
+		return 0;
+	*value = grub_strdup(field + 1);
+	return *value != NULL;
+}
+
+grub_err_t
+grub_fs_probe_cache_load(const char* path)
+{
+	HANDLE fd;
+	DWORD size, dwsize = 0;
+	char* buf;
+	char* line;
+	char* next;
+
+	grub_free(grub_fs_probe_cache_path);
+	grub_fs_probe_cache_path = grub_strdup(path);
+	if (!grub_fs_probe_cache_path)
+		return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+
+	fd = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+	if (fd == INVALID_HANDLE_VALUE)
+		return GRUB_ERR_NONE;
+	size = GetFileSize(fd, NULL);
+	if (size == INVALID_FILE_SIZE)
+	{
+		CHECK_CLOSE_HANDLE(fd);
+		return GRUB_ERR_NONE;
+	}
+	buf = grub_malloc((grub_size_t)size + 1);
+	if (!buf)
+	{
+		CHECK_CLOSE_HANDLE(fd);
+		return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+	}
+	if (!ReadFile(fd, buf, size, &dwsize, NULL))
+		dwsize = 0;
+	CHECK_CLOSE_HANDLE(fd);
+	buf[dwsize] = '\0';
+
+	/* KEY SECTORS START FINGERPRINT FS UUID LABEL, separated by tabs.
+	   Broken lines are skipped.  */
+	for (line = buf; *line; line = next)
+	{
+		char* field[7];
+		struct grub_fs_probe_entry* entry;
+		unsigned i;
+
+		next = grub_strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		else
+			next = line + grub_strlen(line);
+		if (*line && line[grub_strlen(line) - 1] == '\r')
+			line[grub_strlen(line) - 1] = '\0';
+
+		field[0] = line;
+		for (i = 1; i < ARRAY_SIZE(field); i++)
+		{
+			field[i] = grub_strchr(field[i - 1], '\t');
+			if (!field[i])
+				break;
+			*field[i]++ = '\0';
+		}
+		if (i < ARRAY_SIZE(field) || !field[0][0])
+			continue;
+
+		entry = grub_zalloc(sizeof(*entry));
+		if (!entry)
+			break;
+		entry->key = grub_strdup(field[0]);
+		entry->sectors = grub_strtoull(field[1], NULL, 0);
+		entry->start = grub_strtoull(field[2], NULL, 0);
+		entry->fingerprint = (grub_uint32_t)grub_strtoul(field[3], NULL, 16);
+		entry->probed = 1;
+		if (!entry->key
+			|| !grub_fs_probe_cache_field(field[4], &entry->fs)
+			|| entry->fs == grub_fs_probe_absent
+			|| !grub_fs_probe_cache_field(field[5], &entry->uuid)
+			|| !grub_fs_probe_cache_field(field[6], &entry->label))
+		{
+			grub_fs_probe_entry_reset(entry);
+			grub_free(entry->key);
+			grub_free(entry);
+			continue;
+		}
+		entry->next = grub_fs_probe_cache;
+		grub_fs_probe_cache = entry;
+	}
+
+	grub_free(buf);
+	grub_errno = GRUB_ERR_NONE;
+	return GRUB_ERR_NONE;
+}
+
+/* Write a field of an entry, replacing characters that would break the
+   line format.  */
+static void
+grub_fs_probe_cache_write_field(HANDLE fd, const char* value, int last)
+{
+	char* str;
+	char* p;
+	DWORD dwsize;
+
+	if (value == grub_fs_probe_absent)
+		str = grub_xasprintf("!%c", last ? '\n' : '\t');
+	else
+		str = value ? grub_xasprintf("=%s%c", value, last ? '\n' : '\t')
+			: grub_xasprintf("-%c", last ? '\n' : '\t');
+	if (!str)
+		return;
+	for (p = str + 1; p[1]; p++)
+	{
+		if (*p == '\t' || *p == '\n' || *p == '\r')
+			*p = ' ';
+	}
+	WriteFile(fd, str, (DWORD)grub_strlen(str), &dwsize, NULL);
+	grub_free(str);
+}
+
+void
+grub_fs_probe_cache_save(void)
+{
+	HANDLE fd;
+	struct grub_fs_probe_entry* entry;
+
+	if (!grub_fs_probe_cache_path || !grub_fs_probe_cache_dirty)
+		return;
+
+	fd = CreateFileA(grub_fs_probe_cache_path, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
+	if (fd == INVALID_HANDLE_VALUE)
+	{
+		grub_dprintf("fs", "can't write probe cache %s\n", grub_fs_probe_cache_path);
+		return;
+	}
+
+	for (entry = grub_fs_probe_cache; entry; entry = entry->next)
+	{
+		char* str;
+		DWORD dwsize;
+
+		if (!entry->probed)
+			continue;
+		str = grub_xasprintf("%s\t%llu\t%llu\t%08x\t", entry->key,
+			(unsigned long long)entry->sectors, (unsigned long long)entry->start,
+			entry->fingerprint);
+		if (!str)
+			break;
+		WriteFile(fd, str, (DWORD)grub_strlen(str), &dwsize, NULL);
+		grub_free(str);
+		grub_fs_probe_cache_write_field(fd, entry->fs, 0);
+		grub_fs_probe_cache_write_field(fd, entry->uuid, 0);
+		grub_fs_probe_cache_write_field(fd, entry->label, 1);
+	}
+
+	CHECK_CLOSE_HANDLE(fd);
+	grub_fs_probe_cache_dirty = 0;
+	grub_errno = GRUB_ERR_NONE;
+}
+
+/* The name of the disk with its partition if any, grub_malloc'ed.  */
+static char*
+grub_fs_volume_name(grub_disk_t disk)
+{
+	char* part;
+	char* name;
+
+	if (!disk->partition)
+		return grub_strdup(disk->name);
+	part = grub_partition_get_name(disk->partition);
+	name = part ? grub_xasprintf("%s,%s", disk->name, part) : NULL;
+	grub_free(part);
+	return name;
+}
+
+/* Find the entry of DISK in the probe cache, creating it if needed.  An
+   entry whose disk no longer matches is emptied.  Return NULL if the cache
+   is disabled or DISK can't be fingerprinted.  */
+static struct grub_fs_probe_entry*
+grub_fs_probe_cache_find(grub_disk_t disk)
+{
+	struct grub_fs_probe_entry* entry;
+	grub_uint64_t sectors, start;
+	grub_uint32_t fingerprint;
+	grub_size_t size;
+	char* key;
+	char* buf;
+
+	if (!grub_fs_probe_cache_path || disk->dev->id == GRUB_DISK_PROC_ID)
+		return NULL;
+
+	sectors = grub_disk_native_sectors(disk);
+	if (sectors == GRUB_DISK_SIZE_UNKNOWN)
+		return NULL;
+	start = disk->partition ? grub_partition_get_start(disk->partition) : 0;
+
+	key = grub_fs_volume_name(disk);
+	if (!key)
+		return NULL;
+
+	for (entry = grub_fs_probe_cache; entry; entry = entry->next)
+	{
+		if (grub_strcmp(entry->key, key) == 0)
+			break;
+	}
+
+	/* Nothing was written to the device since the last check.  */
+	if (entry && entry->checked && disk->stats
+		&& entry->sectors == sectors && entry->start == start
+		&& entry->checked_writes == disk->stats->write_requests
+		&& entry->checked_generation == disk->stats->generation)
+	{
+		grub_free(key);
+		return entry;
+	}
+
+	size = GRUB_FS_PROBE_FINGERPRINT_SIZE;
+	if (size > (sectors << GRUB_DISK_SECTOR_BITS))
+		size = (grub_size_t)(sectors << GRUB_DISK_SECTOR_BITS);
+	buf = grub_malloc(size);
+	if (!buf)
+	{
+		grub_free(key);
+		return NULL;
+	}
+	if (grub_disk_read(disk, 0, 0, size, buf) != GRUB_ERR_NONE)
+	{
+		grub_free(buf);
+		grub_free(key);
+		grub_errno = GRUB_ERR_NONE;
+		return NULL;
+	}
+	fingerprint = grub_getcrc32c(0, buf, (int)size);
+	grub_free(buf);
+
+	if (!entry)
+	{
+		entry = grub_zalloc(sizeof(*entry));
+		if (!entry)
+		{
+			grub_free(key);
+			return NULL;
+		}
+		entry->key = key;
+		entry->next = grub_fs_probe_cache;
+		grub_fs_probe_cache = entry;
+	}
+	else
+		grub_free(key);
+
+	if (entry->sectors != sectors || entry->start != start
+		|| entry->fingerprint != fingerprint)
+	{
+		grub_dprintf("fs", "probe cache of %s is stale\n", entry->key);
+		grub_fs_probe_entry_reset(entry);
+		entry->sectors = sectors;
+		entry->start = start;
+		entry->fingerprint = fingerprint;
+	}
+
+	entry->checked = (disk->stats != NULL);
+	if (disk->stats)
+	{
+		entry->checked_writes = disk->stats->write_requests;
+		entry->checked_generation = disk->stats->generation;
+	}
+	return entry;
+}
+
+static int
+grub_fs_signature_match(const struct grub_fs_signature* sig,
+	const grub_uint8_t* head, grub_size_t size)
+{
+	for (; sig->size; sig++)
+	{
+		if (sig->offset + sig->size <= size
+			&& grub_memcmp(head + sig->offset, sig->magic, sig->size) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Read the start of DISK, where all signatures lie, in one request.
+   Return NULL if it can't be read.  */
+static grub_uint8_t*
+grub_fs_probe_head(grub_disk_t disk, grub_size_t* size)
+{
+	grub_uint64_t sectors = grub_disk_native_sectors(disk);
+	grub_uint8_t* head;
+
+	*size = GRUB_FS_PROBE_SIZE;
+	if (sectors != GRUB_DISK_SIZE_UNKNOWN
+		&& (sectors << GRUB_DISK_SECTOR_BITS) < *size)
+		*size = (grub_size_t)(sectors << GRUB_DISK_SECTOR_BITS);
+
+	head = grub_malloc(GRUB_FS_PROBE_SIZE);
+	if (head && grub_disk_read(disk, 0, 0, *size, head) != GRUB_ERR_NONE)
+	{
+		grub_free(head);
+		head = NULL;
+	}
+	grub_errno = GRUB_ERR_NONE;
+	return head;
+}
+
+static grub_fs_t
+grub_fs_probe_real(grub_disk_t disk)
+{
+	grub_fs_t p;
+	grub_uint8_t* head;
+	grub_size_t size;
+	int pass, known;
+
+	/* Filesystems whose signature is found go first, then those without
+	   signatures.  The rest can't be on DISK.  */
+	head = grub_fs_probe_head(disk, &size);
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (p = grub_fs_list; p; p = p->next)
+		{
+			known = (head && p->fs_signatures);
+			if (known != (pass == 0)
+				|| (known && !grub_fs_signature_match(p->fs_signatures, head, size)))
+				continue;
+
+			grub_dprintf("fs", "Detecting %s...\n", p->name);
+
+			(p->fs_dir) (disk, "/", probe_dummy_iter, NULL);
+			if (grub_errno == GRUB_ERR_NONE)
+				goto done;
+
+			grub_error_push();
+			/* The grub_error_push() does not touch grub_errmsg. */
+			grub_dprintf("fs", "error: %s.\n", grub_errmsg);
+			grub_dprintf("fs", "%s detection failed.\n", p->name);
+			grub_error_pop();
+
+			if (grub_errno != GRUB_ERR_BAD_FS && grub_errno != GRUB_ERR_OUT_OF_RANGE)
+				goto done;
+
+			grub_errno = GRUB_ERR_NONE;
+		}
+	}
+
+	grub_error(GRUB_ERR_UNKNOWN_FS, N_("unknown filesystem"));
+done:
+	grub_free(head);
+	return grub_errno ? 0 : p;
+}
+
+/* A mounted filesystem, shared by the users of one volume.  */
+struct grub_fs_mount
+{
+	struct grub_fs_mount* next;
+	grub_fs_t fs;
+	/* The volume.  */
+	unsigned long dev_id;
+	unsigned long disk_id;
+	grub_disk_addr_t start;
+	/* The state of the device when it was mounted.  */
+	grub_uint32_t generation;
+	grub_uint64_t writes;
+	/* The disk DATA reads from, owned by the mount.  */
+	grub_disk_t disk;
+	void* data;
+	grub_fs_unmount_t unmount;
+	unsigned refcount;
+	/* Set when the volume changed; unmounted once unused.  */
+	int stale;
+	/* Time of last use, to drop the oldest idle mounts first.  */
+	grub_uint64_t tick;
+};
+
+/* Unused mounts kept for later.  */
+#define GRUB_FS_MOUNT_IDLE_MAX 16
+
+static struct grub_fs_mount* grub_fs_mounts = NULL;
+static grub_uint64_t grub_fs_mount_tick = 0;
+static SRWLOCK grub_fs_mount_lock = SRWLOCK_INIT;
+
+static int
+grub_fs_mount_match(const struct grub_fs_mount* m, grub_disk_t disk)
+{
+	return (m->dev_id == disk->dev->id && m->disk_id == disk->id
+		&& m->start == (disk->partition ? grub_partition_get_start(disk->partition) : 0));
+}
+
+/* Writes and device changes make mount data stale.  */
+static int
+grub_fs_mount_valid(const struct grub_fs_mount* m)
+{
+	const struct grub_disk_stats* stats = m->disk->stats;
+
+	return (!stats || (stats->generation == m->generation
+		&& stats->write_requests == m->writes));
+}
+
+/* Unlink and unmount the unused mount at *PREV.  */
+static void
+grub_fs_mount_drop(struct grub_fs_mount** prev)
+{
+	struct grub_fs_mount* m = *prev;
+
+	*prev = m->next;
+	grub_dprintf("fs", "unmounting %s from %s\n", m->fs->name, m->disk->name);
+	m->unmount(m->data);
+	grub_disk_close(m->disk);
+	grub_free(m);
+}
+
+/* Find the valid mount of DISK, marking stale ones on the way.  Called
+   with the lock held exclusively.  */
+static struct grub_fs_mount*
+grub_fs_mount_find(grub_fs_t fs, grub_disk_t disk)
+{
+	struct grub_fs_mount* m;
+	struct grub_fs_mount** prev = &grub_fs_mounts;
+
+	while ((m = *prev) != NULL)
+	{
+		if (!m->stale && (!fs || m->fs == fs) && grub_fs_mount_match(m, disk))
+		{
+			if (grub_fs_mount_valid(m))
+				return m;
+			m->stale = 1;
+		}
+		if (m->stale && !m->refcount)
+			grub_fs_mount_drop(prev);
+		else
+			prev = &m->next;
+	}
+	return NULL;
+}
+
+static void
+grub_fs_mount_trim(void)
+{
+	struct grub_fs_mount* m;
+	struct grub_fs_mount** prev;
+	struct grub_fs_mount** oldest;
+	unsigned idle;
+
+	while (1)
+	{
+		idle = 0;
+		oldest = NULL;
+		for (prev = &grub_fs_mounts; (m = *prev) != NULL; prev = &m->next)
+		{
+			if (m->refcount)
+				continue;
+			idle++;
+			if (!oldest || m->tick < (*oldest)->tick)
+				oldest = prev;
+		}
+		if (idle <= GRUB_FS_MOUNT_IDLE_MAX)
+			break;
+		grub_fs_mount_drop(oldest);
+	}
+}
+
+void*
+grub_fs_mount_get(grub_fs_t fs, grub_disk_t disk, grub_fs_mount_t mount,
+	grub_fs_unmount_t unmount)
+{
+	struct grub_fs_mount* m;
+	grub_disk_t mdisk;
+	char* name;
+	void* data;
+
+	AcquireSRWLockExclusive(&grub_fs_mount_lock);
+	m = grub_fs_mount_find(fs, disk);
+	if (m)
+	{
+		m->refcount++;
+		m->tick = ++grub_fs_mount_tick;
+		ReleaseSRWLockExclusive(&grub_fs_mount_lock);
+		return m->data;
+	}
+	ReleaseSRWLockExclusive(&grub_fs_mount_lock);
+
+	/* The mount outlives DISK, so it gets a disk of its own.  */
+	name = grub_fs_volume_name(disk);
+	if (!name)
+		return NULL;
+	mdisk = grub_disk_open(name);
+	grub_free(name);
+	if (!mdisk)
+		return NULL;
+
+	m = grub_zalloc(sizeof(*m));
+	if (!m)
+	{
+		grub_disk_close(mdisk);
+		return NULL;
+	}
+	m->fs = fs;
+	m->dev_id = mdisk->dev->id;
+	m->disk_id = mdisk->id;
+	m->start = mdisk->partition ? grub_partition_get_start(mdisk->partition) : 0;
+	if (mdisk->stats)
+	{
+		m->generation = mdisk->stats->generation;
+		m->writes = mdisk->stats->write_requests;
+	}
+	m->disk = mdisk;
+	m->unmount = unmount;
+	m->refcount = 1;
+
+	data = mount(mdisk);
+	if (!data)
+	{
+		grub_disk_close(mdisk);
+		grub_free(m);
+		return NULL;
+	}
+	m->data = data;
+
+	AcquireSRWLockExclusive(&grub_fs_mount_lock);
+	m->tick = ++grub_fs_mount_tick;
+	m->next = grub_fs_mounts;
+	grub_fs_mounts = m;
+	grub_fs_mount_trim();
+	ReleaseSRWLockExclusive(&grub_fs_mount_lock);
+	return data;
+}
+
+void
+grub_fs_mount_put(void* data)
+{
+	struct grub_fs_mount* m;
+	struct grub_fs_mount** prev;
+
+	if (!data)
+		return;
+
+	AcquireSRWLockExclusive(&grub_fs_mount_lock);
+	for (prev = &grub_fs_mounts; (m = *prev) != NULL; prev = &m->next)
+	{
+		if (m->data != data)
+			continue;
+		if (--m->refcount == 0 && (m->stale || !grub_fs_mount_valid(m)))
+			grub_fs_mount_drop(prev);
+		break;
+	}
+	ReleaseSRWLockExclusive(&grub_fs_mount_lock);
+}
+
+void
+grub_fs_mount_flush(void)
+{
+	struct grub_fs_mount* m;
+	struct grub_fs_mount** prev = &grub_fs_mounts;
+
+	AcquireSRWLockExclusive(&grub_fs_mount_lock);
+	while ((m = *prev) != NULL)
+	{
+		if (m->refcount)
+			prev = &m->next;
+		else
+			grub_fs_mount_drop(prev);
+	}
+	ReleaseSRWLockExclusive(&grub_fs_mount_lock);
+}
+
 grub_fs_t
 grub_fs_probe(grub_disk_t disk)
 {
+	struct grub_fs_probe_entry* entry;
+	struct grub_fs_mount* m;
 	grub_fs_t p;
 
-	for (p = grub_fs_list; p; p = p->next)
+	/* A volume that is mounted needs no probing.  */
+	AcquireSRWLockExclusive(&grub_fs_mount_lock);
+	m = grub_fs_mount_find(NULL, disk);
+	p = m ? m->fs : NULL;
+	ReleaseSRWLockExclusive(&grub_fs_mount_lock);
+	if (p)
+		return p;
+
+	entry = grub_fs_probe_cache_find(disk);
+	if (entry && entry->probed)
 	{
-		grub_dprintf("fs", "Detecting %s...\n", p->name);
+		if (!entry->fs)
+		{
+			grub_error(GRUB_ERR_UNKNOWN_FS, N_("unknown filesystem"));
+			return 0;
+		}
+		FOR_FILESYSTEMS(p)
+		{
+			if (grub_strcmp(p->name, entry->fs) == 0)
+				return p;
+		}
+	}
 
-		(p->fs_dir) (disk, "/", probe_dummy_iter, NULL);
-		if (grub_errno == GRUB_ERR_NONE)
-			return p;
+	p = grub_fs_probe_real(disk);
+	if (entry && (p || grub_errno == GRUB_ERR_UNKNOWN_FS))
+	{
+		grub_fs_probe_entry_reset(entry);
+		entry->fs = p ? grub_strdup(p->name) : NULL;
+		entry->probed = (!p || entry->fs);
+		grub_fs_probe_cache_dirty = 1;
+	}
+	return p;
+}
 
-		grub_error_push();
-		/* The grub_error_push() does not touch grub_errmsg. */
-		grub_dprintf("fs", "error: %s.\n", grub_errmsg);
-		grub_dprintf("fs", "%s detection failed.\n", p->name);
-		grub_error_pop();
+/* Get the label (UUID if !LABEL) of the filesystem FS on DISK through the
+   probe cache.  */
+static grub_err_t
+grub_fs_probe_string(grub_fs_t fs, grub_disk_t disk, int label, char** str)
+{
+	struct grub_fs_probe_entry* entry;
+	char** cached;
+	grub_err_t(*get) (grub_disk_t disk, char** str);
 
-		if (grub_errno != GRUB_ERR_BAD_FS && grub_errno != GRUB_ERR_OUT_OF_RANGE)
-			return 0;
+	*str = NULL;
+	get = label ? fs->fs_label : fs->fs_uuid;
+	if (!get)
+		return GRUB_ERR_NONE;
 
-		grub_errno = GRUB_ERR_NONE;
+	entry = grub_fs_probe_cache_find(disk);
+	if (!entry || !entry->probed || !entry->fs || grub_strcmp(entry->fs, fs->name) != 0)
+		return get(disk, str);
+
+	cached = label ? &entry->label : &entry->uuid;
+	if (*cached == grub_fs_probe_absent)
+		return GRUB_ERR_NONE;
+	if (*cached)
+	{
+		*str = grub_strdup(*cached);
+		if (!*str)
+			return grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+		return GRUB_ERR_NONE;
 	}
 
-	grub_error(GRUB_ERR_UNKNOWN_FS, N_("unknown filesystem"));
-	return 0;
+	if (get(disk, str) != GRUB_ERR_NONE)
+		return grub_errno;
+	*cached = *str ? grub_strdup(*str) : grub_fs_probe_absent;
+	grub_fs_probe_cache_dirty = 1;
+	return GRUB_ERR_NONE;
+}
+
+grub_err_t
+grub_fs_label(grub_fs_t fs, grub_disk_t disk, char** label)
+{
+	return grub_fs_probe_string(fs, disk, 1, label);
+}
+
+grub_err_t
+grub_fs_uuid(grub_fs_t fs, grub_disk_t disk, char** uuid)
+{
+	return grub_fs_probe_string(fs, disk, 0, uuid);
+}
+
+grub_err_t
+grub_fs_query_used(grub_fs_t fs, grub_disk_t disk, grub_uint64_t offset,
+	grub_uint64_t len, grub_uint64_t* run, int* used)
+{
+	*run = len;
+	*used = 1;
+
+	if (!len || !fs || !fs->fs_query_used)
+		return GRUB_ERR_NONE;
+
+	if ((fs->fs_query_used) (disk, offset, len, run, used) != GRUB_ERR_NONE)
+		return grub_errno;
+
+	if (*run == 0 || *run > len)
+	{
+		*run = len;
+		*used = 1;
+	}
+	return GRUB_ERR_NONE;
 }
 
 void
@@ -169,16 +878,31 @@ fail:
 }
 
 static grub_ssize_t
-grub_fs_blocklist_rw(grub_file_t file, char* buf, grub_size_t len, int write)
+grub_fs_blocklist_rw(grub_file_t file, char* buf, grub_size_t len, grub_off_t offset, int write)
 {
 	struct grub_fs_block* p;
-	grub_off_t offset;
 	grub_ssize_t ret = 0;
+	struct grub_disk_range* ranges = NULL;
+	grub_size_t n = 0;
+	grub_off_t pos = 0;
 
-	if (len > file->size - file->offset)
-		len = file->size - file->offset;
+	if (len > file->size - offset)
+		len = file->size - offset;
+
+	/* Reads of all blocks are gathered into one vectored read.  */
+	if (!write)
+	{
+		for (p = file->data; p->length && pos < offset + len; p++)
+		{
+			pos += p->length;
+			n++;
+		}
+		ranges = grub_calloc(n ? n : 1, sizeof(*ranges));
+		if (!ranges)
+			return -1;
+		n = 0;
+	}
 
-	offset = file->offset;
 	for (p = file->data; p->length && len > 0; p++)
 	{
 		if (offset < p->length)
@@ -189,9 +913,15 @@ grub_fs_blocklist_rw(grub_file_t file, char* buf, grub_size_t len, int write)
 			if (size + offset > p->length)
 				size = p->length - offset;
 
-			if ((write ?
-				grub_disk_write(file->disk, 0, p->offset + offset, size, buf) :
-				grub_disk_read(file->disk, 0, p->offset + offset, size, buf)) != GRUB_ERR_NONE)
+			if (!write)
+			{
+				ranges[n].sector = 0;
+				ranges[n].offset = p->offset + offset;
+				ranges[n].size = size;
+				ranges[n].buf = buf;
+				n++;
+			}
+			else if (grub_disk_write(file->disk, 0, p->offset + offset, size, buf) != GRUB_ERR_NONE)
 				return -1;
 
 			ret += size;
@@ -204,6 +934,13 @@ grub_fs_blocklist_rw(grub_file_t file, char* buf, grub_size_t len, int write)
 			offset -= p->length;
 	}
 
+	if (!write)
+	{
+		if (grub_disk_readv(file->disk, ranges, n) != GRUB_ERR_NONE)
+			ret = -1;
+		grub_free(ranges);
+	}
+
 	return ret;
 }
 
@@ -213,70 +950,245 @@ grub_fs_blocklist_read(grub_file_t file, char* buf, grub_size_t len)
 	grub_ssize_t ret;
 	file->disk->read_hook = file->read_hook;
 	file->disk->read_hook_data = file->read_hook_data;
-	ret = grub_fs_blocklist_rw(file, buf, len, 0);
+	ret = grub_fs_blocklist_rw(file, buf, len, file->offset, 0);
 	file->disk->read_hook = 0;
 	return ret;
 }
 
+static grub_ssize_t
+grub_fs_blocklist_pread(grub_file_t file, char* buf, grub_size_t len, grub_off_t offset)
+{
+	grub_ssize_t ret;
+	file->disk->read_hook = file->read_hook;
+	file->disk->read_hook_data = file->read_hook_data;
+	ret = grub_fs_blocklist_rw(file, buf, len, offset, 0);
+	file->disk->read_hook = 0;
+	return ret;
+}
+
+static grub_err_t
+grub_fs_blocklist_query_allocated(grub_file_t file, grub_off_t offset,
+	grub_uint64_t len, grub_uint64_t* run, int* allocated)
+{
+	struct grub_fs_block* p;
+
+	if (offset >= file->size)
+		return GRUB_ERR_NONE;
+
+	/* Runs stop at the end of a block.  */
+	for (p = file->data; p->length; p++)
+	{
+		if (offset < p->length)
+		{
+			if (len > p->length - offset)
+				len = p->length - offset;
+			return grub_disk_query_allocated(file->disk, 0, p->offset + offset,
+				len, run, allocated);
+		}
+		offset -= p->length;
+	}
+	return GRUB_ERR_NONE;
+}
+
 struct grub_fs grub_fs_blocklist =
 {
   .name = "blocklist",
   .fs_dir = 0,
   .fs_open = grub_fs_blocklist_open,
   .fs_read = grub_fs_blocklist_read,
+  .fs_pread = grub_fs_blocklist_pread,
   .fs_close = 0,
+  .fs_query_allocated = grub_fs_blocklist_query_allocated,
   .next = 0
 };
 
+struct grub_winfile
+{
+	HANDLE fd;
+	/* Opened with FILE_FLAG_NO_BUFFERING.  */
+	int unbuffered;
+};
+
 static grub_err_t
 grub_fs_winfile_open(grub_file_t file, const char* name)
 {
 	LARGE_INTEGER li;
 	HANDLE fd = INVALID_HANDLE_VALUE;
+	struct grub_winfile* data;
+	int unbuffered = grub_disk_get_unbuffered();
 	grub_dprintf("fs", "winfile %s\n", name);
-	fd = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, 0, 0);
+	fd = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING,
+		unbuffered ? FILE_FLAG_NO_BUFFERING : 0, 0);
 	if (fd == INVALID_HANDLE_VALUE)
 		return grub_error(GRUB_ERR_BAD_FILENAME, "invalid winfile %s", name);
+	data = grub_malloc(sizeof(*data));
+	if (!data)
+	{
+		CloseHandle(fd);
+		return grub_errno;
+	}
+	data->fd = fd;
+	data->unbuffered = unbuffered;
 	if (GetFileSizeEx(fd, &li))
 		file->size = li.QuadPart;
 	else
 		file->size = GRUB_FILE_SIZE_UNKNOWN;
-	grub_dprintf("fs", "winfile size %llu\n", file->size);
-	file->data = fd;
+	grub_dprintf("fs", "winfile size %llu%s\n", file->size, unbuffered ? " unbuffered" : "");
+	file->data = data;
 	return GRUB_ERR_NONE;
 }
 
+/* The offset given in OVERLAPPED makes this a positional read, so threads
+   sharing the handle don't race on its file pointer.  */
+static grub_ssize_t
+grub_fs_winfile_read_at(HANDLE fd, grub_uint64_t offset, char* buf, DWORD len)
+{
+	OVERLAPPED ov;
+	DWORD dwsize = 0;
+	grub_memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	if (!ReadFile(fd, buf, len, &dwsize, &ov))
+		return (GetLastError() == ERROR_HANDLE_EOF) ? 0 : -1;
+	return (grub_ssize_t)dwsize;
+}
+
+/* Unbuffered handles need aligned offsets, lengths and buffers.  Aligned
+   requests are read in place, others go through a pool buffer.  */
+static grub_ssize_t
+grub_fs_winfile_read_unbuffered(HANDLE fd, grub_uint64_t offset, char* buf, grub_size_t len)
+{
+	grub_ssize_t total = 0;
+	char* tmp = NULL;
+
+	while (len > 0)
+	{
+		grub_uint64_t start;
+		grub_size_t skip, size, chunk;
+		grub_ssize_t got;
+
+		if ((offset & (GRUB_DISK_BUFFER_ALIGN - 1)) == 0
+			&& ((grub_addr_t)buf & (GRUB_DISK_BUFFER_ALIGN - 1)) == 0
+			&& len >= GRUB_DISK_BUFFER_ALIGN)
+		{
+			size = len & ~(grub_size_t)(GRUB_DISK_BUFFER_ALIGN - 1);
+			if (size > GRUB_DISK_BUFFER_SIZE)
+				size = GRUB_DISK_BUFFER_SIZE;
+			got = grub_fs_winfile_read_at(fd, offset, buf, (DWORD)size);
+			if (got < 0)
+				goto fail;
+			chunk = got;
+		}
+		else
+		{
+			if (!tmp)
+			{
+				tmp = grub_disk_buffer_get();
+				if (!tmp)
+					goto fail;
+			}
+			start = offset & ~(grub_uint64_t)(GRUB_DISK_BUFFER_ALIGN - 1);
+			skip = (grub_size_t)(offset - start);
+			size = ALIGN_UP(skip + len, GRUB_DISK_BUFFER_ALIGN);
+			if (size > GRUB_DISK_BUFFER_SIZE)
+				size = GRUB_DISK_BUFFER_SIZE;
+			got = grub_fs_winfile_read_at(fd, start, tmp, (DWORD)size);
+			if (got < 0)
+				goto fail;
+			if ((grub_size_t)got <= skip)
+				break;
+			chunk = got - skip;
+			if (chunk > len)
+				chunk = len;
+			grub_memcpy(buf, tmp + skip, chunk);
+		}
+
+		total += chunk;
+		offset += chunk;
+		buf += chunk;
+		len -= chunk;
+		/* End of file.  */
+		if ((grub_size_t)got < size)
+			break;
+	}
+
+	grub_disk_buffer_put(tmp);
+	return total;
+
+fail:
+	grub_disk_buffer_put(tmp);
+	return total ? total : -1;
+}
+
+static grub_ssize_t
+grub_fs_winfile_pread(grub_file_t file, char* buf, grub_size_t len, grub_off_t offset)
+{
+	struct grub_winfile* data = file->data;
+	if (data->unbuffered)
+		return grub_fs_winfile_read_unbuffered(data->fd, offset, buf, len);
+	return grub_fs_winfile_read_at(data->fd, offset, buf, (DWORD)len);
+}
+
 static grub_ssize_t
 grub_fs_winfile_read(grub_file_t file, char* buf, grub_size_t len)
 {
-	grub_ssize_t ret = -1;
-	LARGE_INTEGER li;
-	HANDLE fd = file->data;
-	DWORD dwsize = (DWORD)len;
-	li.QuadPart = file->offset;
-	li.LowPart = SetFilePointer(fd, li.LowPart, &li.HighPart, FILE_BEGIN);
-	if (li.LowPart == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
-		return -1;
-	if (ReadFile(fd, buf, dwsize, &dwsize, NULL))
-		ret = (grub_ssize_t)dwsize;
-	return ret;
+	return grub_fs_winfile_pread(file, buf, len, file->offset);
 }
 
 static grub_err_t
 grub_fs_winfile_close(struct grub_file* file)
 {
-	HANDLE fd = file->data;
-	CHECK_CLOSE_HANDLE(fd);
+	struct grub_winfile* data = file->data;
+	CHECK_CLOSE_HANDLE(data->fd);
+	grub_free(data);
 	return GRUB_ERR_NONE;
 }
 
+/* Sparse files tell their holes apart, other files are allocated in full.  */
+static grub_err_t
+grub_fs_winfile_query_allocated(grub_file_t file, grub_off_t offset,
+	grub_uint64_t len, grub_uint64_t* run, int* allocated)
+{
+	struct grub_winfile* data = file->data;
+	FILE_ALLOCATED_RANGE_BUFFER query, range;
+	DWORD dwsize = 0;
+
+	query.FileOffset.QuadPart = offset;
+	query.Length.QuadPart = len;
+	if (!DeviceIoControl(data->fd, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+		&range, sizeof(range), &dwsize, NULL) && GetLastError() != ERROR_MORE_DATA)
+		return GRUB_ERR_NONE;
+
+	if (dwsize < sizeof(range))
+		*allocated = 0;
+	else if ((grub_uint64_t)range.FileOffset.QuadPart > offset)
+	{
+		*allocated = 0;
+		*run = range.FileOffset.QuadPart - offset;
+	}
+	else
+		*run = range.FileOffset.QuadPart + range.Length.QuadPart - offset;
+	return GRUB_ERR_NONE;
+}
+
+HANDLE
+grub_fs_winfile_handle(grub_file_t file)
+{
+	struct grub_winfile* data = file->data;
+	if (file->fs != &grub_fs_winfile)
+		return INVALID_HANDLE_VALUE;
+	return data->fd;
+}
+
 struct grub_fs grub_fs_winfile =
 {
   .name = "winfile",
   .fs_dir = 0,
   .fs_open = grub_fs_winfile_open,
   .fs_read = grub_fs_winfile_read,
+  .fs_pread = grub_fs_winfile_pread,
   .fs_close = grub_fs_winfile_close,
+  .fs_query_allocated = grub_fs_winfile_query_allocated,
   .next = 0
 };
 
@@ -290,38 +1202,49 @@ struct read_blocklist_ctx
 	grub_disk_addr_t part_start;
 };
 
+/* Add LENGTH bytes at byte OFFSET of the disk to the blocklist.  */
 static grub_err_t
-read_blocklist(grub_disk_addr_t sector, unsigned offset,
-	unsigned length, char* buf, void* ctx)
+blocklist_add(grub_disk_addr_t offset, grub_uint64_t length, void* ctx)
 {
-	(void)buf;
 	struct read_blocklist_ctx* c = ctx;
 
-	sector = ((sector - c->part_start) << GRUB_DISK_SECTOR_BITS) + offset;
-
 	if ((c->num) &&
-		(c->blocks[c->num - 1].offset + c->blocks[c->num - 1].length == sector))
+		(c->blocks[c->num - 1].offset + c->blocks[c->num - 1].length == offset))
 	{
 		c->blocks[c->num - 1].length += length;
 		goto quit;
 	}
 
+	/* One more slot keeps the list ended by a zero-length block.  */
 	if ((c->num & (BLOCKLIST_INC_STEP - 1)) == 0)
 	{
-		c->blocks = grub_realloc(c->blocks, (c->num + BLOCKLIST_INC_STEP) * sizeof(struct grub_fs_block));
+		c->blocks = grub_realloc(c->blocks, (c->num + BLOCKLIST_INC_STEP + 1) * sizeof(struct grub_fs_block));
 		if (!c->blocks)
 			return GRUB_ERR_NONE;
 	}
 
-	c->blocks[c->num].offset = sector;
+	c->blocks[c->num].offset = offset;
 	c->blocks[c->num].length = length;
 	c->num++;
+	c->blocks[c->num].offset = 0;
+	c->blocks[c->num].length = 0;
 
 quit:
 	c->total_size += length;
 	return GRUB_ERR_NONE;
 }
 
+static grub_err_t
+read_blocklist(grub_disk_addr_t sector, unsigned offset,
+	unsigned length, char* buf, void* ctx)
+{
+	(void)buf;
+	struct read_blocklist_ctx* c = ctx;
+
+	return blocklist_add(((sector - c->part_start) << GRUB_DISK_SECTOR_BITS) + offset,
+		length, ctx);
+}
+
 static grub_uint64_t
 blocklist_count_frags(struct grub_fs_block* blocks, grub_off_t file_size)
 {
@@ -343,6 +1266,7 @@ grub_blocklist_convert(grub_file_t file)
 {
 	struct read_blocklist_ctx c;
 	char buf[4 * GRUB_DISK_SECTOR_SIZE];
+	int mapped;
 
 	if (file->fs == &grub_fs_blocklist)
 		return blocklist_count_frags(file->data, file->size);
@@ -356,11 +1280,30 @@ grub_blocklist_convert(grub_file_t file)
 	c.blocks = 0;
 	c.total_size = 0;
 	c.part_start = grub_partition_get_start(file->disk->partition);
-	file->read_hook = read_blocklist;
-	file->read_hook_data = &c;
-	while (grub_file_read(file, buf, sizeof(buf)) > 0)
-		;
-	file->read_hook = 0;
+
+	/* Prefer the driver's metadata to reading the whole file.  */
+	mapped = 0;
+	if (file->fs->fs_extents)
+	{
+		if (file->fs->fs_extents(file, blocklist_add, &c) != GRUB_ERR_NOT_IMPLEMENTED_YET)
+			mapped = 1;
+		else
+		{
+			grub_errno = GRUB_ERR_NONE;
+			c.num = 0;
+			grub_free(c.blocks);
+			c.blocks = 0;
+			c.total_size = 0;
+		}
+	}
+	if (!mapped)
+	{
+		file->read_hook = read_blocklist;
+		file->read_hook_data = &c;
+		while (grub_file_read(file, buf, sizeof(buf)) > 0)
+			;
+		file->read_hook = 0;
+	}
 	if ((grub_errno) || (c.total_size != file->size))
 	{
 		grub_errno = 0;
@@ -382,5 +1325,5 @@ grub_blocklist_convert(grub_file_t file)
 grub_ssize_t
 grub_blocklist_write(grub_file_t file, const char* buf, grub_size_t len)
 {
-	return (file->fs != &grub_fs_blocklist) ? -1 : grub_fs_blocklist_rw(file, (char*)buf, len, 1);
+	return (file->fs != &grub_fs_blocklist) ? -1 : grub_fs_blocklist_rw(file, (char*)buf, len, file->offset, 1);
 }
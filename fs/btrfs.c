@@ -2308,9 +2308,16 @@ grub_btrfs_label(grub_disk_t disk, char** label)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_btrfs_signatures[] =
+{
+	{ 0x10040, 8, GRUB_BTRFS_SIGNATURE },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_btrfs_fs =
 {
   .name = "btrfs",
+  .fs_signatures = grub_btrfs_signatures,
   .fs_dir = grub_btrfs_dir,
   .fs_open = grub_btrfs_open,
   .fs_read = grub_btrfs_read,
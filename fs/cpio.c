@@ -40,6 +40,7 @@ read_number(const grub_uint16_t* arr, grub_size_t size)
 struct grub_fs grub_cpio_fs =
 {
 	.name = FSNAME,
+	.fs_signatures = grub_cpio_signatures,
 	.fs_dir = grub_cpio_dir,
 	.fs_open = grub_cpio_open,
 	.fs_read = grub_cpio_read,
@@ -120,6 +120,12 @@ grub_cpio_rewind(struct grub_archelp_data* data)
 	data->next_hofs = 0;
 }
 
+static grub_off_t
+grub_cpio_get_size(struct grub_archelp_data* data)
+{
+	return data->size;
+}
+
 #pragma warning(push)
 #pragma warning(disable:4028)
 #pragma warning(disable:4113)
@@ -127,7 +133,8 @@ static struct grub_archelp_ops arcops =
 {
   .find_file = grub_cpio_find_file,
   .get_link_target = grub_cpio_get_link_target,
-  .rewind = grub_cpio_rewind
+  .rewind = grub_cpio_rewind,
+  .get_size = grub_cpio_get_size
 };
 #pragma warning(pop)
 
@@ -225,3 +232,12 @@ grub_cpio_close(grub_file_t file)
 
 	return grub_errno;
 }
+
+static const struct grub_fs_signature grub_cpio_signatures[] =
+{
+	{ 0, sizeof(MAGIC) - 1, MAGIC },
+#ifdef MAGIC2
+	{ 0, sizeof(MAGIC2) - 1, MAGIC2 },
+#endif
+	{ 0, 0, NULL },
+};
@@ -24,6 +24,7 @@
 #include "charset.h"
 #include "datetime.h"
 #include "fshelp.h"
+#include "fat_common.h"
 
 #include "exfat.h"
 
@@ -96,6 +97,13 @@ struct grub_fat_dir_entry
 			grub_uint8_t character_count;
 			grub_uint16_t str[15];
 		} volume_label;
+		struct
+		{
+			grub_uint8_t flags;
+			grub_uint8_t reserved[18];
+			grub_uint32_t first_cluster;
+			grub_uint64_t data_length;
+		} allocation_bitmap;
 	} type_specific;
 };
 PRAGMA_END_PACKED
@@ -128,12 +136,26 @@ struct grub_fat_data
 	grub_uint32_t num_clusters;
 
 	grub_uint32_t uuid;
+
+	/* The allocation bitmap, one bit per cluster of the cluster heap,
+	   loaded in one go when first needed.  */
+	grub_uint32_t cluster_count;
+	grub_uint8_t* bitmap;
+	SRWLOCK bitmap_lock;
+
+	struct grub_fat_chain chain;
 };
 
+/* Larger allocation bitmaps aren't loaded.  */
+#define GRUB_EXFAT_BITMAP_MAX	(256U << 20)
+
 struct grub_fshelp_node
 {
 	grub_disk_t disk;
 	struct grub_fat_data* data;
+	/* Only opened fragmented files have a run list; it isn't kept with
+	   the directory entries.  */
+	struct grub_fat_runs* runs;
 
 	grub_uint8_t attr;
 
@@ -146,6 +168,10 @@ struct grub_fshelp_node
 	int is_contiguous;
 };
 
+static grub_err_t
+grub_fat_next_cluster(grub_disk_t disk, void* fat_data,
+	grub_uint32_t cluster, grub_uint32_t* next);
+
 static struct grub_fat_data*
 grub_exfat_mount(grub_disk_t disk)
 {
@@ -210,6 +236,9 @@ grub_exfat_mount(grub_disk_t disk)
 		<< data->logical_sector_bits);
 	data->num_clusters = (grub_le_to_cpu32(bpb.cluster_count)
 		<< data->logical_sector_bits);
+	data->cluster_count = grub_le_to_cpu32(bpb.cluster_count);
+	data->bitmap = NULL;
+	InitializeSRWLock(&data->bitmap_lock);
 
 	if (data->num_clusters <= 2)
 		goto fail;
@@ -257,6 +286,13 @@ grub_exfat_mount(grub_disk_t disk)
 
 	(void)magic;
 
+	data->chain.next = grub_fat_next_cluster;
+	data->chain.data = data;
+	data->chain.num_clusters = data->num_clusters;
+	data->chain.eof_mark = data->cluster_eof_mark;
+	data->chain.cluster_sector = data->cluster_sector;
+	data->chain.cluster_bits = data->cluster_bits;
+
 	return data;
 
 fail:
@@ -266,6 +302,83 @@ fail:
 	return 0;
 }
 
+static void
+grub_exfat_unmount(struct grub_fat_data* data)
+{
+	if (!data)
+		return;
+	grub_free(data->bitmap);
+	grub_free(data);
+}
+
+/* Check the boot sector on DISK itself, so that probing a disk which
+   isn't exFAT doesn't open another disk for the mount cache.  */
+static grub_err_t
+grub_exfat_check_bpb(grub_disk_t disk)
+{
+	grub_current_fat_bpb_t bpb;
+
+	if (grub_disk_read(disk, 0, 0, sizeof(bpb), &bpb))
+		goto fail;
+
+	if (grub_memcmp((const char*)bpb.oem_name, "EXFAT   ",
+		sizeof(bpb.oem_name)) != 0)
+		goto fail;
+
+	if (bpb.bytes_per_sector_shift < GRUB_DISK_SECTOR_BITS
+		|| bpb.bytes_per_sector_shift >= 16
+		|| bpb.sectors_per_cluster_shift > 25
+		|| bpb.num_reserved_sectors == 0
+		|| bpb.sectors_per_fat == 0
+		|| bpb.num_total_sectors == 0
+		|| bpb.num_fats == 0)
+		goto fail;
+
+	return GRUB_ERR_NONE;
+
+fail:
+
+	return grub_error(GRUB_ERR_BAD_FS, "not a FAT filesystem");
+}
+
+static void*
+grub_exfat_mount_shared(grub_disk_t disk)
+{
+	return grub_exfat_mount(disk);
+}
+
+static void
+grub_exfat_unmount_shared(void* data)
+{
+	grub_exfat_unmount(data);
+}
+
+/* Set *NEXT to the cluster after CLUSTER in the FAT, which is at least
+   the end of chain mark after the last cluster.  */
+static grub_err_t
+grub_fat_next_cluster(grub_disk_t disk, void* fat_data,
+	grub_uint32_t cluster, grub_uint32_t* next)
+{
+	struct grub_fat_data* data = fat_data;
+	grub_uint32_t next_cluster = 0;
+
+	/* exFAT entries are always 32 bits.  */
+	if (grub_disk_read(disk, data->fat_sector, (grub_off_t)cluster << 2,
+		sizeof(next_cluster), (char*)&next_cluster))
+		return grub_errno;
+	next_cluster = grub_le_to_cpu32(next_cluster);
+
+	grub_dprintf("fat", "fat_size=%d, next_cluster=%u\n",
+		data->fat_size, next_cluster);
+
+	if (next_cluster < data->cluster_eof_mark
+		&& (next_cluster < 2 || next_cluster >= data->num_clusters))
+		return grub_error(GRUB_ERR_BAD_FS, "invalid cluster %u", next_cluster);
+
+	*next = next_cluster;
+	return GRUB_ERR_NONE;
+}
+
 static grub_ssize_t
 grub_fat_read_data(grub_disk_t disk, grub_fshelp_node_t node,
 	grub_disk_read_hook_t read_hook, void* read_hook_data,
@@ -295,6 +408,10 @@ grub_fat_read_data(grub_disk_t disk, grub_fshelp_node_t node,
 		return len;
 	}
 
+	if (node->runs)
+		return grub_fat_runs_read(disk, node->runs, read_hook, read_hook_data,
+			offset, len, buf);
+
 	/* Calculate the logical cluster number and offset.  */
 	logical_cluster_bits = (node->data->cluster_bits
 		+ GRUB_DISK_SECTOR_BITS);
@@ -313,56 +430,14 @@ grub_fat_read_data(grub_disk_t disk, grub_fshelp_node_t node,
 		{
 			/* Find next cluster.  */
 			grub_uint32_t next_cluster;
-			grub_uint32_t fat_offset;
-
-			switch (node->data->fat_size)
-			{
-			case 32:
-				fat_offset = node->cur_cluster << 2;
-				break;
-			case 16:
-				fat_offset = node->cur_cluster << 1;
-				break;
-			default:
-				/* case 12: */
-				fat_offset = node->cur_cluster + (node->cur_cluster >> 1);
-				break;
-			}
 
-			/* Read the FAT.  */
-			if (grub_disk_read(disk, node->data->fat_sector, fat_offset,
-				(7ULL + node->data->fat_size) >> 3,
-				(char*)&next_cluster))
+			if (grub_fat_next_cluster(disk, node->data, node->cur_cluster, &next_cluster))
 				return -1;
 
-			next_cluster = grub_le_to_cpu32(next_cluster);
-			switch (node->data->fat_size)
-			{
-			case 16:
-				next_cluster &= 0xFFFF;
-				break;
-			case 12:
-				if (node->cur_cluster & 1)
-					next_cluster >>= 4;
-
-				next_cluster &= 0x0FFF;
-				break;
-			}
-
-			grub_dprintf("fat", "fat_size=%d, next_cluster=%u\n",
-				node->data->fat_size, next_cluster);
-
 			/* Check the end.  */
 			if (next_cluster >= node->data->cluster_eof_mark)
 				return ret;
 
-			if (next_cluster < 2 || next_cluster >= node->data->num_clusters)
-			{
-				grub_error(GRUB_ERR_BAD_FS, "invalid cluster %u",
-					next_cluster);
-				return -1;
-			}
-
 			node->cur_cluster = next_cluster;
 			node->cur_cluster_num++;
 		}
@@ -581,6 +656,7 @@ static grub_err_t lookup_file(grub_fshelp_node_t node,
 			(*foundnode)->cur_cluster_num = ~0U;
 			(*foundnode)->data = node->data;
 			(*foundnode)->disk = node->disk;
+			(*foundnode)->runs = NULL;
 
 			*foundtype = ((*foundnode)->attr & GRUB_FAT_ATTR_DIRECTORY) ? GRUB_FSHELP_DIR :
 				GRUB_FSHELP_REG;
@@ -604,10 +680,13 @@ grub_fat_dir(grub_disk_t disk, const char* path, grub_fs_dir_hook_t hook,
 {
 	struct grub_fat_data* data = 0;
 	grub_fshelp_node_t found = NULL;
+	struct grub_fshelp_cache cache;
 	grub_err_t err;
 	struct grub_fat_iterate_context ctxt;
 
-	data = grub_exfat_mount(disk);
+	if (grub_exfat_check_bpb(disk))
+		goto fail;
+	data = grub_fs_mount_get(&grub_exfat_fs, disk, grub_exfat_mount_shared, grub_exfat_unmount_shared);
 	if (!data)
 		goto fail;
 
@@ -623,7 +702,9 @@ grub_fat_dir(grub_disk_t disk, const char* path, grub_fs_dir_hook_t hook,
 	  .is_contiguous = 0,
 	};
 
-	err = grub_fshelp_find_file_lookup(path, &root, &found, lookup_file, NULL,
+	grub_fshelp_cache_init(&cache, &grub_exfat_fs, disk, sizeof(struct grub_fshelp_node),
+		offsetof(struct grub_fshelp_node, attr), 0);
+	err = grub_fshelp_find_file_cached(&cache, path, &root, &found, NULL, lookup_file, NULL,
 		GRUB_FSHELP_DIR);
 	if (err)
 		goto fail;
@@ -646,6 +727,17 @@ grub_fat_dir(grub_disk_t disk, const char* path, grub_fs_dir_hook_t hook,
 			ctxt.entry.type_specific.file.m_time),
 			ctxt.entry.type_specific.file.m_time_tenth,
 			&info.mtime);
+		info.attrset = 1;
+		info.attr = ctxt.dir.attr & (GRUB_FAT_ATTR_READ_ONLY | GRUB_FAT_ATTR_HIDDEN
+			| GRUB_FAT_ATTR_SYSTEM | GRUB_FAT_ATTR_ARCHIVE);
+		if (!info.dir)
+		{
+			info.sizeset = 1;
+			info.size = ctxt.dir.file_size;
+			info.allocset = 1;
+			info.alloc_size = ALIGN_UP(info.size,
+				1ULL << (data->cluster_bits + GRUB_DISK_SECTOR_BITS));
+		}
 
 		if (hook(ctxt.filename, &info, hook_data))
 			break;
@@ -658,7 +750,7 @@ fail:
 	if (found != &root)
 		grub_free(found);
 
-	grub_free(data);
+	grub_fs_mount_put(data);
 
 	return grub_errno;
 }
@@ -668,10 +760,13 @@ grub_fat_open(grub_file_t file, const char* name)
 {
 	struct grub_fat_data* data = 0;
 	grub_fshelp_node_t found = NULL;
+	struct grub_fshelp_cache cache;
 	grub_err_t err;
 	grub_disk_t disk = file->disk;
 
-	data = grub_exfat_mount(disk);
+	if (grub_exfat_check_bpb(disk))
+		goto fail;
+	data = grub_fs_mount_get(&grub_exfat_fs, disk, grub_exfat_mount_shared, grub_exfat_unmount_shared);
 	if (!data)
 		goto fail;
 
@@ -687,11 +782,20 @@ grub_fat_open(grub_file_t file, const char* name)
 	  .is_contiguous = 0,
 	};
 
-	err = grub_fshelp_find_file_lookup(name, &root, &found, lookup_file, NULL,
+	grub_fshelp_cache_init(&cache, &grub_exfat_fs, disk, sizeof(struct grub_fshelp_node),
+		offsetof(struct grub_fshelp_node, attr), 0);
+	err = grub_fshelp_find_file_cached(&cache, name, &root, &found, NULL, lookup_file, NULL,
 		GRUB_FSHELP_REG);
 	if (err)
 		goto fail;
 
+	if (!found->is_contiguous)
+	{
+		found->runs = grub_fat_runs_new(&found->data->chain, found->file_cluster);
+		if (!found->runs)
+			goto fail;
+	}
+
 	file->data = found;
 	file->size = found->file_size;
 
@@ -702,7 +806,7 @@ fail:
 	if (found != &root)
 		grub_free(found);
 
-	grub_free(data);
+	grub_fs_mount_put(data);
 
 	return grub_errno;
 }
@@ -715,12 +819,32 @@ grub_fat_read(grub_file_t file, char* buf, grub_size_t len)
 		file->offset, len, buf);
 }
 
+/* Map the cluster chain of the file from its run list.  */
+static grub_err_t
+grub_fat_extents(grub_file_t file, grub_fs_extent_hook_t hook, void* hook_data)
+{
+	grub_fshelp_node_t node = file->data;
+	struct grub_fat_data* data = node->data;
+
+	/* Files without a chain are stored in one piece.  */
+	if (node->is_contiguous)
+	{
+		if (!file->size)
+			return GRUB_ERR_NONE;
+		return hook((data->cluster_sector + ((grub_disk_addr_t)(node->file_cluster - 2) << data->cluster_bits))
+			<< GRUB_DISK_SECTOR_BITS, file->size, hook_data);
+	}
+
+	return grub_fat_runs_extents(file->disk, node->runs, file->size, hook, hook_data);
+}
+
 static grub_err_t
 grub_fat_close(grub_file_t file)
 {
 	grub_fshelp_node_t node = file->data;
 
-	grub_free(node->data);
+	grub_fat_runs_free(node->runs);
+	grub_fs_mount_put(node->data);
 	grub_free(node);
 
 	return grub_errno;
@@ -809,13 +933,157 @@ grub_fat_uuid(grub_disk_t disk, char** uuid)
 	return grub_errno;
 }
 
+/* Load the allocation bitmap of DATA, found in the root directory.
+   Called with the bitmap lock held exclusively.  */
+static grub_err_t
+grub_exfat_load_bitmap(grub_disk_t disk, struct grub_fat_data* data)
+{
+	struct grub_fat_dir_entry dir;
+	grub_ssize_t offset = -(grub_ssize_t)sizeof(dir);
+	grub_uint64_t size = ((grub_uint64_t)data->cluster_count + 7) >> 3;
+	grub_uint8_t* bitmap;
+	grub_ssize_t got;
+	struct grub_fshelp_node node =
+	{
+	  .data = data,
+	  .disk = disk,
+	  .attr = GRUB_FAT_ATTR_DIRECTORY,
+	  .file_size = 0,
+	  .file_cluster = data->root_cluster,
+	  .cur_cluster_num = ~0U,
+	  .cur_cluster = 0,
+	  .is_contiguous = 0,
+	};
+
+	if (size > GRUB_EXFAT_BITMAP_MAX)
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "allocation bitmap too large");
+
+	while (1)
+	{
+		offset += sizeof(dir);
+
+		if (grub_fat_read_data(disk, &node, 0, 0,
+			offset, sizeof(dir), (char*)&dir)
+			!= sizeof(dir) || dir.entry_type == 0)
+			return grub_errno ? grub_errno
+			: grub_error(GRUB_ERR_BAD_FS, "no allocation bitmap");
+
+		/* The first bitmap; the second is only used by TexFAT.  */
+		if (dir.entry_type == 0x81
+			&& !(dir.type_specific.allocation_bitmap.flags & 1))
+			break;
+	}
+
+	if (grub_le_to_cpu64(dir.type_specific.allocation_bitmap.data_length) < size)
+		return grub_error(GRUB_ERR_BAD_FS, "allocation bitmap too small");
+
+	bitmap = grub_malloc((grub_size_t)size);
+	if (!bitmap)
+		return grub_errno;
+
+	/* Read the bitmap a run at a time.  */
+	node.attr = 0;
+	node.file_size = size;
+	node.file_cluster = grub_le_to_cpu32(dir.type_specific.allocation_bitmap.first_cluster);
+	node.runs = grub_fat_runs_new(&data->chain, node.file_cluster);
+	if (!node.runs)
+	{
+		grub_free(bitmap);
+		return grub_errno;
+	}
+	got = grub_fat_read_data(disk, &node, 0, 0, 0, (grub_size_t)size, (char*)bitmap);
+	grub_fat_runs_free(node.runs);
+	if (got != (grub_ssize_t)size)
+	{
+		grub_free(bitmap);
+		return grub_errno ? grub_errno
+			: grub_error(GRUB_ERR_BAD_FS, "allocation bitmap too small");
+	}
+
+	data->bitmap = bitmap;
+	return GRUB_ERR_NONE;
+}
+
+/* Tell from the allocation bitmap whether the volume is in use at
+   OFFSET.  Space outside the cluster heap counts as used.  */
+static grub_err_t
+grub_exfat_query_used(grub_disk_t disk, grub_uint64_t offset,
+	grub_uint64_t len, grub_uint64_t* run, int* used)
+{
+	struct grub_fat_data* data;
+	unsigned bits;
+	grub_uint64_t heap, cluster, end, n;
+	const grub_uint8_t* bitmap;
+	int state;
+
+	data = grub_fs_mount_get(&grub_exfat_fs, disk, grub_exfat_mount_shared, grub_exfat_unmount_shared);
+	if (!data)
+		return grub_errno;
+
+	AcquireSRWLockExclusive(&data->bitmap_lock);
+	if (!data->bitmap)
+		grub_exfat_load_bitmap(disk, data);
+	ReleaseSRWLockExclusive(&data->bitmap_lock);
+	if (!data->bitmap)
+	{
+		grub_fs_mount_put(data);
+		return grub_errno;
+	}
+	bitmap = data->bitmap;
+
+	bits = data->cluster_bits + GRUB_DISK_SECTOR_BITS;
+	heap = (grub_uint64_t)data->cluster_sector << GRUB_DISK_SECTOR_BITS;
+	end = heap + ((grub_uint64_t)data->cluster_count << bits);
+
+	*run = len;
+	*used = 1;
+	if (offset < heap)
+	{
+		if (heap - offset < len)
+			*run = heap - offset;
+	}
+	else if (offset < end)
+	{
+		cluster = (offset - heap) >> bits;
+		state = (bitmap[cluster >> 3] >> (cluster & 7)) & 1;
+		/* Whole bytes of the same state are skipped at once.  */
+		for (n = cluster + 1; n < data->cluster_count
+			&& heap + (n << bits) - offset < len; n++)
+		{
+			while (!(n & 7) && n + 8 <= data->cluster_count
+				&& bitmap[n >> 3] == (state ? 0xff : 0)
+				&& heap + (n << bits) - offset < len)
+				n += 8;
+			if (n >= data->cluster_count || heap + (n << bits) - offset >= len
+				|| ((bitmap[n >> 3] >> (n & 7)) & 1) != state)
+				break;
+		}
+		end = heap + (n << bits);
+		if (end - offset < len)
+			*run = end - offset;
+		*used = state;
+	}
+
+	grub_fs_mount_put(data);
+	return GRUB_ERR_NONE;
+}
+
+static const struct grub_fs_signature grub_exfat_signatures[] =
+{
+	{ 3, 8, "EXFAT   " },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_exfat_fs =
 {
   .name = "exfat",
+  .fs_signatures = grub_exfat_signatures,
   .fs_dir = grub_fat_dir,
   .fs_open = grub_fat_open,
   .fs_read = grub_fat_read,
   .fs_close = grub_fat_close,
+  .fs_extents = grub_fat_extents,
+  .fs_query_used = grub_exfat_query_used,
   .fs_label = grub_fat_label,
   .fs_uuid = grub_fat_uuid,
   .next = 0
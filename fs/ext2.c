@@ -146,6 +146,7 @@
 #define EXT3_JOURNAL_FLAG_LAST_TAG	8
 
 #define EXT4_ENCRYPT_FLAG              0x800
+#define EXT4_HUGE_FILE_FLAG		0x40000
 #define EXT4_EXTENTS_FLAG		0x80000
 
 #include "ext2.h"
@@ -279,6 +280,19 @@ struct grub_fshelp_node
 	int inode_read;
 };
 
+/* The extent tree leaf used last, covering the file blocks FIRST to END
+   of the inode INO of NODE, and the extent of it found last.  */
+struct grub_ext4_cursor
+{
+	int valid;
+	grub_fshelp_node_t node;
+	int ino;
+	grub_uint64_t first;
+	grub_uint64_t end;
+	int last;
+	struct grub_ext4_extent_header* leaf;
+};
+
 /* Information about a "mounted" ext2 filesystem.  */
 struct grub_ext2_data
 {
@@ -287,6 +301,7 @@ struct grub_ext2_data
 	grub_disk_t disk;
 	struct grub_ext2_inode* inode;
 	struct grub_fshelp_node diropen;
+	struct grub_ext4_cursor cursor;
 };
 
 /* Check is a = b^x for some x.  */
@@ -354,15 +369,20 @@ grub_ext2_blockgroup(struct grub_ext2_data* data, grub_uint64_t group,
 		sizeof(struct grub_ext2_block_group), blkgrp);
 }
 
+/* Find the leaf of the extent tree rooted at EXT_BLOCK holding FILEBLOCK,
+   reading the blocks of the tree into BUF, and set *FIRST and *END to
+   the file blocks the leaf covers.  *LEAF is NULL if no leaf does.  */
 static grub_err_t
 grub_ext4_find_leaf(struct grub_ext2_data* data,
 	struct grub_ext4_extent_header* ext_block,
-	grub_uint32_t fileblock,
-	struct grub_ext4_extent_header** leaf)
+	grub_uint32_t fileblock, void* buf,
+	struct grub_ext4_extent_header** leaf,
+	grub_uint64_t* first, grub_uint64_t* end)
 {
 	struct grub_ext4_extent_idx* index;
-	void* buf = NULL;
 	*leaf = NULL;
+	*first = 0;
+	*end = 1ULL << 32;
 
 	while (1)
 	{
@@ -372,7 +392,7 @@ grub_ext4_find_leaf(struct grub_ext2_data* data,
 		index = (struct grub_ext4_extent_idx*)(ext_block + 1);
 
 		if (ext_block->magic != grub_cpu_to_le16_compile_time(EXT4_EXT_MAGIC))
-			goto fail;
+			return GRUB_ERR_BAD_FS;
 
 		if (ext_block->depth == 0)
 		{
@@ -386,32 +406,107 @@ grub_ext4_find_leaf(struct grub_ext2_data* data,
 				break;
 		}
 
+		if (i < grub_le_to_cpu16(ext_block->entries)
+			&& grub_le_to_cpu32(index[i].block) < *end)
+			*end = grub_le_to_cpu32(index[i].block);
+
 		if (--i < 0)
-		{
-			grub_free(buf);
 			return GRUB_ERR_NONE;
-		}
 
+		*first = grub_le_to_cpu32(index[i].block);
 		block = grub_le_to_cpu16(index[i].leaf_hi);
 		block = (block << 32) | grub_le_to_cpu32(index[i].leaf);
-		if (!buf)
-			buf = grub_malloc(EXT2_BLOCK_SIZE(data));
-		if (!buf)
-			goto fail;
 		if (grub_disk_read(data->disk,
 			block << LOG2_EXT2_BLOCK_SIZE(data),
 			0, EXT2_BLOCK_SIZE(data), buf))
-			goto fail;
+			return GRUB_ERR_BAD_FS;
 
 		ext_block = buf;
 	}
-fail:
-	grub_free(buf);
-	return GRUB_ERR_BAD_FS;
+}
+
+/* Find the leaf holding FILEBLOCK of the extent tree of NODE, keeping
+   tree blocks in the cursor so that the following blocks of the file
+   are found without walking the tree again.  */
+static grub_err_t
+grub_ext4_cursor_leaf(grub_fshelp_node_t node, grub_uint32_t fileblock,
+	struct grub_ext4_extent_header** leaf)
+{
+	struct grub_ext2_data* data = node->data;
+	struct grub_ext4_cursor* cur = &data->cursor;
+	struct grub_ext4_extent_header* root;
+	grub_err_t err;
+
+	root = (struct grub_ext4_extent_header*)node->inode.blocks.dir_blocks;
+	if (root->magic == grub_cpu_to_le16_compile_time(EXT4_EXT_MAGIC)
+		&& root->depth == 0)
+	{
+		*leaf = root;
+		return GRUB_ERR_NONE;
+	}
+
+	if (cur->valid && cur->node == node && cur->ino == node->ino
+		&& fileblock >= cur->first && fileblock < cur->end)
+	{
+		*leaf = cur->leaf;
+		return GRUB_ERR_NONE;
+	}
+
+	if (!cur->leaf)
+	{
+		cur->leaf = grub_malloc(EXT2_BLOCK_SIZE(data));
+		if (!cur->leaf)
+			return GRUB_ERR_BAD_FS;
+	}
+
+	cur->valid = 0;
+	err = grub_ext4_find_leaf(data, root, fileblock, cur->leaf, leaf,
+		&cur->first, &cur->end);
+	if (err != GRUB_ERR_NONE || *leaf != cur->leaf)
+		return err;
+
+	cur->node = node;
+	cur->ino = node->ino;
+	cur->last = 0;
+	cur->valid = 1;
+	return GRUB_ERR_NONE;
+}
+
+/* Index of the last extent of LEAF starting at or before FILEBLOCK, or
+   -1.  HINT, the extent found last time, is tried first.  */
+static int
+grub_ext4_find_extent(struct grub_ext4_extent_header* leaf,
+	grub_uint32_t fileblock, int hint)
+{
+	struct grub_ext4_extent* ext = (struct grub_ext4_extent*)(leaf + 1);
+	int entries = grub_le_to_cpu16(leaf->entries);
+	int lo, hi, mid;
+
+	/* Reads going through the file stay in the same extent or move to
+	   the next one.  */
+	for (mid = hint; mid <= hint + 1 && mid < entries; mid++)
+	{
+		if (fileblock >= grub_le_to_cpu32(ext[mid].block)
+			&& (mid + 1 == entries || fileblock < grub_le_to_cpu32(ext[mid + 1].block)))
+			return mid;
+	}
+
+	lo = 0;
+	hi = entries;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (fileblock < grub_le_to_cpu32(ext[mid].block))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo - 1;
 }
 
 static grub_disk_addr_t
-grub_ext2_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
+grub_ext2_read_extent(grub_fshelp_node_t node, grub_disk_addr_t fileblock,
+	grub_disk_addr_t* run)
 {
 	struct grub_ext2_data* data = node->data;
 	struct grub_ext2_inode* inode = &node->inode;
@@ -429,9 +524,8 @@ grub_ext2_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 		int i;
 		grub_disk_addr_t ret;
 
-		if (grub_ext4_find_leaf(data,
-			(struct grub_ext4_extent_header*)inode->blocks.dir_blocks,
-			(grub_uint32_t)fileblock, &leaf) != GRUB_ERR_NONE)
+		if (grub_ext4_cursor_leaf(node, (grub_uint32_t)fileblock, &leaf)
+			!= GRUB_ERR_NONE)
 		{
 			grub_error(GRUB_ERR_BAD_FS, "invalid extent");
 			return (grub_disk_addr_t)-1;
@@ -442,17 +536,24 @@ grub_ext2_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 			return 0;
 
 		ext = (struct grub_ext4_extent*)(leaf + 1);
-		for (i = 0; i < grub_le_to_cpu16(leaf->entries); i++)
-		{
-			if (fileblock < grub_le_to_cpu32(ext[i].block))
-				break;
-		}
+		i = grub_ext4_find_extent(leaf, (grub_uint32_t)fileblock,
+			(leaf == data->cursor.leaf) ? data->cursor.last : 0);
+		if (i >= 0 && leaf == data->cursor.leaf)
+			data->cursor.last = i;
 
-		if (--i >= 0)
+		if (i >= 0)
 		{
-			fileblock -= grub_le_to_cpu32(ext[i].block);
-			if (fileblock >= grub_le_to_cpu16(ext[i].len))
+			grub_disk_addr_t off = fileblock - grub_le_to_cpu32(ext[i].block);
+
+			if (off >= grub_le_to_cpu16(ext[i].len))
+			{
+				/* Sparse up to the next extent.  */
+				if (i + 1 < grub_le_to_cpu16(leaf->entries))
+					*run = grub_le_to_cpu32(ext[i + 1].block) - fileblock;
+				else if (leaf == data->cursor.leaf)
+					*run = data->cursor.end - fileblock;
 				ret = 0;
+			}
 			else
 			{
 				grub_disk_addr_t start;
@@ -460,7 +561,8 @@ grub_ext2_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 				start = grub_le_to_cpu16(ext[i].start_hi);
 				start = (start << 32) + grub_le_to_cpu32(ext[i].start);
 
-				ret = fileblock + start;
+				*run = grub_le_to_cpu16(ext[i].len) - off;
+				ret = off + start;
 			}
 		}
 		else
@@ -469,9 +571,6 @@ grub_ext2_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 			ret = (grub_disk_addr_t)-1;
 		}
 
-		if (leaf != (struct grub_ext4_extent_header*)inode->blocks.dir_blocks)
-			grub_free(leaf);
-
 		return ret;
 	}
 
@@ -526,6 +625,14 @@ indirect:
 	return grub_le_to_cpu32(indir);
 }
 
+static grub_disk_addr_t
+grub_ext2_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
+{
+	grub_disk_addr_t run = 0;
+
+	return grub_ext2_read_extent(node, fileblock, &run);
+}
+
 /* Read LEN bytes from the file described by DATA starting with byte
    POS.  Return the amount of read bytes in READ.  */
 static grub_ssize_t
@@ -535,7 +642,7 @@ grub_ext2_read_file(grub_fshelp_node_t node,
 {
 	return grub_fshelp_read_file(node->data->disk, node,
 		read_hook, read_hook_data,
-		pos, len, buf, grub_ext2_read_block,
+		pos, len, buf, grub_ext2_read_block, grub_ext2_read_extent,
 		grub_cpu_to_le32(node->inode.size)
 		| (((grub_off_t)grub_cpu_to_le32(node->inode.size_high)) << 32),
 		LOG2_EXT2_BLOCK_SIZE(node->data), 0);
@@ -648,6 +755,7 @@ grub_ext2_mount(grub_disk_t disk)
 	data->diropen.inode_read = 1;
 
 	data->inode = &data->diropen.inode;
+	grub_memset(&data->cursor, 0, sizeof(data->cursor));
 
 	grub_ext2_read_inode(data, 2, data->inode);
 	if (grub_errno)
@@ -663,6 +771,14 @@ fail:
 	return 0;
 }
 
+static void
+grub_ext2_unmount(struct grub_ext2_data* data)
+{
+	if (data)
+		grub_free(data->cursor.leaf);
+	grub_free(data);
+}
+
 static char*
 grub_ext2_read_symlink(grub_fshelp_node_t node)
 {
@@ -823,6 +939,7 @@ grub_ext2_open(struct grub_file* file, const char* name)
 {
 	struct grub_ext2_data* data;
 	struct grub_fshelp_node* fdiro = 0;
+	struct grub_fshelp_cache cache;
 	grub_err_t err;
 
 	data = grub_ext2_mount(file->disk);
@@ -832,8 +949,10 @@ grub_ext2_open(struct grub_file* file, const char* name)
 		goto fail;
 	}
 
-	err = grub_fshelp_find_file(name, &data->diropen, &fdiro,
-		grub_ext2_iterate_dir,
+	grub_fshelp_cache_init(&cache, &grub_ext2_fs, file->disk, sizeof(struct grub_fshelp_node),
+		sizeof(struct grub_ext2_data*), 1);
+	err = grub_fshelp_find_file_cached(&cache, name, &data->diropen, &fdiro,
+		grub_ext2_iterate_dir, NULL,
 		grub_ext2_read_symlink, GRUB_FSHELP_REG);
 	if (err)
 		goto fail;
@@ -853,6 +972,8 @@ grub_ext2_open(struct grub_file* file, const char* name)
 
 	grub_memcpy(data->inode, &fdiro->inode, sizeof(struct grub_ext2_inode));
 	grub_free(fdiro);
+	/* The cursor may hold a leaf of the root directory.  */
+	data->cursor.valid = 0;
 
 	file->size = grub_le_to_cpu32(data->inode->size);
 	file->size |= ((grub_off_t)grub_le_to_cpu32(data->inode->size_high)) << 32;
@@ -864,15 +985,25 @@ grub_ext2_open(struct grub_file* file, const char* name)
 fail:
 	if (data && fdiro != &data->diropen)
 		grub_free(fdiro);
-	grub_free(data);
+	grub_ext2_unmount(data);
 
 	return err;
 }
 
+static grub_err_t
+grub_ext2_extents(grub_file_t file, grub_fs_extent_hook_t hook, void* hook_data)
+{
+	struct grub_ext2_data* data = (struct grub_ext2_data*)file->data;
+
+	return grub_fshelp_extents(&data->diropen, grub_ext2_read_block,
+		grub_ext2_read_extent, file->size,
+		LOG2_EXT2_BLOCK_SIZE(data), 0, hook, hook_data);
+}
+
 static grub_err_t
 grub_ext2_close(grub_file_t file)
 {
-	grub_free(file->data);
+	grub_ext2_unmount(file->data);
 
 	return GRUB_ERR_NONE;
 }
@@ -913,13 +1044,27 @@ grub_ext2_dir_iter(const char* filename, enum grub_fshelp_filetype filetype,
 			node->inode_read = 1;
 		grub_errno = GRUB_ERR_NONE;
 	}
+	info.dir = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_DIR);
 	if (node->inode_read)
 	{
 		info.mtimeset = 1;
 		info.mtime = grub_le_to_cpu32(node->inode.mtime);
+		/* Symlinks are sized by their target, left to opening them.  */
+		if ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_REG)
+		{
+			info.sizeset = 1;
+			info.size = grub_le_to_cpu32(node->inode.size)
+				| ((grub_uint64_t)grub_le_to_cpu32(node->inode.size_high) << 32);
+		}
+		/* Huge files count their blocks in filesystem blocks.  */
+		if (!(node->inode.flags & grub_cpu_to_le32_compile_time(EXT4_HUGE_FILE_FLAG)))
+		{
+			info.allocset = 1;
+			info.alloc_size = (grub_uint64_t)grub_le_to_cpu32(node->inode.blockcnt)
+				<< GRUB_DISK_SECTOR_BITS;
+		}
 	}
 
-	info.dir = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_DIR);
 	grub_free(node);
 	return ctx->hook(filename, &info, ctx->hook_data);
 }
@@ -933,13 +1078,16 @@ grub_ext2_dir(grub_disk_t disk, const char* path, grub_fs_dir_hook_t hook, void*
 	  .hook_data = hook_data
 	};
 	struct grub_fshelp_node* fdiro = 0;
+	struct grub_fshelp_cache cache;
 
 	ctx.data = grub_ext2_mount(disk);
 	if (!ctx.data)
 		goto fail;
 
-	grub_fshelp_find_file(path, &ctx.data->diropen, &fdiro,
-		grub_ext2_iterate_dir, grub_ext2_read_symlink,
+	grub_fshelp_cache_init(&cache, &grub_ext2_fs, disk, sizeof(struct grub_fshelp_node),
+		sizeof(struct grub_ext2_data*), 1);
+	grub_fshelp_find_file_cached(&cache, path, &ctx.data->diropen, &fdiro,
+		grub_ext2_iterate_dir, NULL, grub_ext2_read_symlink,
 		GRUB_FSHELP_DIR);
 	if (grub_errno)
 		goto fail;
@@ -949,7 +1097,7 @@ grub_ext2_dir(grub_disk_t disk, const char* path, grub_fs_dir_hook_t hook, void*
 fail:
 	if (ctx.data && fdiro != &ctx.data->diropen)
 		grub_free(fdiro);
-	grub_free(ctx.data);
+	grub_ext2_unmount(ctx.data);
 
 	return grub_errno;
 }
@@ -966,7 +1114,7 @@ grub_ext2_label(grub_disk_t disk, char** label)
 	else
 		*label = NULL;
 
-	grub_free(data);
+	grub_ext2_unmount(data);
 
 	return grub_errno;
 }
@@ -996,7 +1144,7 @@ grub_ext2_uuid(grub_disk_t disk, char** uuid)
 	else
 		*uuid = NULL;
 
-	grub_free(data);
+	grub_ext2_unmount(data);
 
 	return grub_errno;
 }
@@ -1013,18 +1161,26 @@ grub_ext2_mtime(grub_disk_t disk, grub_int64_t* tm)
 	else
 		*tm = grub_le_to_cpu32(data->sblock.utime);
 
-	grub_free(data);
+	grub_ext2_unmount(data);
 
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_ext2_signatures[] =
+{
+	{ 0x438, 2, "\x53\xef" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_ext2_fs =
 {
 	.name = "ext",
+	.fs_signatures = grub_ext2_signatures,
 	.fs_dir = grub_ext2_dir,
 	.fs_open = grub_ext2_open,
 	.fs_read = grub_ext2_read,
 	.fs_close = grub_ext2_close,
+	.fs_extents = grub_ext2_extents,
 	.fs_label = grub_ext2_label,
 	.fs_uuid = grub_ext2_uuid,
 	.fs_mtime = grub_ext2_mtime,
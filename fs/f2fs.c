@@ -944,7 +944,7 @@ grub_f2fs_read_file(grub_fshelp_node_t node,
 
 	return grub_fshelp_read_file(node->data->disk, node,
 		read_hook, read_hook_data,
-		pos, len, buf, grub_f2fs_get_block,
+		pos, len, buf, grub_f2fs_get_block, NULL,
 		filesize,
 		F2FS_BLK_SEC_BITS, 0);
 }
@@ -1313,9 +1313,17 @@ grub_f2fs_uuid(grub_disk_t disk, char** uuid)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_f2fs_signatures[] =
+{
+	{ 0x400, 4, "\x10\x20\xf5\xf2" },
+	{ 0x1400, 4, "\x10\x20\xf5\xf2" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_f2fs_fs =
 {
 	.name = "f2fs",
+	.fs_signatures = grub_f2fs_signatures,
 	.fs_dir = grub_f2fs_dir,
 	.fs_open = grub_f2fs_open,
 	.fs_read = grub_f2fs_read,
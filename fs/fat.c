@@ -24,6 +24,7 @@
 #include "charset.h"
 #include "datetime.h"
 #include "fshelp.h"
+#include "fat_common.h"
 #include "fat.h"
 
 // fuck you microsoft
@@ -105,12 +106,30 @@ struct grub_fat_data
 	grub_uint32_t num_clusters;
 
 	grub_uint32_t uuid;
+
+	/* The FAT in memory, loaded a window at a time as chains are
+	   followed.  FAT12 entries are unpacked to 16 bits.  FAT_WINDOWS is
+	   0 when the FAT is too large and is read entry by entry instead.  */
+	grub_uint32_t fat_windows;
+	void** fat_window;
+	SRWLOCK fat_lock;
+
+	struct grub_fat_chain chain;
 };
 
+/* Entries of the FAT loaded at once.  */
+#define GRUB_FAT_WINDOW_BITS	18
+
+/* FATs larger than this aren't kept in memory.  */
+#define GRUB_FAT_TABLE_MAX	(256U << 20)
+
 struct grub_fshelp_node
 {
 	grub_disk_t disk;
 	struct grub_fat_data* data;
+	/* Only opened files have a run list; it isn't kept with the
+	   directory entries.  */
+	struct grub_fat_runs* runs;
 
 	grub_uint8_t attr;
 
@@ -138,6 +157,10 @@ fat_log2(unsigned x)
 	return i;
 }
 
+static grub_err_t
+grub_fat_next_cluster(grub_disk_t disk, void* fat_data,
+	grub_uint32_t cluster, grub_uint32_t* next);
+
 struct grub_fat_data*
 grub_fat_mount(grub_disk_t disk)
 {
@@ -261,6 +284,13 @@ grub_fat_mount(grub_disk_t disk)
 	if (data->num_sectors <= data->fat_sector)
 		goto fail;
 
+	data->fat_window = NULL;
+	data->fat_windows = 0;
+	if (((grub_uint64_t)data->sectors_per_fat << GRUB_DISK_SECTOR_BITS) <= GRUB_FAT_TABLE_MAX)
+		data->fat_windows = (data->num_clusters + (1U << GRUB_FAT_WINDOW_BITS) - 1)
+		>> GRUB_FAT_WINDOW_BITS;
+	InitializeSRWLock(&data->fat_lock);
+
 	if (grub_disk_read(disk,
 		data->fat_sector,
 		0,
@@ -299,6 +329,13 @@ grub_fat_mount(grub_disk_t disk)
 	if ((first_fat | 0x8) != (magic | bpb.media | 0x8))
 		goto fail;
 
+	data->chain.next = grub_fat_next_cluster;
+	data->chain.data = data;
+	data->chain.num_clusters = data->num_clusters;
+	data->chain.eof_mark = data->cluster_eof_mark;
+	data->chain.cluster_sector = data->cluster_sector;
+	data->chain.cluster_bits = data->cluster_bits;
+
 	return data;
 
 fail:
@@ -308,6 +345,232 @@ fail:
 	return 0;
 }
 
+void
+grub_fat_unmount(struct grub_fat_data* data)
+{
+	grub_uint32_t i;
+
+	if (!data)
+		return;
+	if (data->fat_window)
+	{
+		for (i = 0; i < data->fat_windows; i++)
+			grub_free(data->fat_window[i]);
+		grub_free(data->fat_window);
+	}
+	grub_free(data);
+}
+
+/* Check the BPB on DISK itself, so that probing a disk which isn't FAT
+   doesn't open another disk for the mount cache.  */
+static grub_err_t
+grub_fat_check_bpb(grub_disk_t disk)
+{
+	grub_current_fat_bpb_t bpb;
+	int bits;
+
+	if (grub_disk_read(disk, 0, 0, sizeof(bpb), &bpb))
+		goto fail;
+
+	bits = fat_log2(grub_le_to_cpu16(bpb.bytes_per_sector));
+	if (bits < GRUB_DISK_SECTOR_BITS || bits >= 16
+		|| fat_log2(bpb.sectors_per_cluster) < 0
+		|| bpb.num_reserved_sectors == 0
+		|| bpb.num_fats == 0
+		|| (!bpb.sectors_per_fat_16 && !bpb.version_specific.fat32.sectors_per_fat_32)
+		|| (!bpb.num_total_sectors_16 && !bpb.num_total_sectors_32))
+		goto fail;
+
+	return GRUB_ERR_NONE;
+
+fail:
+
+	return grub_error(GRUB_ERR_BAD_FS, "not a FAT filesystem");
+}
+
+static void*
+grub_fat_mount_shared(grub_disk_t disk)
+{
+	return grub_fat_mount(disk);
+}
+
+static void
+grub_fat_unmount_shared(void* data)
+{
+	grub_fat_unmount(data);
+}
+
+/* Read the window W of the FAT in one go, unpacking FAT12 entries.  */
+static void*
+grub_fat_load_window(grub_disk_t disk, struct grub_fat_data* data, grub_uint32_t w)
+{
+	grub_uint32_t first = w << GRUB_FAT_WINDOW_BITS;
+	grub_uint32_t count = data->num_clusters - first;
+	grub_uint64_t offset, bytes, fat_bytes;
+	grub_uint8_t* raw;
+	grub_uint16_t* entry;
+	grub_uint32_t i;
+
+	if (count > (1U << GRUB_FAT_WINDOW_BITS))
+		count = 1U << GRUB_FAT_WINDOW_BITS;
+
+	switch (data->fat_size)
+	{
+	case 32:
+		offset = (grub_uint64_t)first << 2;
+		bytes = (grub_uint64_t)count << 2;
+		break;
+	case 16:
+		offset = (grub_uint64_t)first << 1;
+		bytes = (grub_uint64_t)count << 1;
+		break;
+	default:
+		/* case 12: windows start on an even entry.  */
+		offset = first + (first >> 1);
+		bytes = ((grub_uint64_t)count * 3 + 1) >> 1;
+		break;
+	}
+
+	/* Two spare bytes let FAT12 unpack whole entry pairs.  */
+	raw = grub_zalloc(bytes + 2);
+	if (!raw)
+		return NULL;
+
+	/* Entries past the end of the FAT read as free.  */
+	fat_bytes = (grub_uint64_t)data->sectors_per_fat << GRUB_DISK_SECTOR_BITS;
+	if (offset < fat_bytes
+		&& grub_disk_read(disk, data->fat_sector, offset,
+			(grub_size_t)((offset + bytes > fat_bytes) ? fat_bytes - offset : bytes), raw))
+	{
+		grub_free(raw);
+		return NULL;
+	}
+
+	if (data->fat_size != 12)
+		return raw;
+
+	entry = grub_malloc((grub_size_t)count * sizeof(*entry) + sizeof(*entry));
+	if (!entry)
+	{
+		grub_free(raw);
+		return NULL;
+	}
+	/* Three bytes hold two entries.  */
+	for (i = 0; i < count; i += 2)
+	{
+		const grub_uint8_t* p = raw + (i >> 1) * 3;
+
+		entry[i] = (grub_uint16_t)(p[0] | ((p[1] & 0x0f) << 8));
+		entry[i + 1] = (grub_uint16_t)((p[1] >> 4) | (p[2] << 4));
+	}
+	grub_free(raw);
+	return entry;
+}
+
+/* Set *ENTRY to the FAT entry of CLUSTER from the FAT in memory,
+   loading its window if needed.  Return 0 if the entry must be read
+   from disk instead.  */
+static int
+grub_fat_table_entry(grub_disk_t disk, struct grub_fat_data* data,
+	grub_uint32_t cluster, grub_uint32_t* entry)
+{
+	grub_uint32_t w = cluster >> GRUB_FAT_WINDOW_BITS;
+	grub_uint32_t i = cluster & ((1U << GRUB_FAT_WINDOW_BITS) - 1);
+	void* win;
+
+	if (w >= data->fat_windows)
+		return 0;
+
+	AcquireSRWLockShared(&data->fat_lock);
+	win = data->fat_window ? data->fat_window[w] : NULL;
+	ReleaseSRWLockShared(&data->fat_lock);
+
+	if (!win)
+	{
+		AcquireSRWLockExclusive(&data->fat_lock);
+		if (!data->fat_window)
+			data->fat_window = grub_zalloc(data->fat_windows * sizeof(void*));
+		if (data->fat_window && !data->fat_window[w])
+			data->fat_window[w] = grub_fat_load_window(disk, data, w);
+		win = data->fat_window ? data->fat_window[w] : NULL;
+		ReleaseSRWLockExclusive(&data->fat_lock);
+		if (!win)
+		{
+			grub_errno = GRUB_ERR_NONE;
+			return 0;
+		}
+	}
+
+	/* Loaded windows stay until unmount.  */
+	if (data->fat_size == 32)
+		*entry = grub_le_to_cpu32(((const grub_uint32_t*)win)[i]);
+	else if (data->fat_size == 16)
+		*entry = grub_le_to_cpu16(((const grub_uint16_t*)win)[i]);
+	else
+		*entry = ((const grub_uint16_t*)win)[i];
+	return 1;
+}
+
+/* Set *NEXT to the cluster after CLUSTER in the FAT, which is at least
+   the end of chain mark after the last cluster.  */
+static grub_err_t
+grub_fat_next_cluster(grub_disk_t disk, void* fat_data,
+	grub_uint32_t cluster, grub_uint32_t* next)
+{
+	struct grub_fat_data* data = fat_data;
+	grub_uint32_t next_cluster = 0;
+	grub_uint32_t fat_offset;
+
+	if (grub_fat_table_entry(disk, data, cluster, &next_cluster))
+		goto check;
+
+	switch (data->fat_size)
+	{
+	case 32:
+		fat_offset = cluster << 2;
+		break;
+	case 16:
+		fat_offset = cluster << 1;
+		break;
+	default:
+		/* case 12: */
+		fat_offset = cluster + (cluster >> 1);
+		break;
+	}
+
+	/* Read the FAT.  */
+	if (grub_disk_read(disk, data->fat_sector, fat_offset,
+		(7ULL + data->fat_size) >> 3,
+		(char*)&next_cluster))
+		return grub_errno;
+
+	next_cluster = grub_le_to_cpu32(next_cluster);
+	switch (data->fat_size)
+	{
+	case 16:
+		next_cluster &= 0xFFFF;
+		break;
+	case 12:
+		if (cluster & 1)
+			next_cluster >>= 4;
+
+		next_cluster &= 0x0FFF;
+		break;
+	}
+
+check:
+
+	grub_dprintf("fat", "fat_size=%d, next_cluster=%u\n",
+		data->fat_size, next_cluster);
+
+	if (next_cluster < data->cluster_eof_mark
+		&& (next_cluster < 2 || next_cluster >= data->num_clusters))
+		return grub_error(GRUB_ERR_BAD_FS, "invalid cluster %u", next_cluster);
+
+	*next = next_cluster;
+	return GRUB_ERR_NONE;
+}
+
 static grub_ssize_t
 grub_fat_read_data(grub_disk_t disk, grub_fshelp_node_t node,
 	grub_disk_read_hook_t read_hook, void* read_hook_data,
@@ -333,6 +596,10 @@ grub_fat_read_data(grub_disk_t disk, grub_fshelp_node_t node,
 		return size;
 	}
 
+	if (node->runs)
+		return grub_fat_runs_read(disk, node->runs, read_hook, read_hook_data,
+			offset, len, buf);
+
 	/* Calculate the logical cluster number and offset.  */
 	logical_cluster_bits = (node->data->cluster_bits
 		+ GRUB_DISK_SECTOR_BITS);
@@ -351,56 +618,14 @@ grub_fat_read_data(grub_disk_t disk, grub_fshelp_node_t node,
 		{
 			/* Find next cluster.  */
 			grub_uint32_t next_cluster;
-			grub_uint32_t fat_offset;
-
-			switch (node->data->fat_size)
-			{
-			case 32:
-				fat_offset = node->cur_cluster << 2;
-				break;
-			case 16:
-				fat_offset = node->cur_cluster << 1;
-				break;
-			default:
-				/* case 12: */
-				fat_offset = node->cur_cluster + (node->cur_cluster >> 1);
-				break;
-			}
 
-			/* Read the FAT.  */
-			if (grub_disk_read(disk, node->data->fat_sector, fat_offset,
-				(7ULL + node->data->fat_size) >> 3,
-				(char*)&next_cluster))
+			if (grub_fat_next_cluster(disk, node->data, node->cur_cluster, &next_cluster))
 				return -1;
 
-			next_cluster = grub_le_to_cpu32(next_cluster);
-			switch (node->data->fat_size)
-			{
-			case 16:
-				next_cluster &= 0xFFFF;
-				break;
-			case 12:
-				if (node->cur_cluster & 1)
-					next_cluster >>= 4;
-
-				next_cluster &= 0x0FFF;
-				break;
-			}
-
-			grub_dprintf("fat", "fat_size=%d, next_cluster=%u\n",
-				node->data->fat_size, next_cluster);
-
 			/* Check the end.  */
 			if (next_cluster >= node->data->cluster_eof_mark)
 				return ret;
 
-			if (next_cluster < 2 || next_cluster >= node->data->num_clusters)
-			{
-				grub_error(GRUB_ERR_BAD_FS, "invalid cluster %u",
-					next_cluster);
-				return -1;
-			}
-
 			node->cur_cluster = next_cluster;
 			node->cur_cluster_num++;
 		}
@@ -648,6 +873,7 @@ static grub_err_t lookup_file(grub_fshelp_node_t node,
 			(*foundnode)->cur_cluster_num = ~0U;
 			(*foundnode)->data = node->data;
 			(*foundnode)->disk = node->disk;
+			(*foundnode)->runs = NULL;
 
 			*foundtype = ((*foundnode)->attr & GRUB_FAT_ATTR_DIRECTORY) ? GRUB_FSHELP_DIR :
 				GRUB_FSHELP_REG;
@@ -671,10 +897,13 @@ grub_fat_dir(grub_disk_t disk, const char* path, grub_fs_dir_hook_t hook,
 {
 	struct grub_fat_data* data = 0;
 	grub_fshelp_node_t found = NULL;
+	struct grub_fshelp_cache cache;
 	grub_err_t err;
 	struct grub_fat_iterate_context ctxt;
 
-	data = grub_fat_mount(disk);
+	if (grub_fat_check_bpb(disk))
+		goto fail;
+	data = grub_fs_mount_get(&grub_fat_fs, disk, grub_fat_mount_shared, grub_fat_unmount_shared);
 	if (!data)
 		goto fail;
 
@@ -689,7 +918,9 @@ grub_fat_dir(grub_disk_t disk, const char* path, grub_fs_dir_hook_t hook,
 	  .cur_cluster = 0,
 	};
 
-	err = grub_fshelp_find_file_lookup(path, &root, &found, lookup_file, NULL,
+	grub_fshelp_cache_init(&cache, &grub_fat_fs, disk, sizeof(struct grub_fshelp_node),
+		offsetof(struct grub_fshelp_node, attr), 0);
+	err = grub_fshelp_find_file_cached(&cache, path, &root, &found, NULL, lookup_file, NULL,
 		GRUB_FSHELP_DIR);
 	if (err)
 		goto fail;
@@ -711,6 +942,17 @@ grub_fat_dir(grub_disk_t disk, const char* path, grub_fs_dir_hook_t hook,
 		info.mtimeset = grub_fat_timestamp(grub_le_to_cpu16(ctxt.dir.w_time),
 			grub_le_to_cpu16(ctxt.dir.w_date),
 			&info.mtime);
+		info.attrset = 1;
+		info.attr = ctxt.dir.attr & (GRUB_FAT_ATTR_READ_ONLY | GRUB_FAT_ATTR_HIDDEN
+			| GRUB_FAT_ATTR_SYSTEM | GRUB_FAT_ATTR_ARCHIVE);
+		if (!info.dir)
+		{
+			info.sizeset = 1;
+			info.size = grub_le_to_cpu32(ctxt.dir.file_size);
+			info.allocset = 1;
+			info.alloc_size = ALIGN_UP(info.size,
+				1ULL << (data->cluster_bits + GRUB_DISK_SECTOR_BITS));
+		}
 
 		if (hook(ctxt.filename, &info, hook_data))
 			break;
@@ -723,7 +965,7 @@ fail:
 	if (found != &root)
 		grub_free(found);
 
-	grub_free(data);
+	grub_fs_mount_put(data);
 
 	return grub_errno;
 }
@@ -733,10 +975,13 @@ grub_fat_open(grub_file_t file, const char* name)
 {
 	struct grub_fat_data* data = 0;
 	grub_fshelp_node_t found = NULL;
+	struct grub_fshelp_cache cache;
 	grub_err_t err;
 	grub_disk_t disk = file->disk;
 
-	data = grub_fat_mount(disk);
+	if (grub_fat_check_bpb(disk))
+		goto fail;
+	data = grub_fs_mount_get(&grub_fat_fs, disk, grub_fat_mount_shared, grub_fat_unmount_shared);
 	if (!data)
 		goto fail;
 
@@ -751,11 +996,17 @@ grub_fat_open(grub_file_t file, const char* name)
 	  .cur_cluster = 0,
 	};
 
-	err = grub_fshelp_find_file_lookup(name, &root, &found, lookup_file, NULL,
+	grub_fshelp_cache_init(&cache, &grub_fat_fs, disk, sizeof(struct grub_fshelp_node),
+		offsetof(struct grub_fshelp_node, attr), 0);
+	err = grub_fshelp_find_file_cached(&cache, name, &root, &found, NULL, lookup_file, NULL,
 		GRUB_FSHELP_REG);
 	if (err)
 		goto fail;
 
+	found->runs = grub_fat_runs_new(&found->data->chain, found->file_cluster);
+	if (!found->runs)
+		goto fail;
+
 	file->data = found;
 	file->size = found->file_size;
 
@@ -766,7 +1017,7 @@ fail:
 	if (found != &root)
 		grub_free(found);
 
-	grub_free(data);
+	grub_fs_mount_put(data);
 
 	return grub_errno;
 }
@@ -779,12 +1030,22 @@ grub_fat_read(grub_file_t file, char* buf, grub_size_t len)
 		file->offset, len, buf);
 }
 
+/* Map the cluster chain of the file from its run list.  */
+static grub_err_t
+grub_fat_extents(grub_file_t file, grub_fs_extent_hook_t hook, void* hook_data)
+{
+	grub_fshelp_node_t node = file->data;
+
+	return grub_fat_runs_extents(file->disk, node->runs, file->size, hook, hook_data);
+}
+
 static grub_err_t
 grub_fat_close(grub_file_t file)
 {
 	grub_fshelp_node_t node = file->data;
 
-	grub_free(node->data);
+	grub_fat_runs_free(node->runs);
+	grub_fs_mount_put(node->data);
 	grub_free(node);
 
 	return grub_errno;
@@ -827,7 +1088,7 @@ grub_fat_label(grub_disk_t disk, char** label)
 
 fail:
 
-	grub_free(root.data);
+	grub_fat_unmount(root.data);
 
 	return grub_errno;
 }
@@ -847,7 +1108,7 @@ grub_fat_uuid(grub_disk_t disk, char** uuid)
 	else
 		*uuid = NULL;
 
-	grub_free(data);
+	grub_fat_unmount(data);
 
 	return grub_errno;
 }
@@ -859,6 +1120,7 @@ struct grub_fs grub_fat_fs =
   .fs_open = grub_fat_open,
   .fs_read = grub_fat_read,
   .fs_close = grub_fat_close,
+  .fs_extents = grub_fat_extents,
   .fs_label = grub_fat_label,
   .fs_uuid = grub_fat_uuid,
   .next = 0
@@ -71,5 +71,6 @@ PRAGMA_END_PACKED
 
 struct grub_fat_data;
 struct grub_fat_data* grub_fat_mount(grub_disk_t disk);
+void grub_fat_unmount(struct grub_fat_data* data);
 
 #endif
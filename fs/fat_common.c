@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2022  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compat.h"
+#include "disk.h"
+#include "fs.h"
+#include "fat_common.h"
+
+/* Cluster run lists, shared by the FAT and exFAT drivers.  */
+
+struct grub_fat_runs*
+grub_fat_runs_new(const struct grub_fat_chain* chain, grub_uint32_t first_cluster)
+{
+	struct grub_fat_runs* runs;
+
+	runs = grub_zalloc(sizeof(*runs));
+	if (!runs)
+		return NULL;
+	runs->chain = chain;
+	runs->next_cluster = first_cluster;
+	/* Empty files have no clusters.  */
+	runs->done = (first_cluster == 0);
+	return runs;
+}
+
+void
+grub_fat_runs_free(struct grub_fat_runs* runs)
+{
+	if (runs)
+		grub_free(runs->run);
+	grub_free(runs);
+}
+
+/* Follow the chain of RUNS up to the logical cluster UPTO, or to its
+   end, adding the clusters found to the run list.  */
+grub_err_t
+grub_fat_runs_extend(grub_disk_t disk, struct grub_fat_runs* runs, grub_uint32_t upto)
+{
+	const struct grub_fat_chain* chain = runs->chain;
+	struct grub_fat_run* last;
+	grub_uint32_t cluster, next;
+
+	while (!runs->done && runs->next_logical <= upto)
+	{
+		cluster = runs->next_cluster;
+		if (cluster < 2 || cluster >= chain->num_clusters)
+			return grub_error(GRUB_ERR_BAD_FS, "invalid cluster %u", cluster);
+		if (chain->next(disk, chain->data, cluster, &next))
+			return grub_errno;
+
+		last = runs->count ? &runs->run[runs->count - 1] : NULL;
+		if (last && last->cluster + last->count == cluster)
+			last->count++;
+		else
+		{
+			if (runs->count == runs->alloc)
+			{
+				grub_uint32_t alloc = runs->alloc ? runs->alloc * 2 : 16;
+				struct grub_fat_run* run;
+
+				run = grub_realloc(runs->run, alloc * sizeof(*run));
+				if (!run)
+					return grub_errno;
+				runs->run = run;
+				runs->alloc = alloc;
+			}
+			last = &runs->run[runs->count++];
+			last->logical = runs->next_logical;
+			last->cluster = cluster;
+			last->count = 1;
+		}
+
+		runs->next_logical++;
+		runs->next_cluster = next;
+		if (next >= chain->eof_mark)
+			runs->done = 1;
+	}
+	return GRUB_ERR_NONE;
+}
+
+/* Find the run holding the mapped logical cluster LOGICAL.  */
+static struct grub_fat_run*
+grub_fat_runs_find(struct grub_fat_runs* runs, grub_uint32_t logical)
+{
+	grub_uint32_t lo = 0, hi = runs->count, mid;
+
+	while (hi - lo > 1)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (runs->run[mid].logical <= logical)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return &runs->run[lo];
+}
+
+static grub_disk_addr_t
+grub_fat_run_sector(const struct grub_fat_chain* chain, const struct grub_fat_run* run)
+{
+	return chain->cluster_sector
+		+ ((grub_disk_addr_t)(run->cluster - 2) << chain->cluster_bits);
+}
+
+/* Read LEN bytes at OFFSET through the run list RUNS, a run at a time.
+   Reading stops at the end of the chain.  */
+grub_ssize_t
+grub_fat_runs_read(grub_disk_t disk, struct grub_fat_runs* runs,
+	grub_disk_read_hook_t read_hook, void* read_hook_data,
+	grub_off_t offset, grub_size_t len, char* buf)
+{
+	unsigned bits = runs->chain->cluster_bits + GRUB_DISK_SECTOR_BITS;
+	struct grub_fat_run* run;
+	grub_uint64_t skip, avail;
+	grub_ssize_t ret = 0;
+	grub_size_t size;
+
+	if (len == 0)
+		return 0;
+
+	if (grub_fat_runs_extend(disk, runs,
+		(grub_uint32_t)((offset + len - 1) >> bits)))
+		return -1;
+
+	while (len && (offset >> bits) < runs->next_logical)
+	{
+		run = grub_fat_runs_find(runs, (grub_uint32_t)(offset >> bits));
+		skip = offset - ((grub_uint64_t)run->logical << bits);
+		avail = ((grub_uint64_t)run->count << bits) - skip;
+		size = (avail < len) ? (grub_size_t)avail : len;
+
+		disk->read_hook = read_hook;
+		disk->read_hook_data = read_hook_data;
+		grub_disk_read(disk, grub_fat_run_sector(runs->chain, run), skip, size, buf);
+		disk->read_hook = 0;
+		if (grub_errno)
+			return -1;
+
+		len -= size;
+		buf += size;
+		ret += size;
+		offset += size;
+	}
+
+	return ret;
+}
+
+/* Call HOOK with the disk extents of the first SIZE bytes of RUNS.  */
+grub_err_t
+grub_fat_runs_extents(grub_disk_t disk, struct grub_fat_runs* runs,
+	grub_uint64_t size, grub_fs_extent_hook_t hook, void* hook_data)
+{
+	unsigned bits = runs->chain->cluster_bits + GRUB_DISK_SECTOR_BITS;
+	grub_uint64_t len;
+	grub_uint32_t i;
+
+	if (!size)
+		return GRUB_ERR_NONE;
+	if (grub_fat_runs_extend(disk, runs, (grub_uint32_t)((size - 1) >> bits)))
+		return grub_errno;
+	if (((grub_uint64_t)runs->next_logical << bits) < size)
+		return grub_error(GRUB_ERR_BAD_FS, "cluster chain shorter than file");
+
+	for (i = 0; size && i < runs->count; i++)
+	{
+		len = (grub_uint64_t)runs->run[i].count << bits;
+		if (len > size)
+			len = size;
+		if (hook(grub_fat_run_sector(runs->chain, &runs->run[i]) << GRUB_DISK_SECTOR_BITS,
+			len, hook_data))
+			return grub_errno;
+		size -= len;
+	}
+	return GRUB_ERR_NONE;
+}
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2022  Free Software Foundation, Inc.
+ *
+ *  GRUB is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  GRUB is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with GRUB.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FAT_COMMON_HEADER
+#define _FAT_COMMON_HEADER 1
+
+#include "compat.h"
+#include "disk.h"
+#include "fs.h"
+
+/* Set *NEXT to the cluster after CLUSTER in the FAT of DATA, which is at
+   least the end of chain mark after the last cluster.  */
+typedef grub_err_t(*grub_fat_next_t) (grub_disk_t disk, void* data,
+	grub_uint32_t cluster, grub_uint32_t* next);
+
+/* How cluster chains of a FAT or exFAT volume are followed, and where
+   their clusters are.  */
+struct grub_fat_chain
+{
+	grub_fat_next_t next;
+	void* data;
+	grub_uint32_t num_clusters;
+	grub_uint32_t eof_mark;
+	grub_disk_addr_t cluster_sector;
+	int cluster_bits;
+};
+
+/* Adjacent clusters of a file, starting at the logical cluster LOGICAL.  */
+struct grub_fat_run
+{
+	grub_uint32_t logical;
+	grub_uint32_t cluster;
+	grub_uint32_t count;
+};
+
+/* The cluster chain of a file as a run list, mapped as far as it has
+   been read.  NEXT_CLUSTER is the cluster of the logical cluster
+   NEXT_LOGICAL, unless the end of the chain was reached.  */
+struct grub_fat_runs
+{
+	const struct grub_fat_chain* chain;
+	struct grub_fat_run* run;
+	grub_uint32_t count;
+	grub_uint32_t alloc;
+	grub_uint32_t next_logical;
+	grub_uint32_t next_cluster;
+	int done;
+};
+
+struct grub_fat_runs* grub_fat_runs_new(const struct grub_fat_chain* chain,
+	grub_uint32_t first_cluster);
+void grub_fat_runs_free(struct grub_fat_runs* runs);
+grub_err_t grub_fat_runs_extend(grub_disk_t disk, struct grub_fat_runs* runs,
+	grub_uint32_t upto);
+grub_ssize_t grub_fat_runs_read(grub_disk_t disk, struct grub_fat_runs* runs,
+	grub_disk_read_hook_t read_hook, void* read_hook_data,
+	grub_off_t offset, grub_size_t len, char* buf);
+grub_err_t grub_fat_runs_extents(grub_disk_t disk, struct grub_fat_runs* runs,
+	grub_uint64_t size, grub_fs_extent_hook_t hook, void* hook_data);
+
+#endif
@@ -1405,9 +1405,16 @@ grub_hfs_uuid(grub_disk_t disk, char** uuid)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_hfs_signatures[] =
+{
+	{ 0x400, 2, "BD" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_hfs_fs =
 {
   .name = "hfs",
+  .fs_signatures = grub_hfs_signatures,
   .fs_dir = grub_hfs_dir,
   .fs_open = grub_hfs_open,
   .fs_read = grub_hfs_read,
@@ -497,7 +497,7 @@ grub_hfsplus_read_file(grub_fshelp_node_t node,
 {
 	return grub_fshelp_read_file(node->data->disk, node,
 		read_hook, read_hook_data,
-		pos, len, buf, grub_hfsplus_read_block,
+		pos, len, buf, grub_hfsplus_read_block, NULL,
 		node->size,
 		node->data->log2blksize - GRUB_DISK_SECTOR_BITS,
 		node->data->embedded_offset);
@@ -1378,9 +1378,18 @@ grub_hfsplus_uuid(grub_disk_t disk, char** uuid)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_hfsplus_signatures[] =
+{
+	{ 0x400, 2, "H+" },
+	{ 0x400, 2, "HX" },
+	{ 0x400, 2, "BD" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_hfsplus_fs =
 {
   .name = "hfsplus",
+  .fs_signatures = grub_hfsplus_signatures,
   .fs_dir = grub_hfsplus_dir,
   .fs_open = grub_hfsplus_open,
   .fs_read = grub_hfsplus_read,
@@ -177,6 +177,7 @@ enum
 	FLAG_TYPE_PLAIN = 0,
 	FLAG_TYPE_DIR = 2,
 	FLAG_TYPE = 3,
+	FLAG_HIDDEN = 1,
 	FLAG_MORE_EXTENTS = 0x80
 };
 
@@ -897,6 +898,13 @@ grub_iso9660_dir_iter(const char* filename,
 	grub_memset(&info, 0, sizeof(info));
 	info.dir = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_DIR);
 	info.mtimeset = !!iso9660_to_unixtime2(&node->dirents[0].mtime, &info.mtime);
+	info.attrset = 1;
+	info.attr = (node->dirents[0].flags & FLAG_HIDDEN) ? GRUB_DIRHOOK_ATTR_HIDDEN : 0;
+	if (!info.dir)
+	{
+		info.sizeset = 1;
+		info.size = get_node_size(node);
+	}
 
 	grub_free(node);
 	return ctx->hook(filename, &info, ctx->hook_data);
@@ -999,6 +1007,25 @@ grub_iso9660_read(grub_file_t file, char* buf, grub_size_t len)
 	return len;
 }
 
+static grub_err_t
+grub_iso9660_extents(grub_file_t file, grub_fs_extent_hook_t hook, void* hook_data)
+{
+	struct grub_iso9660_data* data = (struct grub_iso9660_data*)file->data;
+	grub_fshelp_node_t node = data->node;
+	grub_size_t i;
+
+	for (i = 0; i < node->have_dirents; i++)
+	{
+		if (!node->dirents[i].size)
+			continue;
+		if (hook((grub_disk_addr_t)grub_le_to_cpu32(node->dirents[i].first_sector)
+			<< (GRUB_ISO9660_LOG2_BLKSZ + GRUB_DISK_SECTOR_BITS),
+			grub_le_to_cpu32(node->dirents[i].size), hook_data))
+			return grub_errno;
+	}
+	return GRUB_ERR_NONE;
+}
+
 static grub_err_t
 grub_iso9660_close(grub_file_t file)
 {
@@ -1111,13 +1138,21 @@ grub_iso9660_mtime(grub_disk_t disk, grub_int64_t* timebuf)
 	return err;
 }
 
+static const struct grub_fs_signature grub_iso9660_signatures[] =
+{
+	{ 0x8001, 5, "CD001" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_iso9660_fs =
 {
 	.name = "iso9660",
+	.fs_signatures = grub_iso9660_signatures,
 	.fs_dir = grub_iso9660_dir,
 	.fs_open = grub_iso9660_open,
 	.fs_read = grub_iso9660_read,
 	.fs_close = grub_iso9660_close,
+	.fs_extents = grub_iso9660_extents,
 	.fs_label = grub_iso9660_label,
 	.fs_uuid = grub_iso9660_uuid,
 	.fs_mtime = grub_iso9660_mtime,
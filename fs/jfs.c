@@ -918,9 +918,16 @@ grub_jfs_label(grub_disk_t disk, char** label)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_jfs_signatures[] =
+{
+	{ 0x8000, 4, "JFS1" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_jfs_fs =
 {
 	.name = "jfs",
+	.fs_signatures = grub_jfs_signatures,
 	.fs_dir = grub_jfs_dir,
 	.fs_open = grub_jfs_open,
 	.fs_read = grub_jfs_read,
@@ -729,6 +729,24 @@ grub_ntfs_read_block(grub_fshelp_node_t node, grub_disk_addr_t block)
 			ctx->curr_vcn + ctx->curr_lcn);
 }
 
+static grub_disk_addr_t
+grub_ntfs_read_extent(grub_fshelp_node_t node, grub_disk_addr_t block,
+	grub_disk_addr_t* run)
+{
+	struct grub_ntfs_rlst* ctx;
+
+	ctx = (struct grub_ntfs_rlst*)node;
+	while (block >= ctx->next_vcn)
+	{
+		if (grub_ntfs_read_run_list(ctx))
+			return (grub_disk_addr_t)-1;
+	}
+	/* The rest of the current run.  */
+	*run = ctx->next_vcn - block;
+	return (ctx->flags & GRUB_NTFS_RF_BLNK) ? 0 : (block -
+		ctx->curr_vcn + ctx->curr_lcn);
+}
+
 static grub_err_t
 read_data(struct grub_ntfs_attr* at, grub_uint8_t* pa, grub_uint8_t* dest,
 	grub_disk_addr_t ofs, grub_size_t len, int cached,
@@ -799,7 +817,7 @@ read_data(struct grub_ntfs_attr* at, grub_uint8_t* pa, grub_uint8_t* dest,
 	grub_fshelp_read_file(ctx->comp.disk, (grub_fshelp_node_t)ctx,
 		read_hook, read_hook_data, ofs, len,
 		(char*)dest,
-		grub_ntfs_read_block, ofs + len,
+		grub_ntfs_read_block, grub_ntfs_read_extent, ofs + len,
 		ctx->comp.log_spc, 0);
 	return grub_errno;
 }
@@ -978,6 +996,9 @@ list_file(struct grub_ntfs_file* diro, grub_uint8_t* pos,
 			fdiro->data = diro->data;
 			fdiro->ino = u64at(pos, 0) & 0xffffffffffffULL;
 			fdiro->mtime = u64at(pos, 0x20);
+			fdiro->alloc_size = u64at(pos, 0x38);
+			fdiro->size = u64at(pos, 0x40);
+			fdiro->flags = attr;
 
 			ustr = get_utf8(np, ns);
 			if (ustr == NULL)
@@ -1363,6 +1384,15 @@ grub_ntfs_dir_iter(const char* filename, enum grub_fshelp_filetype filetype,
 	info.mtime = node->mtime / 10000000
 		- 86400ULL * 365 * (1970 - 1601)
 		- 86400ULL * ((1970 - 1601) / 4) + 86400ULL * ((1970 - 1601) / 100);
+	info.attrset = 1;
+	info.attr = node->flags & 0xffff;
+	if (!info.dir)
+	{
+		info.sizeset = 1;
+		info.size = node->size;
+		info.allocset = 1;
+		info.alloc_size = node->alloc_size;
+	}
 	grub_free(node);
 	return ctx->hook(filename, &info, ctx->hook_data);
 }
@@ -1374,13 +1404,16 @@ grub_ntfs_dir(grub_disk_t disk, const char* path,
 	struct grub_ntfs_dir_ctx ctx = { hook, hook_data };
 	struct grub_ntfs_data* data = 0;
 	struct grub_fshelp_node* fdiro = 0;
+	struct grub_fshelp_cache cache;
 
 	data = grub_ntfs_mount(disk);
 	if (!data)
 		goto fail;
 
-	grub_fshelp_find_file(path, &data->cmft, &fdiro, grub_ntfs_iterate_dir,
-		grub_ntfs_read_symlink, GRUB_FSHELP_DIR);
+	grub_fshelp_cache_init(&cache, &grub_ntfs_fs, disk, sizeof(struct grub_ntfs_file),
+		sizeof(struct grub_ntfs_data*), 1);
+	grub_fshelp_find_file_cached(&cache, path, &data->cmft, &fdiro, grub_ntfs_iterate_dir,
+		NULL, grub_ntfs_read_symlink, GRUB_FSHELP_DIR);
 
 	if (grub_errno)
 		goto fail;
@@ -1408,13 +1441,16 @@ grub_ntfs_open(grub_file_t file, const char* name)
 {
 	struct grub_ntfs_data* data = 0;
 	struct grub_fshelp_node* mft = 0;
+	struct grub_fshelp_cache cache;
 
 	data = grub_ntfs_mount(file->disk);
 	if (!data)
 		goto fail;
 
-	grub_fshelp_find_file(name, &data->cmft, &mft, grub_ntfs_iterate_dir,
-		grub_ntfs_read_symlink, GRUB_FSHELP_REG);
+	grub_fshelp_cache_init(&cache, &grub_ntfs_fs, file->disk, sizeof(struct grub_ntfs_file),
+		sizeof(struct grub_ntfs_data*), 1);
+	grub_fshelp_find_file_cached(&cache, name, &data->cmft, &mft, grub_ntfs_iterate_dir,
+		NULL, grub_ntfs_read_symlink, GRUB_FSHELP_REG);
 
 	if (grub_errno)
 		goto fail;
@@ -1462,6 +1498,62 @@ grub_ntfs_read(grub_file_t file, char* buf, grub_size_t len)
 	return (grub_errno) ? -1 : (grub_ssize_t)len;
 }
 
+/* Map the run list of the data attribute.  */
+static grub_err_t
+grub_ntfs_extents(grub_file_t file, grub_fs_extent_hook_t hook, void* hook_data)
+{
+	struct grub_ntfs_file* mft = &((struct grub_ntfs_data*)file->data)->cmft;
+	struct grub_ntfs_attr* at = &mft->attr;
+	int shift = mft->data->log_spc + GRUB_NTFS_BLK_SHR;
+	struct grub_ntfs_rlst cc;
+	grub_uint8_t* save_cur;
+	grub_uint8_t* pa;
+	grub_uint64_t pos = 0;
+	grub_uint64_t len;
+
+	save_cur = at->attr_cur;
+	at->attr_nxt = at->attr_cur;
+	pa = find_attr(at, *at->attr_nxt);
+	if (!pa)
+	{
+		at->attr_cur = save_cur;
+		return grub_errno ? grub_errno : grub_error(GRUB_ERR_BAD_FS, "attribute not found");
+	}
+	/* Resident and compressed data is read, not mapped.  */
+	if (pa[8] == 0 || (pa[0xC] & GRUB_NTFS_FLAG_COMPRESSED))
+	{
+		at->attr_cur = save_cur;
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "data can't be mapped");
+	}
+
+	grub_memset(&cc, 0, sizeof(cc));
+	cc.attr = at;
+	cc.comp.log_spc = mft->data->log_spc;
+	cc.comp.disk = mft->data->disk;
+	cc.cur_run = pa + u16at(pa, 0x20);
+	cc.next_vcn = u32at(pa, 0x10);
+	cc.curr_lcn = 0;
+
+	while (pos < file->size)
+	{
+		if (grub_ntfs_read_run_list(&cc))
+			break;
+		if (cc.flags & GRUB_NTFS_RF_BLNK)
+		{
+			grub_error(GRUB_ERR_BAD_FILE_TYPE, "file has holes");
+			break;
+		}
+		len = (cc.next_vcn - cc.curr_vcn) << shift;
+		if (len > file->size - pos)
+			len = file->size - pos;
+		if (hook(cc.curr_lcn << shift, len, hook_data))
+			break;
+		pos += len;
+	}
+	at->attr_cur = save_cur;
+	return grub_errno;
+}
+
 static grub_err_t
 grub_ntfs_close(grub_file_t file)
 {
@@ -1556,13 +1648,21 @@ grub_ntfs_uuid(grub_disk_t disk, char** uuid)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_ntfs_signatures[] =
+{
+	{ 3, 4, "NTFS" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_ntfs_fs =
 {
 	.name = "ntfs",
+	.fs_signatures = grub_ntfs_signatures,
 	.fs_dir = grub_ntfs_dir,
 	.fs_open = grub_ntfs_open,
 	.fs_read = grub_ntfs_read,
 	.fs_close = grub_ntfs_close,
+	.fs_extents = grub_ntfs_extents,
 	.fs_label = grub_ntfs_label,
 	.fs_uuid = grub_ntfs_uuid,
 	.next = 0
@@ -151,6 +151,9 @@ struct grub_ntfs_file
 	grub_uint64_t ino;
 	int inode_read;
 	struct grub_ntfs_attr attr;
+	/* As recorded in the directory index.  */
+	grub_uint64_t alloc_size;
+	grub_uint32_t flags;
 };
 
 struct grub_ntfs_data
@@ -1296,9 +1296,16 @@ grub_reiserfs_uuid(grub_disk_t disk, char** uuid)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_reiserfs_signatures[] =
+{
+	{ 0x10034, 6, REISERFS_MAGIC_STRING },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_reiserfs_fs =
 {
   .name = "reiserfs",
+  .fs_signatures = grub_reiserfs_signatures,
   .fs_dir = grub_reiserfs_dir,
   .fs_open = grub_reiserfs_open,
   .fs_read = grub_reiserfs_read,
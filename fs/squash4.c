@@ -755,6 +755,17 @@ grub_squash_dir_iter(const char* filename, enum grub_fshelp_filetype filetype,
 	info.dir = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_DIR);
 	info.mtimeset = 1;
 	info.mtime = grub_le_to_cpu32(node->ino.mtime);
+	switch (node->ino.type)
+	{
+	case grub_cpu_to_le16_compile_time(SQUASH_TYPE_LONG_REGULAR):
+		info.sizeset = 1;
+		info.size = grub_le_to_cpu64(node->ino.long_file.size);
+		break;
+	case grub_cpu_to_le16_compile_time(SQUASH_TYPE_REGULAR):
+		info.sizeset = 1;
+		info.size = grub_le_to_cpu32(node->ino.file.size);
+		break;
+	}
 	grub_free(node);
 	return ctx->hook(filename, &info, ctx->hook_data);
 }
@@ -1092,9 +1103,16 @@ grub_squash_mtime(grub_disk_t disk, grub_int64_t* tm)
 	return GRUB_ERR_NONE;
 }
 
+static const struct grub_fs_signature grub_squash_signatures[] =
+{
+	{ 0, 4, "hsqs" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_squash_fs =
 {
 	.name = "squash4",
+	.fs_signatures = grub_squash_signatures,
 	.fs_dir = grub_squash_dir,
 	.fs_open = grub_squash_open,
 	.fs_read = grub_squash_read,
@@ -213,6 +213,12 @@ grub_tar_rewind(struct grub_archelp_data* data)
 	data->next_hofs = 0;
 }
 
+static grub_off_t
+grub_tar_get_size(struct grub_archelp_data* data)
+{
+	return data->size;
+}
+
 #pragma warning(push)
 #pragma warning(disable:4028)
 #pragma warning(disable:4113)
@@ -220,7 +226,8 @@ static struct grub_archelp_ops arcops =
 {
   .find_file = grub_tar_find_file,
   .get_link_target = grub_tar_get_link_target,
-  .rewind = grub_tar_rewind
+  .rewind = grub_tar_rewind,
+  .get_size = grub_tar_get_size
 };
 #pragma warning(pop)
 
@@ -322,9 +329,16 @@ grub_tar_close(grub_file_t file)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_tar_signatures[] =
+{
+	{ 257, sizeof(MAGIC) - 1, MAGIC },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_tar_fs =
 {
 	.name = "tarfs",
+	.fs_signatures = grub_tar_signatures,
 	.fs_dir = grub_tar_dir,
 	.fs_open = grub_tar_open,
 	.fs_read = grub_tar_read,
@@ -442,7 +442,8 @@ grub_udf_read_icb(struct grub_udf_data* data,
 }
 
 static grub_disk_addr_t
-grub_udf_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
+grub_udf_read_extent(grub_fshelp_node_t node, grub_disk_addr_t fileblock,
+	grub_disk_addr_t* run)
 {
 	char* buf = NULL;
 	char* ptr;
@@ -508,6 +509,8 @@ grub_udf_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 			if (filebytes < adlen)
 			{
 				grub_uint32_t ad_pos = ad->position;
+				*run = (adlen - filebytes + U32(node->data->lvd.bsize) - 1)
+					>> (GRUB_DISK_SECTOR_BITS + node->data->lbshift);
 				grub_free(buf);
 				return ((U32(ad_pos) & GRUB_UDF_EXT_MASK) ? 0 :
 					(grub_udf_get_block(node->data, (grub_uint16_t)node->part_ref, ad_pos)
@@ -562,6 +565,8 @@ grub_udf_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 			{
 				grub_uint32_t ad_block_num = ad->block.block_num;
 				grub_uint32_t ad_part_ref = ad->block.part_ref;
+				*run = (adlen - filebytes + U32(node->data->lvd.bsize) - 1)
+					>> (GRUB_DISK_SECTOR_BITS + node->data->lbshift);
 				grub_free(buf);
 				return ((U32(ad_block_num) & GRUB_UDF_EXT_MASK) ? 0 :
 					(grub_udf_get_block(node->data, (grub_uint16_t)ad_part_ref,
@@ -582,6 +587,14 @@ fail:
 	return 0;
 }
 
+static grub_disk_addr_t
+grub_udf_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
+{
+	grub_disk_addr_t run = 0;
+
+	return grub_udf_read_extent(node, fileblock, &run);
+}
+
 static grub_ssize_t
 grub_udf_read_file(grub_fshelp_node_t node,
 	grub_disk_read_hook_t read_hook, void* read_hook_data,
@@ -611,7 +624,7 @@ grub_udf_read_file(grub_fshelp_node_t node,
 
 	return grub_fshelp_read_file(node->data->disk, node,
 		read_hook, read_hook_data,
-		pos, len, buf, grub_udf_read_block,
+		pos, len, buf, grub_udf_read_block, grub_udf_read_extent,
 		U64(node->block.fe.file_size),
 		node->data->lbshift, 0);
 }
@@ -1106,9 +1119,24 @@ grub_udf_dir_iter(const char* filename, enum grub_fshelp_filetype filetype,
 	grub_memset(&info, 0, sizeof(info));
 	info.dir = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_DIR);
 	if (U16(node->block.fe.tag.tag_ident) == GRUB_UDF_TAG_IDENT_FE)
+	{
 		tstamp = &node->block.fe.modification_time;
+		info.allocset = 1;
+		info.alloc_size = U64(node->block.fe.blocks_recorded);
+	}
 	else if (U16(node->block.fe.tag.tag_ident) == GRUB_UDF_TAG_IDENT_EFE)
+	{
 		tstamp = &node->block.efe.modification_time;
+		info.allocset = 1;
+		info.alloc_size = U64(node->block.efe.blocks_recorded);
+	}
+	info.alloc_size <<= GRUB_DISK_SECTOR_BITS + node->data->lbshift;
+	/* Symlinks are sized by their target, left to opening them.  */
+	if ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_REG)
+	{
+		info.sizeset = 1;
+		info.size = U64(node->block.fe.file_size);
+	}
 
 	if (tstamp && (U16(tstamp->type_and_timezone) & 0xf000) == 0x1000)
 	{
@@ -1223,6 +1251,20 @@ grub_udf_read(grub_file_t file, char* buf, grub_size_t len)
 		file->offset, len, buf);
 }
 
+static grub_err_t
+grub_udf_extents(grub_file_t file, grub_fs_extent_hook_t hook, void* hook_data)
+{
+	struct grub_fshelp_node* node = (struct grub_fshelp_node*)file->data;
+
+	/* Data embedded in the file entry is read, not mapped.  */
+	if ((U16(node->block.fe.icbtag.flags) & GRUB_UDF_ICBTAG_FLAG_AD_MASK)
+		== GRUB_UDF_ICBTAG_FLAG_AD_IN_ICB)
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "data can't be mapped");
+
+	return grub_fshelp_extents(node, grub_udf_read_block, grub_udf_read_extent, file->size,
+		node->data->lbshift, 0, hook, hook_data);
+}
+
 static grub_err_t
 grub_udf_close(grub_file_t file)
 {
@@ -1336,13 +1378,27 @@ grub_udf_uuid(grub_disk_t disk, char** uuid)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_udf_signatures[] =
+{
+	{ 0x8001, 5, "BEA01" },
+	{ 0x8001, 5, "BOOT2" },
+	{ 0x8001, 5, "CD001" },
+	{ 0x8001, 5, "CDW02" },
+	{ 0x8001, 5, "TEA01" },
+	{ 0x8001, 5, "NSR02" },
+	{ 0x8001, 5, "NSR03" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_udf_fs =
 {
 	.name = "udf",
+	.fs_signatures = grub_udf_signatures,
 	.fs_dir = grub_udf_dir,
 	.fs_open = grub_udf_open,
 	.fs_read = grub_udf_read,
 	.fs_close = grub_udf_close,
+	.fs_extents = grub_udf_extents,
 	.fs_label = grub_udf_label,
 	.fs_uuid = grub_udf_uuid,
 	.next = 0
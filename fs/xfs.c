@@ -540,7 +540,8 @@ get_fsb(const void* keys, int idx)
 }
 
 static grub_disk_addr_t
-grub_xfs_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
+grub_xfs_read_extent(grub_fshelp_node_t node, grub_disk_addr_t fileblock,
+	grub_disk_addr_t* run)
 {
 	struct grub_xfs_btree_node* leaf = 0;
 	int ex, nrec;
@@ -630,9 +631,13 @@ grub_xfs_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 
 		/* Sparse block.  */
 		if (fileblock < offset)
+		{
+			*run = offset - fileblock;
 			break;
+		}
 		else if (fileblock < offset + size)
 		{
+			*run = offset + size - fileblock;
 			ret = (fileblock - offset + start);
 			break;
 		}
@@ -643,6 +648,14 @@ grub_xfs_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 	return GRUB_XFS_FSB_TO_BLOCK(node->data, ret);
 }
 
+static grub_disk_addr_t
+grub_xfs_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
+{
+	grub_disk_addr_t run = 0;
+
+	return grub_xfs_read_extent(node, fileblock, &run);
+}
+
 
 /* Read LEN bytes from the file described by DATA starting with byte
    POS.	 Return the amount of read bytes in READ.  */
@@ -653,7 +666,7 @@ grub_xfs_read_file(grub_fshelp_node_t node,
 {
 	return grub_fshelp_read_file(node->data->disk, node,
 		read_hook, read_hook_data,
-		pos, len, buf, grub_xfs_read_block,
+		pos, len, buf, grub_xfs_read_block, grub_xfs_read_extent,
 		grub_be_to_cpu64(node->inode.size) + header_size,
 		node->data->sblock.log2_bsize
 		- GRUB_DISK_SECTOR_BITS, 0);
@@ -1018,12 +1031,21 @@ grub_xfs_dir_iter(const char* filename, enum grub_fshelp_filetype filetype,
 	struct grub_dirhook_info info;
 
 	grub_memset(&info, 0, sizeof(info));
+	info.dir = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_DIR);
 	if (node->inode_read)
 	{
 		info.mtimeset = 1;
 		info.mtime = grub_xfs_get_inode_time(&node->inode);
+		/* Symlinks are sized by their target, left to opening them.  */
+		if ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_REG)
+		{
+			info.sizeset = 1;
+			info.size = grub_be_to_cpu64(node->inode.size);
+		}
+		info.allocset = 1;
+		info.alloc_size = grub_be_to_cpu64(node->inode.nblocks)
+			<< node->data->sblock.log2_bsize;
 	}
-	info.dir = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_DIR);
 	grub_free(node);
 	return ctx->hook(filename, &info, ctx->hook_data);
 }
@@ -1114,6 +1136,16 @@ grub_xfs_read(grub_file_t file, char* buf, grub_size_t len)
 }
 
 
+static grub_err_t
+grub_xfs_extents(grub_file_t file, grub_fs_extent_hook_t hook, void* hook_data)
+{
+	struct grub_xfs_data* data = (struct grub_xfs_data*)file->data;
+
+	return grub_fshelp_extents(&data->diropen, grub_xfs_read_block,
+		grub_xfs_read_extent, file->size,
+		data->sblock.log2_bsize - GRUB_DISK_SECTOR_BITS, 0, hook, hook_data);
+}
+
 static grub_err_t
 grub_xfs_close(grub_file_t file)
 {
@@ -1169,13 +1201,21 @@ grub_xfs_uuid(grub_disk_t disk, char** uuid)
 	return grub_errno;
 }
 
+static const struct grub_fs_signature grub_xfs_signatures[] =
+{
+	{ 0, 4, "XFSB" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_xfs_fs =
 {
   .name = "xfs",
+  .fs_signatures = grub_xfs_signatures,
   .fs_dir = grub_xfs_dir,
   .fs_open = grub_xfs_open,
   .fs_read = grub_xfs_read,
   .fs_close = grub_xfs_close,
+  .fs_extents = grub_xfs_extents,
   .fs_label = grub_xfs_label,
   .fs_uuid = grub_xfs_uuid,
   .next = 0
@@ -39,16 +39,23 @@ struct grub_zip_header
 	grub_uint16_t field_len;
 } GRUB_PACKED;
 
-struct grub_zip_data
+/* The central directory of an archive, shared by its open files.  */
+struct grub_zip_mount
 {
-	grub_disk_t disk;
 	grub_off_t size;
+	mz_zip_archive zip;
+	struct grub_zip_header header;
+};
+
+struct grub_zip_data
+{
+	struct grub_zip_mount* mount;
+	/* The archive of the mount, reading through the disk of the file.  */
+	mz_zip_archive zip;
 	grub_off_t saved_offset;
 	mz_zip_reader_extract_iter_state* iter;
-	mz_zip_archive zip;
 	mz_uint index;
 	mz_zip_archive_file_stat stat;
-	struct grub_zip_header header;
 };
 
 static size_t
@@ -80,10 +87,10 @@ static char* path_convert(const char* path)
 	return path_copy;
 }
 
-static struct grub_zip_data*
+static void*
 grub_zip_mount(grub_disk_t disk)
 {
-	struct grub_zip_data* data = NULL;
+	struct grub_zip_mount* data = NULL;
 	struct grub_zip_header header;
 	mz_bool bret;
 
@@ -93,12 +100,11 @@ grub_zip_mount(grub_disk_t disk)
 	if (grub_memcmp(header.magic, "PK\3\4", 4) != 0)
 		goto fail;
 
-	data = grub_zalloc(sizeof(struct grub_zip_data));
+	data = grub_zalloc(sizeof(struct grub_zip_mount));
 	if (!data)
 		goto fail;
 
 	grub_memcpy(&data->header, &header, sizeof(header));
-	data->disk = disk;
 	data->size = grub_disk_native_sectors(disk) << GRUB_DISK_SECTOR_BITS;
 	data->zip.m_pRead = mz_grub_file_read;
 	data->zip.m_pIO_opaque = disk;
@@ -115,16 +121,35 @@ fail:
 	return 0;
 }
 
+static void
+grub_zip_unmount(void* mount)
+{
+	struct grub_zip_mount* data = mount;
+
+	mz_zip_reader_end(&data->zip);
+	grub_free(data);
+}
+
 static grub_err_t
 grub_zip_open(struct grub_file* file, const char* name)
 {
 	struct grub_zip_data* data;
+	struct grub_zip_mount* mount;
 	mz_bool bret;
 	char* new_path;
 
-	data = grub_zip_mount(file->disk);
+	data = grub_zalloc(sizeof(struct grub_zip_data));
 	if (!data)
 		return grub_errno;
+	mount = grub_fs_mount_get(&grub_zip_fs, file->disk, grub_zip_mount, grub_zip_unmount);
+	if (!mount)
+	{
+		grub_free(data);
+		return grub_errno;
+	}
+	data->mount = mount;
+	data->zip = mount->zip;
+	data->zip.m_pIO_opaque = file->disk;
 
 	new_path = path_convert(name);
 	if (!new_path)
@@ -161,10 +186,14 @@ grub_zip_open(struct grub_file* file, const char* name)
 	file->data = data;
 	file->size = data->stat.m_uncomp_size;
 	file->not_easily_seekable = 1;
+	grub_free(new_path);
+	return GRUB_ERR_NONE;
 
 fail:
 	if (new_path)
 		grub_free(new_path);
+	grub_fs_mount_put(mount);
+	grub_free(data);
 	return grub_errno;
 }
 
@@ -174,7 +203,7 @@ grub_zip_close(grub_file_t file)
 	struct grub_zip_data* data = file->data;
 	if (data->iter)
 		mz_zip_reader_extract_iter_free(data->iter);
-	mz_zip_reader_end(&data->zip);
+	grub_fs_mount_put(data->mount);
 	grub_free(data);
 	return GRUB_ERR_NONE;
 }
@@ -183,7 +212,7 @@ static grub_ssize_t
 grub_zip_read(grub_file_t file, char* buf, grub_size_t len)
 {
 	struct grub_zip_data* data = file->data;
-	grub_disk_t disk = data->disk;
+	grub_disk_t disk = file->disk;
 	grub_ssize_t ret = -1;
 	char* tmp = NULL;
 	grub_size_t tmp_size = 1024 * 1024; // 1MB
@@ -218,7 +247,10 @@ grub_zip_read(grub_file_t file, char* buf, grub_size_t len)
 		tmp_offset += s;
 	}
 
+	disk->read_hook = file->read_hook;
+	disk->read_hook_data = file->read_hook_data;
 	ret = mz_zip_reader_extract_iter_read(data->iter, buf, len);
+	disk->read_hook = 0;
 	data->saved_offset = file->offset + ret;
 
 fail:
@@ -233,12 +265,14 @@ grub_zip_dir(grub_disk_t disk, const char* path,
 {
 	char* new_path;
 	grub_size_t new_path_len;
-	struct grub_zip_data* data;
+	struct grub_zip_mount* data;
 	mz_uint max_file;
+	mz_uint index;
+	mz_zip_archive_file_stat stat;
 	struct grub_dirhook_info info;
 	mz_bool bret;
 
-	data = grub_zip_mount(disk);
+	data = grub_fs_mount_get(&grub_zip_fs, disk, grub_zip_mount, grub_zip_unmount);
 	if (!data)
 		return grub_errno;
 
@@ -268,24 +302,35 @@ grub_zip_dir(grub_disk_t disk, const char* path,
 				p = new_path;
 			info.dir = 0;
 			info.inode = id;
+			if (mz_zip_reader_file_stat(&data->zip, id, &stat))
+			{
+				info.sizeset = 1;
+				info.size = stat.m_uncomp_size;
+				info.allocset = 1;
+				info.alloc_size = stat.m_comp_size;
+			}
 			hook(p, &info, hook_data);
 			goto fail;
 		}
 	}
 
 	max_file = mz_zip_reader_get_num_files(&data->zip);
-	for (data->index = 0; data->index < max_file; data->index++)
+	for (index = 0; index < max_file; index++)
 	{
-		bret = mz_zip_reader_file_stat(&data->zip, data->index, &data->stat);
+		bret = mz_zip_reader_file_stat(&data->zip, index, &stat);
 		if (bret == MZ_FALSE)
 			continue;
-		if (grub_strncasecmp(new_path, data->stat.m_filename, new_path_len) == 0)
+		if (grub_strncasecmp(new_path, stat.m_filename, new_path_len) == 0)
 		{
 			grub_size_t p_len;
-			char* p = &data->stat.m_filename[new_path_len];
+			char* p = &stat.m_filename[new_path_len];
 			char* q;
-			info.dir = data->stat.m_is_directory ? 1 : 0;
-			info.inode = data->index;
+			info.dir = stat.m_is_directory ? 1 : 0;
+			info.inode = index;
+			info.sizeset = !info.dir;
+			info.size = stat.m_uncomp_size;
+			info.allocset = !info.dir;
+			info.alloc_size = stat.m_comp_size;
 			if (*p == '/')
 				p++;
 			if (*p == '\0')
@@ -308,7 +353,7 @@ fail:
 		grub_error(GRUB_ERR_FILE_NOT_FOUND, "file `%s' not found", path);
 	if (new_path)
 		grub_free(new_path);
-	grub_free(data);
+	grub_fs_mount_put(data);
 	return grub_errno;
 }
 
@@ -326,9 +371,16 @@ static grub_err_t grub_zip_label(grub_disk_t disk, char** label)
 	return GRUB_ERR_NONE;
 }
 
+static const struct grub_fs_signature grub_zip_signatures[] =
+{
+	{ 0, 4, "PK\3\4" },
+	{ 0, 0, NULL },
+};
+
 struct grub_fs grub_zip_fs =
 {
   .name = "zip",
+  .fs_signatures = grub_zip_signatures,
   .fs_dir = grub_zip_dir,
   .fs_open = grub_zip_open,
   .fs_read = grub_zip_read,
@@ -21,6 +21,7 @@
 #include "fs.h"
 #include "file.h"
 #include "fshelp.h"
+#include "partition.h"
 
 typedef int (*iterate_dir_func) (grub_fshelp_node_t dir,
 	grub_fshelp_iterate_dir_hook_t hook,
@@ -36,6 +37,8 @@ struct stack_element
 	struct stack_element* parent;
 	grub_fshelp_node_t node;
 	enum grub_fshelp_filetype type;
+	/* Path from the root, when the directory cache is used.  */
+	char* path;
 };
 
 /* Context for grub_fshelp_find_file.  */
@@ -50,8 +53,350 @@ struct grub_fshelp_find_file_ctx
 
 	/* Current file being traversed and its parents.  */
 	struct stack_element* currnode;
+
+	const struct grub_fshelp_cache* cache;
+};
+
+/* Directory entries remembered per volume.  */
+#define GRUB_FSHELP_CACHE_VOLUMES	8
+#define GRUB_FSHELP_CACHE_ENTRIES	65536
+#define GRUB_FSHELP_CACHE_DIR_HASH	1024
+#define GRUB_FSHELP_CACHE_HASH	16384
+
+struct grub_fshelp_cache_dir
+{
+	struct grub_fshelp_cache_dir* next;
+	grub_uint32_t hash;
+	/* All entries of the directory are cached.  */
+	int complete;
+	char* path;
+};
+
+struct grub_fshelp_cache_entry
+{
+	struct grub_fshelp_cache_entry* next;
+	struct grub_fshelp_cache_dir* dir;
+	grub_uint32_t hash;
+	/* The type with GRUB_FSHELP_CASE_INSENSITIVE, or GRUB_FSHELP_UNKNOWN
+	   for a name known not to exist.  */
+	enum grub_fshelp_filetype type;
+	char* name;
+	char* node;
 };
 
+struct grub_fshelp_cache_volume
+{
+	struct grub_fshelp_cache_volume* next;
+	grub_fs_t fs;
+	unsigned long dev_id;
+	unsigned long disk_id;
+	grub_disk_addr_t start;
+	grub_uint32_t generation;
+	grub_uint64_t writes;
+	grub_uint64_t tick;
+	grub_size_t count;
+	struct grub_fshelp_cache_dir* dirs[GRUB_FSHELP_CACHE_DIR_HASH];
+	struct grub_fshelp_cache_entry* entries[GRUB_FSHELP_CACHE_HASH];
+};
+
+static struct grub_fshelp_cache_volume* cache_volumes = NULL;
+static grub_uint64_t cache_tick = 0;
+static SRWLOCK cache_lock = SRWLOCK_INIT;
+
+/* FNV-1a of the lowercase S, so that names of any case share a chain.  */
+static grub_uint32_t
+cache_hash(grub_uint32_t hash, const char* s)
+{
+	for (; *s; s++)
+		hash = (hash ^ (grub_uint8_t)grub_tolower((grub_uint8_t)*s)) * 16777619;
+	return hash;
+}
+
+static void
+cache_clear(struct grub_fshelp_cache_volume* vol)
+{
+	struct grub_fshelp_cache_entry* e, * enext;
+	struct grub_fshelp_cache_dir* d, * dnext;
+	grub_size_t i;
+
+	for (i = 0; i < GRUB_FSHELP_CACHE_HASH; i++)
+	{
+		for (e = vol->entries[i]; e; e = enext)
+		{
+			enext = e->next;
+			grub_free(e);
+		}
+		vol->entries[i] = NULL;
+	}
+	for (i = 0; i < GRUB_FSHELP_CACHE_DIR_HASH; i++)
+	{
+		for (d = vol->dirs[i]; d; d = dnext)
+		{
+			dnext = d->next;
+			grub_free(d);
+		}
+		vol->dirs[i] = NULL;
+	}
+	vol->count = 0;
+}
+
+/* The device state the cache of CACHE's volume must match.  */
+static void
+cache_stamp(const struct grub_fshelp_cache* cache, grub_uint32_t* generation,
+	grub_uint64_t* writes)
+{
+	const struct grub_disk_stats* stats = cache->disk->stats;
+
+	*generation = stats ? stats->generation : 0;
+	*writes = stats ? stats->write_requests : 0;
+}
+
+/* Find the volume of CACHE, creating it if needed.  Its entries are
+   dropped unless they were made in the device state GENERATION and
+   WRITES.  Called with the lock held exclusively.  */
+static struct grub_fshelp_cache_volume*
+cache_volume(const struct grub_fshelp_cache* cache, grub_uint32_t generation,
+	grub_uint64_t writes)
+{
+	struct grub_fshelp_cache_volume* vol;
+	struct grub_fshelp_cache_volume** prev;
+	struct grub_fshelp_cache_volume** oldest = NULL;
+	grub_disk_t disk = cache->disk;
+	grub_disk_addr_t start = disk->partition ? grub_partition_get_start(disk->partition) : 0;
+	unsigned n = 0;
+
+	for (prev = &cache_volumes; (vol = *prev) != NULL; prev = &vol->next)
+	{
+		if (vol->fs == cache->fs && vol->dev_id == disk->dev->id
+			&& vol->disk_id == disk->id && vol->start == start)
+			break;
+		if (!oldest || vol->tick < (*oldest)->tick)
+			oldest = prev;
+		n++;
+	}
+
+	if (!vol)
+	{
+		if (n >= GRUB_FSHELP_CACHE_VOLUMES)
+		{
+			vol = *oldest;
+			*oldest = vol->next;
+			cache_clear(vol);
+		}
+		else
+		{
+			vol = grub_zalloc(sizeof(*vol));
+			if (!vol)
+			{
+				grub_errno = GRUB_ERR_NONE;
+				return NULL;
+			}
+		}
+		vol->fs = cache->fs;
+		vol->dev_id = disk->dev->id;
+		vol->disk_id = disk->id;
+		vol->start = start;
+		vol->generation = generation;
+		vol->writes = writes;
+		vol->next = cache_volumes;
+		cache_volumes = vol;
+	}
+	else if (vol->generation != generation || vol->writes != writes)
+	{
+		cache_clear(vol);
+		vol->generation = generation;
+		vol->writes = writes;
+	}
+	vol->tick = ++cache_tick;
+	return vol;
+}
+
+static struct grub_fshelp_cache_dir*
+cache_dir(struct grub_fshelp_cache_volume* vol, const char* path, int create)
+{
+	struct grub_fshelp_cache_dir* dir;
+	grub_uint32_t hash = cache_hash(2166136261U, path);
+	grub_size_t len;
+
+	for (dir = vol->dirs[hash % GRUB_FSHELP_CACHE_DIR_HASH]; dir; dir = dir->next)
+		if (dir->hash == hash && grub_strcmp(dir->path, path) == 0)
+			return dir;
+	if (!create)
+		return NULL;
+
+	len = grub_strlen(path);
+	dir = grub_malloc(sizeof(*dir) + len + 1);
+	if (!dir)
+	{
+		grub_errno = GRUB_ERR_NONE;
+		return NULL;
+	}
+	dir->hash = hash;
+	dir->complete = 0;
+	dir->path = (char*)(dir + 1);
+	grub_memcpy(dir->path, path, len + 1);
+	dir->next = vol->dirs[hash % GRUB_FSHELP_CACHE_DIR_HASH];
+	vol->dirs[hash % GRUB_FSHELP_CACHE_DIR_HASH] = dir;
+	return dir;
+}
+
+static int
+cache_entry_match(const struct grub_fshelp_cache_entry* e,
+	const struct grub_fshelp_cache_dir* dir, grub_uint32_t hash, const char* name)
+{
+	if (e->dir != dir || e->hash != hash)
+		return 0;
+	return (e->type & GRUB_FSHELP_CASE_INSENSITIVE)
+		? grub_strcasecmp(e->name, name) == 0 : grub_strcmp(e->name, name) == 0;
+}
+
+/* Make an entry for NAME in DIR, with a copy of NODE if not NULL.  */
+static struct grub_fshelp_cache_entry*
+cache_entry_new(const struct grub_fshelp_cache* cache, const char* name,
+	enum grub_fshelp_filetype type, grub_fshelp_node_t node)
+{
+	struct grub_fshelp_cache_entry* e;
+	grub_size_t head = ALIGN_UP(sizeof(*e), sizeof(grub_properly_aligned_t));
+	grub_size_t node_size = node ? ALIGN_UP(cache->node_size, sizeof(grub_properly_aligned_t)) : 0;
+	grub_size_t len = grub_strlen(name);
+
+	e = grub_malloc(head + node_size + len + 1);
+	if (!e)
+	{
+		grub_errno = GRUB_ERR_NONE;
+		return NULL;
+	}
+	e->next = NULL;
+	e->dir = NULL;
+	e->hash = 0;
+	e->type = node ? type : GRUB_FSHELP_UNKNOWN;
+	e->node = node ? (char*)e + head : NULL;
+	if (node)
+		grub_memcpy(e->node, node, cache->node_size);
+	e->name = (char*)e + head + node_size;
+	grub_memcpy(e->name, name, len + 1);
+	return e;
+}
+
+/* Link the list of entries E into DIR, keeping any entry already there.
+   Entries are appended, so that lookups find them in directory order.  */
+static void
+cache_insert(struct grub_fshelp_cache_volume* vol, struct grub_fshelp_cache_dir* dir,
+	struct grub_fshelp_cache_entry* e)
+{
+	struct grub_fshelp_cache_entry* next;
+	struct grub_fshelp_cache_entry** prev;
+
+	for (; e; e = next)
+	{
+		next = e->next;
+		e->next = NULL;
+		e->dir = dir;
+		e->hash = cache_hash((grub_uint32_t)(grub_addr_t)dir, e->name);
+		for (prev = &vol->entries[e->hash % GRUB_FSHELP_CACHE_HASH]; *prev; prev = &(*prev)->next)
+			if ((*prev)->dir == dir && (*prev)->hash == e->hash
+				&& grub_strcmp((*prev)->name, e->name) == 0)
+				break;
+		if (*prev || vol->count >= GRUB_FSHELP_CACHE_ENTRIES)
+		{
+			grub_free(e);
+			continue;
+		}
+		*prev = e;
+		vol->count++;
+	}
+}
+
+static void
+cache_free_list(struct grub_fshelp_cache_entry* e)
+{
+	struct grub_fshelp_cache_entry* next;
+
+	for (; e; e = next)
+	{
+		next = e->next;
+		grub_free(e);
+	}
+}
+
+/* Add the entries E of the directory at PATH, read in the device state
+   GENERATION and WRITES.  COMPLETE tells that they are all of them.  */
+static void
+cache_add(const struct grub_fshelp_cache* cache, grub_uint32_t generation,
+	grub_uint64_t writes, const char* path, struct grub_fshelp_cache_entry* e,
+	int complete)
+{
+	struct grub_fshelp_cache_volume* vol;
+	struct grub_fshelp_cache_dir* dir = NULL;
+	grub_uint32_t now_generation;
+	grub_uint64_t now_writes;
+
+	cache_stamp(cache, &now_generation, &now_writes);
+	AcquireSRWLockExclusive(&cache_lock);
+	/* Entries read before a write may be stale.  */
+	if (now_generation == generation && now_writes == writes)
+	{
+		vol = cache_volume(cache, generation, writes);
+		dir = vol ? cache_dir(vol, path, 1) : NULL;
+		if (dir)
+		{
+			cache_insert(vol, dir, e);
+			e = NULL;
+			if (complete && vol->count < GRUB_FSHELP_CACHE_ENTRIES)
+				dir->complete = 1;
+		}
+	}
+	ReleaseSRWLockExclusive(&cache_lock);
+	cache_free_list(e);
+}
+
+/* Look NAME up in the cache.  Return 1 with FOUNDNODE set, or left NULL
+   for a name known not to exist, and 0 if the cache can't tell.  */
+static int
+cache_lookup(struct grub_fshelp_find_file_ctx* ctx, const char* name,
+	grub_fshelp_node_t* foundnode, enum grub_fshelp_filetype* foundtype)
+{
+	const struct grub_fshelp_cache* cache = ctx->cache;
+	struct grub_fshelp_cache_volume* vol;
+	struct grub_fshelp_cache_dir* dir = NULL;
+	struct grub_fshelp_cache_entry* e = NULL;
+	grub_uint32_t generation;
+	grub_uint64_t writes;
+	grub_uint32_t hash;
+	int ret = 0;
+
+	cache_stamp(cache, &generation, &writes);
+	AcquireSRWLockExclusive(&cache_lock);
+	vol = cache_volume(cache, generation, writes);
+	if (vol)
+		dir = cache_dir(vol, ctx->currnode->path, 0);
+	if (dir)
+	{
+		hash = cache_hash((grub_uint32_t)(grub_addr_t)dir, name);
+		for (e = vol->entries[hash % GRUB_FSHELP_CACHE_HASH]; e; e = e->next)
+			if (cache_entry_match(e, dir, hash, name))
+				break;
+		ret = (e || dir->complete);
+	}
+	if (e && e->node)
+	{
+		*foundnode = grub_malloc(cache->node_size);
+		if (*foundnode)
+		{
+			grub_memcpy(*foundnode, e->node, cache->node_size);
+			grub_memcpy(*foundnode, ctx->rootnode, cache->shared);
+			*foundtype = e->type;
+		}
+		else
+		{
+			grub_errno = GRUB_ERR_NONE;
+			ret = 0;
+		}
+	}
+	ReleaseSRWLockExclusive(&cache_lock);
+	return ret;
+}
+
 /* Helper for find_file_iter.  */
 static void
 free_node(grub_fshelp_node_t node, struct grub_fshelp_find_file_ctx* ctx)
@@ -67,6 +412,7 @@ pop_element(struct grub_fshelp_find_file_ctx* ctx)
 	el = ctx->currnode;
 	ctx->currnode = el->parent;
 	free_node(el->node, ctx);
+	grub_free(el->path);
 	grub_free(el);
 }
 
@@ -87,12 +433,23 @@ go_up_a_level(struct grub_fshelp_find_file_ctx* ctx)
 
 static grub_err_t
 push_node(struct grub_fshelp_find_file_ctx* ctx, grub_fshelp_node_t node,
-	enum grub_fshelp_filetype filetype)
+	enum grub_fshelp_filetype filetype, const char* name)
 {
 	struct stack_element* nst;
 	nst = grub_malloc(sizeof(*nst));
 	if (!nst)
 		return grub_errno;
+	nst->path = NULL;
+	if (ctx->cache)
+	{
+		nst->path = ctx->currnode ? grub_xasprintf("%s/%s", ctx->currnode->path, name)
+			: grub_strdup("");
+		if (!nst->path)
+		{
+			grub_free(nst);
+			return grub_errno;
+		}
+	}
 	nst->node = node;
 	nst->type = filetype & ~GRUB_FSHELP_CASE_INSENSITIVE;
 	nst->parent = ctx->currnode;
@@ -104,7 +461,7 @@ static grub_err_t
 go_to_root(struct grub_fshelp_find_file_ctx* ctx)
 {
 	free_stack(ctx);
-	return push_node(ctx, ctx->rootnode, GRUB_FSHELP_DIR);
+	return push_node(ctx, ctx->rootnode, GRUB_FSHELP_DIR, NULL);
 }
 
 struct grub_fshelp_find_file_iter_ctx
@@ -157,6 +514,109 @@ directory_find_file(grub_fshelp_node_t node, const char* name,
 	return GRUB_ERR_NONE;
 }
 
+/* Context for load_dir_iter.  */
+struct grub_fshelp_load_dir_ctx
+{
+	const struct grub_fshelp_cache* cache;
+	const char* name;
+	grub_fshelp_node_t* foundnode;
+	enum grub_fshelp_filetype* foundtype;
+	struct grub_fshelp_cache_entry* head;
+	struct grub_fshelp_cache_entry** tail;
+	int failed;
+};
+
+/* Helper for cached_find_file.  */
+static int
+load_dir_iter(const char* filename, enum grub_fshelp_filetype filetype,
+	grub_fshelp_node_t node, void* data)
+{
+	struct grub_fshelp_load_dir_ctx* ctx = data;
+	struct grub_fshelp_cache_entry* e;
+
+	if (filetype == GRUB_FSHELP_UNKNOWN)
+	{
+		grub_free(node);
+		return 0;
+	}
+
+	e = ctx->failed ? NULL : cache_entry_new(ctx->cache, filename, filetype, node);
+	if (e)
+	{
+		*ctx->tail = e;
+		ctx->tail = &e->next;
+	}
+	else
+		ctx->failed = 1;
+
+	if (!*ctx->foundnode && ((filetype & GRUB_FSHELP_CASE_INSENSITIVE)
+		? grub_strcasecmp(ctx->name, filename) == 0
+		: grub_strcmp(ctx->name, filename) == 0))
+	{
+		*ctx->foundnode = node;
+		*ctx->foundtype = filetype;
+		/* Without a complete listing there is no need to go on.  */
+		return ctx->failed;
+	}
+	grub_free(node);
+	return 0;
+}
+
+static grub_err_t
+cached_find_file(struct grub_fshelp_find_file_ctx* ctx, const char* name,
+	grub_fshelp_node_t* foundnode, enum grub_fshelp_filetype* foundtype,
+	iterate_dir_func iterate_dir, lookup_file_func lookup_file)
+{
+	const struct grub_fshelp_cache* cache = ctx->cache;
+	struct grub_fshelp_cache_entry* e;
+	grub_uint32_t generation;
+	grub_uint64_t writes;
+	grub_err_t err;
+
+	if (cache_lookup(ctx, name, foundnode, foundtype))
+		return GRUB_ERR_NONE;
+
+	cache_stamp(cache, &generation, &writes);
+	if (!lookup_file && cache->load_dir)
+	{
+		struct grub_fshelp_load_dir_ctx lctx =
+		{
+		  .cache = cache,
+		  .name = name,
+		  .foundnode = foundnode,
+		  .foundtype = foundtype,
+		  .head = NULL,
+		  .failed = 0,
+		};
+		lctx.tail = &lctx.head;
+		iterate_dir(ctx->currnode->node, load_dir_iter, &lctx);
+		if (grub_errno || lctx.failed)
+		{
+			cache_free_list(lctx.head);
+			if (grub_errno && *foundnode)
+			{
+				grub_free(*foundnode);
+				*foundnode = NULL;
+			}
+			return grub_errno;
+		}
+		cache_add(cache, generation, writes, ctx->currnode->path, lctx.head, 1);
+		return GRUB_ERR_NONE;
+	}
+
+	if (lookup_file)
+		err = lookup_file(ctx->currnode->node, name, foundnode, foundtype);
+	else
+		err = directory_find_file(ctx->currnode->node, name, foundnode, foundtype,
+			iterate_dir);
+	if (err)
+		return err;
+	e = cache_entry_new(cache, name, *foundtype, *foundnode);
+	if (e)
+		cache_add(cache, generation, writes, ctx->currnode->path, e, 0);
+	return GRUB_ERR_NONE;
+}
+
 static grub_err_t
 find_file(char* currpath,
 	iterate_dir_func iterate_dir, lookup_file_func lookup_file,
@@ -201,7 +661,10 @@ find_file(char* currpath,
 		/* Iterate over the directory.  */
 		c = *next;
 		*next = '\0';
-		if (lookup_file)
+		if (ctx->cache)
+			err = cached_find_file(ctx, name, &foundnode, &foundtype, iterate_dir,
+				lookup_file);
+		else if (lookup_file)
 			err = lookup_file(ctx->currnode->node, name, &foundnode, &foundtype);
 		else
 			err = directory_find_file(ctx->currnode->node, name, &foundnode, &foundtype,
@@ -214,7 +677,15 @@ find_file(char* currpath,
 		if (!foundnode)
 			break;
 
-		push_node(ctx, foundnode, foundtype);
+		c = *next;
+		*next = '\0';
+		err = push_node(ctx, foundnode, foundtype, name);
+		*next = c;
+		if (err)
+		{
+			free_node(foundnode, ctx);
+			return err;
+		}
 
 		/* Read in the symlink and follow it.  */
 		if (ctx->currnode->type == GRUB_FSHELP_SYMLINK)
@@ -259,7 +730,8 @@ find_file(char* currpath,
 }
 
 static grub_err_t
-grub_fshelp_find_file_real(const char* path, grub_fshelp_node_t rootnode,
+grub_fshelp_find_file_real(const struct grub_fshelp_cache* cache,
+	const char* path, grub_fshelp_node_t rootnode,
 	grub_fshelp_node_t* foundnode,
 	iterate_dir_func iterate_dir,
 	lookup_file_func lookup_file,
@@ -271,7 +743,8 @@ grub_fshelp_find_file_real(const char* path, grub_fshelp_node_t rootnode,
 	  .path = path,
 	  .rootnode = rootnode,
 	  .symlinknest = 0,
-	  .currnode = 0
+	  .currnode = 0,
+	  .cache = cache
 	};
 	grub_err_t err;
 	enum grub_fshelp_filetype foundtype;
@@ -324,7 +797,7 @@ grub_fshelp_find_file(const char* path, grub_fshelp_node_t rootnode,
 	read_symlink_func read_symlink,
 	enum grub_fshelp_filetype expecttype)
 {
-	return grub_fshelp_find_file_real(path, rootnode, foundnode,
+	return grub_fshelp_find_file_real(NULL, path, rootnode, foundnode,
 		iterate_dir, NULL,
 		read_symlink, expecttype);
 
@@ -337,29 +810,102 @@ grub_fshelp_find_file_lookup(const char* path, grub_fshelp_node_t rootnode,
 	read_symlink_func read_symlink,
 	enum grub_fshelp_filetype expecttype)
 {
-	return grub_fshelp_find_file_real(path, rootnode, foundnode,
+	return grub_fshelp_find_file_real(NULL, path, rootnode, foundnode,
 		NULL, lookup_file,
 		read_symlink, expecttype);
 
 }
 
+void
+grub_fshelp_cache_init(struct grub_fshelp_cache* cache, grub_fs_t fs,
+	grub_disk_t disk, grub_size_t node_size, grub_size_t shared, int load_dir)
+{
+	cache->fs = fs;
+	cache->disk = disk;
+	cache->node_size = node_size;
+	cache->shared = shared;
+	cache->load_dir = load_dir;
+}
+
+grub_err_t
+grub_fshelp_find_file_cached(const struct grub_fshelp_cache* cache,
+	const char* path, grub_fshelp_node_t rootnode,
+	grub_fshelp_node_t* foundnode,
+	iterate_dir_func iterate_dir,
+	lookup_file_func lookup_file,
+	read_symlink_func read_symlink,
+	enum grub_fshelp_filetype expecttype)
+{
+	return grub_fshelp_find_file_real(cache, path, rootnode, foundnode,
+		iterate_dir, lookup_file,
+		read_symlink, expecttype);
+}
+
+/* Translate the file block BLOCK to a disk block, and set *RUN to the
+   number of blocks from BLOCK on, at most MAX, that follow it on disk
+   or are sparse like it.  Runs GET_EXTENT can't tell are made up block
+   by block through GET_BLOCK.  */
+static grub_disk_addr_t
+grub_fshelp_map_run(grub_fshelp_node_t node, grub_disk_addr_t block,
+	grub_disk_addr_t max,
+	grub_disk_addr_t(*get_block) (grub_fshelp_node_t node,
+		grub_disk_addr_t block),
+	grub_fshelp_get_extent_t get_extent,
+	grub_disk_addr_t* run)
+{
+	grub_disk_addr_t blknr, next, n = 0;
+
+	if (get_extent)
+	{
+		blknr = get_extent(node, block, &n);
+		if (grub_errno)
+			return 0;
+		if (n)
+		{
+			*run = (n < max) ? n : max;
+			return blknr;
+		}
+	}
+	else
+	{
+		blknr = get_block(node, block);
+		if (grub_errno)
+			return 0;
+	}
+
+	for (n = 1; n < max; n++)
+	{
+		next = get_block(node, block + n);
+		if (grub_errno)
+			return 0;
+		if (blknr ? (next != blknr + n) : (next != 0))
+			break;
+	}
+	*run = n;
+	return blknr;
+}
+
 /* Read LEN bytes from the file NODE on disk DISK into the buffer BUF,
    beginning with the block POS.  READ_HOOK should be set before
    reading a block from the file.  READ_HOOK_DATA is passed through as
    the DATA argument to READ_HOOK.  GET_BLOCK is used to translate
-   file blocks to disk blocks.  The file is FILESIZE bytes big and the
-   blocks have a size of LOG2BLOCKSIZE (in log2).  */
+   file blocks to disk blocks, and GET_EXTENT, if given, to translate
+   whole runs of them.  Blocks that follow each other on disk are read
+   at once.  The file is FILESIZE bytes big and the blocks have a size
+   of LOG2BLOCKSIZE (in log2).  */
 grub_ssize_t
 grub_fshelp_read_file(grub_disk_t disk, grub_fshelp_node_t node,
 	grub_disk_read_hook_t read_hook, void* read_hook_data,
 	grub_off_t pos, grub_size_t len, char* buf,
 	grub_disk_addr_t(*get_block) (grub_fshelp_node_t node,
 		grub_disk_addr_t block),
+	grub_fshelp_get_extent_t get_extent,
 	grub_off_t filesize, int log2blocksize,
 	grub_disk_addr_t blocks_start)
 {
-	grub_disk_addr_t i, blockcnt;
-	int blocksize = 1 << (log2blocksize + GRUB_DISK_SECTOR_BITS);
+	grub_disk_addr_t i, first, blockcnt, run;
+	int shift = log2blocksize + GRUB_DISK_SECTOR_BITS;
+	int blocksize = 1 << shift;
 
 	/*
 	 * Catch blatantly invalid log2blocksize. We could be a lot stricter, but
@@ -384,58 +930,104 @@ grub_fshelp_read_file(grub_disk_t disk, grub_fshelp_node_t node,
 	if (pos + len > filesize)
 		len = filesize - pos;
 
-	blockcnt = ((len + pos) + blocksize - 1) >> (log2blocksize +
-		GRUB_DISK_SECTOR_BITS);
+	blockcnt = ((len + pos) + blocksize - 1) >> shift;
+	first = pos >> shift;
 
-	for (i = pos >> (log2blocksize + GRUB_DISK_SECTOR_BITS); i < blockcnt; i++)
+	for (i = first; i < blockcnt; i += run)
 	{
 		grub_disk_addr_t blknr;
-		int blockoff = pos & (blocksize - 1);
-		int blockend = blocksize;
-
-		int skipfirst = 0;
+		grub_size_t skipfirst = 0;
+		grub_size_t size;
+		int blockend;
 
-		blknr = get_block(node, i);
+		blknr = grub_fshelp_map_run(node, i, blockcnt - i,
+			get_block, get_extent, &run);
 		if (grub_errno)
 			return -1;
 
-		blknr = blknr << log2blocksize;
+		size = (grub_size_t)run << shift;
 
 		/* Last block.  */
-		if (i == blockcnt - 1)
+		if (i + run == blockcnt)
 		{
 			blockend = (len + pos) & (blocksize - 1);
 
 			/* The last portion is exactly blocksize.  */
-			if (!blockend)
-				blockend = blocksize;
+			if (blockend)
+				size -= blocksize - blockend;
 		}
 
 		/* First block.  */
-		if (i == (pos >> (log2blocksize + GRUB_DISK_SECTOR_BITS)))
+		if (i == first)
 		{
-			skipfirst = blockoff;
-			blockend -= skipfirst;
+			skipfirst = pos & (blocksize - 1);
+			size -= skipfirst;
 		}
 
-		/* If the block number is 0 this block is not stored on disk but
+		/* If the block number is 0 the run is not stored on disk but
 		is zero filled instead.  */
 		if (blknr)
 		{
 			disk->read_hook = read_hook;
 			disk->read_hook_data = read_hook_data;
 
-			grub_disk_read(disk, blknr + blocks_start, skipfirst,
-				blockend, buf);
+			grub_disk_read(disk, (blknr << log2blocksize) + blocks_start,
+				skipfirst, size, buf);
 			disk->read_hook = 0;
 			if (grub_errno)
 				return -1;
 		}
 		else
-			grub_memset(buf, 0, blockend);
+			grub_memset(buf, 0, size);
 
-		buf += blocksize - skipfirst;
+		buf += size;
 	}
 
 	return len;
 }
+
+grub_err_t
+grub_fshelp_extents(grub_fshelp_node_t node,
+	grub_disk_addr_t(*get_block) (grub_fshelp_node_t node,
+		grub_disk_addr_t block),
+	grub_fshelp_get_extent_t get_extent,
+	grub_off_t filesize, int log2blocksize,
+	grub_disk_addr_t blocks_start,
+	grub_fs_extent_hook_t hook, void* hook_data)
+{
+	int shift = log2blocksize + GRUB_DISK_SECTOR_BITS;
+	grub_disk_addr_t i, blockcnt, blknr, n;
+	grub_disk_addr_t start = 0;
+	grub_uint64_t run = 0;
+
+	if (shift >= 31)
+		return grub_error(GRUB_ERR_OUT_OF_RANGE, N_("blocksize too large"));
+
+	blockcnt = (filesize + (1ULL << shift) - 1) >> shift;
+	for (i = 0; i < blockcnt; i += n)
+	{
+		blknr = grub_fshelp_map_run(node, i, blockcnt - i,
+			get_block, get_extent, &n);
+		if (grub_errno)
+			return grub_errno;
+		if (!blknr)
+			return grub_error(GRUB_ERR_BAD_FILE_TYPE, "file has holes");
+		blknr = (blknr << log2blocksize) + blocks_start;
+
+		/* Merge contiguous runs.  */
+		if (run && start + (run << log2blocksize) == blknr)
+		{
+			run += n;
+			continue;
+		}
+		if (run && hook(start << GRUB_DISK_SECTOR_BITS, run << shift, hook_data))
+			return grub_errno;
+		start = blknr;
+		run = n;
+	}
+	/* The last block is cut to the file size.  */
+	if (run && hook(start << GRUB_DISK_SECTOR_BITS,
+		(run << shift) - ((blockcnt << shift) - filesize), hook_data))
+		return grub_errno;
+	return GRUB_ERR_NONE;
+}
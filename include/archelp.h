@@ -47,6 +47,10 @@ struct grub_archelp_ops
 
 	void
 	(*rewind) (struct grub_archelp_data* data);
+
+	/* Size of the entry last found, optional.  */
+	grub_off_t
+	(*get_size) (struct grub_archelp_data* data);
 };
 
 grub_err_t
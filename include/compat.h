@@ -10,6 +10,8 @@
 #define PRAGMA_BEGIN_PACKED __pragma(pack(push, 1))
 #define PRAGMA_END_PACKED   __pragma(pack(pop))
 
+#define GRUB_THREAD_LOCAL __declspec(thread)
+
 #define grub_add(a, b, res)	(UIntPtrAdd(a, b, (UINT_PTR *)res) != S_OK)
 #define grub_sub(a, b, res)	(UIntPtrSub(a, b, (UINT_PTR *)res) != S_OK)
 #define grub_mul(a, b, res)	(UIntPtrMult(a, b, (UINT_PTR *)res) != S_OK)
@@ -323,8 +325,9 @@ struct grub_error_saved
 	char errmsg[GRUB_MAX_ERRMSG];
 };
 
-extern grub_err_t grub_errno;
-extern char grub_errmsg[GRUB_MAX_ERRMSG];
+/* The error state is kept per thread.  */
+extern GRUB_THREAD_LOCAL grub_err_t grub_errno;
+extern GRUB_THREAD_LOCAL char grub_errmsg[GRUB_MAX_ERRMSG];
 
 grub_err_t grub_error (grub_err_t n, const char* fmt, ...);
 void grub_error_push (void);
@@ -366,6 +369,12 @@ grub_memmove(void* dst, const void* src, grub_size_t n)
 	return memmove(dst, src, n);
 }
 
+static inline void*
+grub_memchr(const void* s, int c, grub_size_t n)
+{
+	return memchr(s, c, n);
+}
+
 static inline void*
 grub_memcpy(void* dst, const void* src, grub_size_t n)
 {
@@ -378,6 +387,13 @@ grub_memset(void* s, int c, grub_size_t len)
 	return memset(s, c, len);
 }
 
+static inline void
+grub_qsort(void* base, grub_size_t nmemb, grub_size_t size,
+	int (*compar) (const void*, const void*))
+{
+	qsort(base, nmemb, size, compar);
+}
+
 /* Copied from gnulib.
    Written by Bruno Haible <bruno@clisp.org>, 2005. */
 static inline char*
@@ -577,6 +593,8 @@ grub_stpcpy(char* dest, const char* src)
 
 grub_uint64_t grub_get_time_ms(void);
 
+grub_uint64_t grub_get_time_us(void);
+
 grub_uint32_t grub_rand(void);
 
 void grub_srand(grub_uint32_t seed);
@@ -7,17 +7,40 @@
 
 struct grub_partition;
 struct grub_disk;
+struct grub_disk_stats;
 
 typedef int (*grub_disk_iterate_hook_t) (const char* name, void* data);
 
 typedef grub_err_t (*grub_disk_read_hook_t) (grub_disk_addr_t sector,
 	unsigned offset, unsigned length, char* buf, void* data);
 
+/* An asynchronous read of SIZE native sectors at SECTOR into BUF.  */
+struct grub_disk_request
+{
+	grub_disk_addr_t sector;
+	grub_size_t size;
+	char* buf;
+	/* Private to the device while the request is in flight.  */
+	void* data;
+};
+
+/* A range of SIZE bytes at byte OFFSET of sector SECTOR, read into BUF.  */
+struct grub_disk_range
+{
+	grub_disk_addr_t sector;
+	grub_off_t offset;
+	grub_size_t size;
+	void* buf;
+};
+
 #define GRUB_DISK_WINDISK_ID     1
 #define GRUB_DISK_LOOPBACK_ID    2
 #define GRUB_DISK_PROC_ID        3
 #define GRUB_DISK_LVM_ID         4
 
+/* Any disk of a device, see disk_backing.  */
+#define GRUB_DISK_ANY_ID         ((unsigned long)-1)
+
 /* Disk device.  */
 struct grub_disk_dev
 {
@@ -47,6 +70,35 @@ struct grub_disk_dev
 	/* Write SIZE sectors from BUF into the sector SECTOR of the disk DISK.  */
 	grub_err_t(*disk_write) (struct grub_disk* disk, grub_disk_addr_t sector,
 		grub_size_t size, const char* buf);
+
+	/* Optional.  Read the N ranges RANGES of the disk DISK.  SECTOR of each
+	   range is in native sectors, OFFSET is zero and SIZE is a multiple of
+	   the sector size.  */
+	grub_err_t(*disk_readv) (struct grub_disk* disk,
+		const struct grub_disk_range* ranges, grub_size_t n);
+
+	/* Optional, together with disk_wait.  Start the read REQ without waiting
+	   for it to complete.  */
+	grub_err_t(*disk_submit) (struct grub_disk* disk, struct grub_disk_request* req);
+
+	/* Wait for the read REQ started by disk_submit to complete.  */
+	grub_err_t(*disk_wait) (struct grub_disk* disk, struct grub_disk_request* req);
+
+	/* Optional.  Return a value that changes when the medium of the opened
+	   disk DISK is changed.  */
+	grub_uint64_t(*disk_media_id) (struct grub_disk* disk);
+
+	/* Optional.  Tell in *ALLOCATED whether the native sector SECTOR of the
+	   disk DISK holds data, and set *RUN to the number of sectors, at most
+	   SIZE, that share this state.  Unallocated sectors read as zeros.  */
+	grub_err_t(*disk_query_allocated) (struct grub_disk* disk, grub_disk_addr_t sector,
+		grub_disk_addr_t size, grub_disk_addr_t* run, int* allocated);
+
+	/* Optional.  If the data of the disk DISK_ID of this device is stored on
+	   another disk, set *DEV_ID and *BACKING_ID to that disk and return 1.
+	   A *BACKING_ID of GRUB_DISK_ANY_ID stands for any disk of *DEV_ID.  */
+	int (*disk_backing) (unsigned long disk_id, unsigned long* dev_id,
+		unsigned long* backing_id);
 };
 typedef struct grub_disk_dev* grub_disk_dev_t;
 
@@ -105,6 +157,42 @@ struct grub_disk
 
 	/* Device-specific data.  */
 	void* data;
+
+	/* Set by devices whose contents are mapped in memory.  Reads copy
+	   straight from the MAP_SIZE bytes of MAP, bypassing the cache.  */
+	const char* map;
+	grub_uint64_t map_size;
+
+	/* The last cache unit (in 512B sectors) read through this disk, or
+	   GRUB_DISK_RA_NONE before the first read.  */
+	grub_disk_addr_t ra_last;
+
+	/* Non-zero if the current read continues a sequential stream.  */
+	int ra_seq;
+
+	/* Current readahead window, in cache units.  */
+	unsigned int ra_window;
+
+	/* Buffer used to read ahead, RA_BUF_SIZE cache units long.  */
+	char* ra_buf;
+	unsigned int ra_buf_size;
+
+	/* I/O statistics of the device, shared by all opens of it.  */
+	struct grub_disk_stats* stats;
+
+	/* Non-zero if writes are buffered until grub_disk_sync.  */
+	int writeback;
+
+	/* Non-zero if whole cache units read in bulk bypass the disk cache and
+	   readahead.  Small reads are still cached.  */
+	int unbuffered;
+
+	/* Write-back buffer of WB_SIZE bytes.  It holds WB_LEN dirty bytes,
+	   a whole number of sectors starting at the 512B sector WB_SECTOR.  */
+	grub_disk_addr_t wb_sector;
+	grub_size_t wb_len;
+	grub_size_t wb_size;
+	char* wb_buf;
 };
 typedef struct grub_disk* grub_disk_t;
 
@@ -117,8 +205,14 @@ typedef struct grub_disk* grub_disk_t;
  */
 #define GRUB_DISK_MAX_SECTORS (1ULL << (60 - GRUB_DISK_SECTOR_BITS))
 
- /* The maximum number of disk caches.  */
-#define GRUB_DISK_CACHE_NUM 1021
+ /* The number of cache units in one set of the disk cache.  */
+#define GRUB_DISK_CACHE_WAYS 8
+
+/* The default size of the disk cache in bytes.  */
+#define GRUB_DISK_CACHE_DEFAULT_SIZE (32ULL << 20)
+
+/* The default maximum readahead window in bytes.  */
+#define GRUB_DISK_READAHEAD_DEFAULT_SIZE (512ULL << 10)
 
 /* The size of a disk cache in 512B units. Must be at least as big as the
    largest supported sector size, currently 16K.  */
@@ -127,6 +221,10 @@ typedef struct grub_disk* grub_disk_t;
 
 #define GRUB_DISK_MAX_MAX_AGGLOMERATE ((1 << (30 - GRUB_DISK_CACHE_BITS - GRUB_DISK_SECTOR_BITS)) - 1)
 
+/* Value of ra_last before the first read.  It is not aligned to a cache
+   unit, so no read starts at it or just after it.  */
+#define GRUB_DISK_RA_NONE 0xffffffffffffffffULL
+
 /* Return value of grub_disk_native_sectors() in case disk size is unknown. */
 #define GRUB_DISK_SIZE_UNKNOWN 0xffffffffffffffffULL
 
@@ -156,8 +254,101 @@ grub_disk_from_native_sector(grub_disk_t disk, grub_disk_addr_t sector)
 
 grub_uint64_t grub_disk_native_sectors(grub_disk_t disk);
 
+/* Drop the cached data of all devices.  Needed after writing to host files
+   or devices without going through grub_disk_write.  */
 void grub_disk_cache_invalidate_all(void);
 
+/* I/O statistics and cache state of one device, kept for the life of the
+   process.  */
+struct grub_disk_stats
+{
+	struct grub_disk_stats* next;
+	unsigned long dev_id;
+	unsigned long disk_id;
+	char* name;
+
+	/* Cache units of an older generation are stale.  The generation is
+	   bumped when the device changes under the cache.  */
+	grub_uint32_t generation;
+	/* What the device looked like when it was last opened.  */
+	grub_disk_addr_t total_sectors;
+	unsigned int log_sector_size;
+	grub_uint64_t media_id;
+
+	/* Lookups in the disk cache.  */
+	grub_uint64_t cache_hits;
+	grub_uint64_t cache_misses;
+	/* Valid units dropped to make room for this device.  */
+	grub_uint64_t cache_evictions;
+
+	/* Calls to disk_read/disk_write of the device.  */
+	grub_uint64_t read_requests;
+	grub_uint64_t read_bytes;
+	grub_uint64_t read_time_us;
+	grub_uint64_t write_requests;
+	grub_uint64_t write_bytes;
+	grub_uint64_t write_time_us;
+
+	/* Agglomerated reads of several cache units and their total size.  */
+	grub_uint64_t agglomerate_reads;
+	grub_uint64_t agglomerate_units;
+	grub_uint64_t agglomerate_max;
+
+	/* Readahead requests and their total size.  */
+	grub_uint64_t readahead_reads;
+	grub_uint64_t readahead_units;
+};
+
+/* Print the I/O statistics of all devices.  */
+void grub_disk_stats_print(void);
+
+/* The size of the buffer grub_disk_readv gathers device reads in.  */
+#define GRUB_DISK_READV_SIZE (4ULL << 20)
+
+/* The number of device reads bulk transfers keep in flight.  */
+#define GRUB_DISK_QUEUE_DEPTH_DEFAULT 4
+#define GRUB_DISK_QUEUE_DEPTH_MAX 64
+
+/* The size of the write-back buffer of a disk in bytes.  */
+#define GRUB_DISK_WRITEBACK_SIZE (4ULL << 20)
+
+/* Set the number of reads kept in flight on devices with asynchronous I/O.
+   One makes all reads synchronous.  */
+grub_err_t grub_disk_set_queue_depth(unsigned depth);
+
+/* Read the N requests REQS of the disk DISK, keeping up to the queue depth
+   of them in flight when the device supports it.  */
+grub_err_t grub_disk_read_requests(grub_disk_t disk,
+	struct grub_disk_request* reqs, grub_size_t n);
+
+/* Enable or disable write-back buffering on disks opened from now on.  */
+void grub_disk_set_writeback(int enable);
+
+/* Enable or disable unbuffered bulk reads on disks and host files opened
+   from now on.  */
+void grub_disk_set_unbuffered(int enable);
+int grub_disk_get_unbuffered(void);
+
+/* Buffers of the aligned buffer pool are GRUB_DISK_BUFFER_SIZE bytes long
+   and aligned to GRUB_DISK_BUFFER_ALIGN, which suits unbuffered I/O on any
+   sector size.  */
+#define GRUB_DISK_BUFFER_SIZE (1 << 20)
+#define GRUB_DISK_BUFFER_ALIGN 4096
+
+/* Take a buffer from the aligned buffer pool, or NULL if out of memory.  */
+void* grub_disk_buffer_get(void);
+
+/* Give back a buffer taken with grub_disk_buffer_get.  */
+void grub_disk_buffer_put(void* buf);
+
+/* Set the largest readahead window of sequential reads to SIZE bytes.
+   Zero disables readahead.  */
+grub_err_t grub_disk_set_readahead(grub_uint64_t size);
+
+/* Set the size of the disk cache to SIZE bytes.  The cache is flushed and
+   reallocated on next use, so no other thread may be using disks.  */
+grub_err_t grub_disk_cache_set_size(grub_uint64_t size);
+
 /* Disk cache.  */
 struct grub_disk_cache
 {
@@ -165,10 +356,21 @@ struct grub_disk_cache
 	unsigned long disk_id;
 	grub_disk_addr_t sector;
 	char* data;
+	/* Set while the unit is being filled.  */
 	int lock;
+	/* The value of the cache clock when this unit was last used.  */
+	grub_uint64_t last_use;
+	/* The generation of the device when this unit was filled.  */
+	grub_uint32_t generation;
+	/* Set when the unit was written or invalidated while being filled, so
+	   that the fill is not published.  */
+	int dropped;
 };
 
-extern struct grub_disk_cache grub_disk_cache_table[GRUB_DISK_CACHE_NUM];
+/* The cache table is made up of GRUB_DISK_CACHE_WAYS * grub_disk_cache_sets
+   units.  Each sector maps to one set and may live in any unit of it.  */
+extern struct grub_disk_cache* grub_disk_cache_table;
+extern unsigned grub_disk_cache_sets;
 
 int
 grub_disk_iterate(grub_disk_iterate_hook_t hook, void* hook_data);
@@ -180,7 +382,25 @@ void grub_disk_close (grub_disk_t disk);
 grub_err_t
 grub_disk_read (grub_disk_t disk, grub_disk_addr_t sector, grub_off_t offset, grub_size_t size, void* buf);
 
+/* Read the N ranges RANGES of the disk DISK.  Ranges may come in any order
+   and overlap.  Cached data is used where present, and the rest is read with
+   as few device requests as possible.  */
+grub_err_t
+grub_disk_readv (grub_disk_t disk, const struct grub_disk_range* ranges, grub_size_t n);
+
+/* Tell in *ALLOCATED whether the data at byte OFFSET of the sector SECTOR
+   of DISK is allocated, and set *RUN to the number of bytes, at most SIZE,
+   that share this state.  Unallocated data reads as zeros, so bulk readers
+   may skip it.  Disks that can't tell report everything as allocated.  */
+grub_err_t
+grub_disk_query_allocated (grub_disk_t disk, grub_disk_addr_t sector, grub_off_t offset,
+	grub_uint64_t size, grub_uint64_t* run, int* allocated);
+
 grub_err_t
 grub_disk_write (grub_disk_t disk, grub_disk_addr_t sector, grub_off_t offset, grub_size_t size, const void* buf);
 
+/* Write out the dirty data buffered for DISK.  */
+grub_err_t
+grub_disk_sync (grub_disk_t disk);
+
 #endif
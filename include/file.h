@@ -67,6 +67,9 @@ struct grub_file
 
 	/* Caller-specific data passed to the read hook.  */
 	void* read_hook_data;
+
+	/* Line reader used by grub_file_getline.  */
+	struct grub_file_reader* reader;
 };
 typedef struct grub_file* grub_file_t;
 
@@ -107,9 +110,23 @@ char* grub_file_get_device_name (const char* name);
 
 grub_file_t grub_file_open (const char* name, enum grub_file_type type);
 grub_ssize_t grub_file_read (grub_file_t file, void* buf, grub_size_t len);
+
+/* Read LEN bytes at OFFSET of FILE into BUF.  The file offset is neither
+   used nor changed, so readers sharing FILE don't disturb each other if
+   its filesystem has fs_pread.  Others are read through a temporary
+   seek.  */
+grub_ssize_t grub_file_pread (grub_file_t file, void* buf, grub_size_t len, grub_off_t offset);
 grub_off_t grub_file_seek (grub_file_t file, grub_off_t offset);
 void grub_file_close (grub_file_t file);
 
+/* Tell in *ALLOCATED whether the data at OFFSET of FILE is allocated, and
+   set *RUN to the number of bytes, at most LEN, that share this state.  The
+   file offset is neither used nor changed.  Holes read as zeros, so bulk
+   readers may skip them.  Files that can't tell report everything as
+   allocated.  */
+grub_err_t grub_file_query_allocated (grub_file_t file, grub_off_t offset,
+	grub_uint64_t len, grub_uint64_t* run, int* allocated);
+
 /* Return value of grub_file_size() in case file size is unknown. */
 #define GRUB_FILE_SIZE_UNKNOWN	 0xffffffffffffffffULL
 
@@ -131,8 +148,28 @@ grub_file_seekable(const grub_file_t file)
 	return !file->not_easily_seekable;
 }
 
+/* Return the next line of FILE without its line ending and carriage
+   returns, in a grub_malloc'ed buffer, or NULL at the end of the file.  */
 char* grub_file_getline(grub_file_t file);
 
+/* Buffered line reader.  It reads FILE in blocks and returns lines straight
+   from its buffer.  The file offset is kept at the start of the next line,
+   so other reads and seeks on FILE may be mixed in.  */
+typedef struct grub_file_reader* grub_file_reader_t;
+
+#define GRUB_FILE_READER_BLOCK_SIZE (64 * 1024)
+
+/* Make a line reader for FILE reading BLOCK_SIZE bytes at a time, or
+   GRUB_FILE_READER_BLOCK_SIZE if zero.  */
+grub_file_reader_t grub_file_reader_new (grub_file_t file, grub_size_t block_size);
+
+void grub_file_reader_free (grub_file_reader_t reader);
+
+/* Return the next line without its line ending, NUL terminated, and set
+   *LEN to its length.  The line stays valid until the next call.  Return
+   NULL at the end of the file or on error.  */
+const char* grub_file_reader_line (grub_file_reader_t reader, grub_size_t* len);
+
 struct grub_fs_block
 {
 	grub_disk_addr_t offset;
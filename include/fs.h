@@ -31,10 +31,44 @@ struct grub_dirhook_info
 	unsigned mtimeset : 1;
 	unsigned case_insensitive : 1;
 	unsigned inodeset : 1;
+	unsigned sizeset : 1;
+	unsigned allocset : 1;
+	unsigned attrset : 1;
 	grub_int64_t mtime;
 	grub_uint64_t inode;
+	/* File size and space allocated to the file.  */
+	grub_uint64_t size;
+	grub_uint64_t alloc_size;
+	/* GRUB_DIRHOOK_ATTR_* flags.  */
+	grub_uint32_t attr;
 };
 
+/* Same values as the FAT and NTFS attributes.  */
+#define GRUB_DIRHOOK_ATTR_READONLY	0x0001
+#define GRUB_DIRHOOK_ATTR_HIDDEN	0x0002
+#define GRUB_DIRHOOK_ATTR_SYSTEM	0x0004
+#define GRUB_DIRHOOK_ATTR_ARCHIVE	0x0020
+#define GRUB_DIRHOOK_ATTR_SPARSE	0x0200
+#define GRUB_DIRHOOK_ATTR_REPARSE	0x0400
+#define GRUB_DIRHOOK_ATTR_COMPRESSED	0x0800
+#define GRUB_DIRHOOK_ATTR_ENCRYPTED	0x4000
+
+/* A magic number found at byte OFFSET of a volume.  */
+struct grub_fs_signature
+{
+	grub_uint32_t offset;
+	grub_uint32_t size;
+	const char* magic;
+};
+
+/* Signatures must lie within the first GRUB_FS_PROBE_SIZE bytes.  */
+#define GRUB_FS_PROBE_SIZE 0x11000
+
+/* Called with the LENGTH bytes of a file stored at byte OFFSET of its
+   disk, in file order.  */
+typedef grub_err_t (*grub_fs_extent_hook_t) (grub_disk_addr_t offset,
+	grub_uint64_t length, void* data);
+
 typedef int (*grub_fs_dir_hook_t) (const char* filename,
 	const struct grub_dirhook_info* info,
 	void* data);
@@ -59,6 +93,11 @@ struct grub_fs
 	/* Read LEN bytes data from FILE into BUF.  */
 	grub_ssize_t(*fs_read) (struct grub_file* file, char* buf, grub_size_t len);
 
+	/* Optional.  Read LEN bytes data at OFFSET of FILE into BUF, without
+	   using or changing the file offset.  */
+	grub_ssize_t(*fs_pread) (struct grub_file* file, char* buf, grub_size_t len,
+		grub_off_t offset);
+
 	/* Close the file FILE.  */
 	grub_err_t(*fs_close) (struct grub_file* file);
 
@@ -74,6 +113,32 @@ struct grub_fs
 
 	/* Get writing time of filesystem. */
 	grub_err_t(*fs_mtime) (grub_disk_t disk, grub_int64_t* timebuf);
+
+	/* Optional.  Tell in *ALLOCATED whether the data at OFFSET of FILE is
+	   allocated, and set *RUN to the number of bytes, at most LEN, that
+	   share this state, without using or changing the file offset.
+	   Unallocated data reads as zeros.  */
+	grub_err_t(*fs_query_allocated) (struct grub_file* file, grub_off_t offset,
+		grub_uint64_t len, grub_uint64_t* run, int* allocated);
+
+	/* Optional.  Call HOOK with the extents holding the data of FILE,
+	   found from metadata alone.  Fails with GRUB_ERR_NOT_IMPLEMENTED_YET
+	   for files the driver can't map, such as compressed or embedded ones,
+	   which are then mapped by reading them.  */
+	grub_err_t(*fs_extents) (struct grub_file* file, grub_fs_extent_hook_t hook,
+		void* hook_data);
+
+	/* Optional.  Tell in *USED whether the byte OFFSET of the volume DISK
+	   is in use by the filesystem, and set *RUN to the number of bytes, at
+	   most LEN, that share this state.  Unused space holds no data, so
+	   imaging and hashing tools may skip it.  */
+	grub_err_t(*fs_query_used) (grub_disk_t disk, grub_uint64_t offset,
+		grub_uint64_t len, grub_uint64_t* run, int* used);
+
+	/* Optional.  Signatures of which every volume of this filesystem has at
+	   least one, ending with an empty entry.  The probe skips filesystems
+	   none of whose signatures are found.  */
+	const struct grub_fs_signature* fs_signatures;
 };
 typedef struct grub_fs* grub_fs_t;
 
@@ -95,7 +160,49 @@ grub_fs_unregister(grub_fs_t fs)
 
 grub_fs_t grub_fs_probe (grub_disk_t disk);
 
+/* Get the label or the UUID of the filesystem FS on DISK, from the probe
+   cache when possible.  The string is grub_malloc'ed, or NULL if FS has no
+   such function.  */
+grub_err_t grub_fs_label (grub_fs_t fs, grub_disk_t disk, char** label);
+grub_err_t grub_fs_uuid (grub_fs_t fs, grub_disk_t disk, char** uuid);
+
+/* Tell in *USED whether the byte OFFSET of the volume DISK is in use by
+   its filesystem FS, and set *RUN to the number of bytes, at most LEN,
+   that share this state.  Filesystems that can't tell report everything
+   as used.  */
+grub_err_t grub_fs_query_used (grub_fs_t fs, grub_disk_t disk, grub_uint64_t offset,
+	grub_uint64_t len, grub_uint64_t* run, int* used);
+
+/* Keep probe results in the file PATH across runs.  Entries are checked
+   against the size and a fingerprint of the first 64K of the disk.  */
+grub_err_t grub_fs_probe_cache_load (const char* path);
+
+/* Write the probe cache back to its file if it changed.  */
+void grub_fs_probe_cache_save (void);
+
+/* Mount data of a filesystem, made from the volume DISK.  */
+typedef void* (*grub_fs_mount_t) (grub_disk_t disk);
+typedef void (*grub_fs_unmount_t) (void* data);
+
+/* Return the mount data of FS on the volume of DISK, calling MOUNT if it
+   isn't mounted yet, or NULL on error.  The data is shared by all users
+   of the volume and kept after the last one is done, until the volume is
+   written to or changes.  MOUNT gets a disk of the cache's own, since the
+   data may outlive DISK.  */
+void* grub_fs_mount_get (grub_fs_t fs, grub_disk_t disk, grub_fs_mount_t mount,
+	grub_fs_unmount_t unmount);
+
+/* Release mount data returned by grub_fs_mount_get.  */
+void grub_fs_mount_put (void* data);
+
+/* Unmount all filesystems no longer in use.  */
+void grub_fs_mount_flush (void);
+
 extern struct grub_fs grub_fs_winfile;
+
+/* Host handle of a file opened through grub_fs_winfile, or
+   INVALID_HANDLE_VALUE for any other file.  */
+HANDLE grub_fs_winfile_handle (struct grub_file* file);
 extern struct grub_fs grub_fs_blocklist;
 
 extern struct grub_fs grub_fat_fs;
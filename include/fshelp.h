@@ -71,11 +71,59 @@ grub_fshelp_find_file_lookup(const char* path,
 	char* (*read_symlink) (grub_fshelp_node_t node),
 	enum grub_fshelp_filetype expect);
 
+/* Lets grub_fshelp_find_file_cached remember the directory entries of
+   the volume DISK of FS between lookups.  Nodes must be NODE_SIZE bytes
+   with no pointers of their own, except for the first SHARED bytes
+   which point to mount data; these are taken from the root node when a
+   remembered node is handed out.  With LOAD_DIR set, the first lookup
+   in a directory reads all of its entries at once.  */
+struct grub_fshelp_cache
+{
+	grub_fs_t fs;
+	grub_disk_t disk;
+	grub_size_t node_size;
+	grub_size_t shared;
+	int load_dir;
+};
+
+/* Set up CACHE for the volume DISK of FS with the fields described above.  */
+void
+grub_fshelp_cache_init(struct grub_fshelp_cache* cache, grub_fs_t fs,
+	grub_disk_t disk, grub_size_t node_size, grub_size_t shared, int load_dir);
+
+/* Like grub_fshelp_find_file or grub_fshelp_find_file_lookup, whichever
+   of ITERATE_DIR and LOOKUP_FILE is given, with entries and misses kept
+   in the directory cache.  The cache of a volume is dropped when it is
+   written to or changes.  */
+grub_err_t
+grub_fshelp_find_file_cached(const struct grub_fshelp_cache* cache,
+	const char* path,
+	grub_fshelp_node_t rootnode,
+	grub_fshelp_node_t* foundnode,
+	int (*iterate_dir) (grub_fshelp_node_t dir,
+		grub_fshelp_iterate_dir_hook_t hook,
+		void* hook_data),
+	grub_err_t(*lookup_file) (grub_fshelp_node_t dir,
+		const char* name,
+		grub_fshelp_node_t* foundnode,
+		enum grub_fshelp_filetype* foundtype),
+	char* (*read_symlink) (grub_fshelp_node_t node),
+	enum grub_fshelp_filetype expect);
+
+/* Translate the file block BLOCK to a disk block like GET_BLOCK, and
+   set *RUN to the number of blocks from BLOCK on that follow it on disk,
+   or that are all sparse when 0 is returned.  *RUN is left 0 when it
+   isn't known.  */
+typedef grub_disk_addr_t(*grub_fshelp_get_extent_t) (grub_fshelp_node_t node,
+	grub_disk_addr_t block,
+	grub_disk_addr_t* run);
+
 /* Read LEN bytes from the file NODE on disk DISK into the buffer BUF,
    beginning with the block POS.  READ_HOOK should be set before
    reading a block from the file.  GET_BLOCK is used to translate file
-   blocks to disk blocks.  The file is FILESIZE bytes big and the
-   blocks have a size of LOG2BLOCKSIZE (in log2).  */
+   blocks to disk blocks, and GET_EXTENT, if given, to translate whole
+   runs of them.  The file is FILESIZE bytes big and the blocks have a
+   size of LOG2BLOCKSIZE (in log2).  */
 grub_ssize_t
 grub_fshelp_read_file(grub_disk_t disk, grub_fshelp_node_t node,
 	grub_disk_read_hook_t read_hook,
@@ -83,7 +131,19 @@ grub_fshelp_read_file(grub_disk_t disk, grub_fshelp_node_t node,
 	grub_off_t pos, grub_size_t len, char* buf,
 	grub_disk_addr_t(*get_block) (grub_fshelp_node_t node,
 		grub_disk_addr_t block),
+	grub_fshelp_get_extent_t get_extent,
 	grub_off_t filesize, int log2blocksize,
 	grub_disk_addr_t blocks_start);
 
+/* Call HOOK with the extents of the file NODE, found through GET_BLOCK
+   and GET_EXTENT with the same arguments as grub_fshelp_read_file.  */
+grub_err_t
+grub_fshelp_extents(grub_fshelp_node_t node,
+	grub_disk_addr_t(*get_block) (grub_fshelp_node_t node,
+		grub_disk_addr_t block),
+	grub_fshelp_get_extent_t get_extent,
+	grub_off_t filesize, int log2blocksize,
+	grub_disk_addr_t blocks_start,
+	grub_fs_extent_hook_t hook, void* hook_data);
+
 #endif
@@ -70,9 +70,6 @@ struct VHDFileControl
 	grub_uint32_t batEntries;
 	grub_uint32_t blockBitmapSize;
 	grub_uint8_t* blockAllocationTable;
-	grub_uint8_t* blockBitmapAndData;
-	grub_uint8_t* blockData;
-	grub_uint32_t currentBlockOffset;
 	struct VHDFileControl* parentVHDFC;
 };
 
@@ -119,8 +116,6 @@ grub_vhdio_close(grub_file_t file)
 	{
 		if (vhdfc->blockAllocationTable)
 			grub_free(vhdfc->blockAllocationTable);
-		if (vhdfc->blockBitmapAndData)
-			grub_free(vhdfc->blockBitmapAndData);
 		grub_free(vhdfc);
 	}
 	grub_file_close(vhdio->file);
@@ -198,13 +193,10 @@ grub_vhdio_open(grub_file_t io, enum grub_file_type type)
 
 	grub_uint32_t batSize = (4ULL * vhdfc->batEntries + 511) & (-512LL);
 	vhdfc->blockAllocationTable = grub_malloc(batSize);
-	vhdfc->blockBitmapSize = vhdfc->blockSize / (512 * 8);
-	vhdfc->blockBitmapAndData = grub_malloc(vhdfc->blockBitmapSize + vhdfc->blockSize);
-	vhdfc->blockData = vhdfc->blockBitmapAndData + vhdfc->blockBitmapSize;
+	// the sector bitmap is padded to a sector boundary
+	vhdfc->blockBitmapSize = ALIGN_UP(vhdfc->blockSize / (512 * 8), 512);
 
-	vhdio->file->offset = vhdfc->tableOffset;
-	grub_file_read(vhdio->file, vhdfc->blockAllocationTable, batSize);
-	vhdfc->currentBlockOffset = (grub_uint32_t)-1LL;
+	grub_file_pread(vhdio->file, vhdfc->blockAllocationTable, batSize, vhdfc->tableOffset);
 
 	file->size = vhdfc->volumeSize;
 
@@ -212,24 +204,24 @@ grub_vhdio_open(grub_file_t io, enum grub_file_type type)
 }
 
 static grub_ssize_t
-grub_vhdio_read(grub_file_t file, char* buf, grub_size_t len)
+grub_vhdio_pread(grub_file_t file, char* buf, grub_size_t len, grub_off_t offset)
 {
-	grub_uint64_t ret = 0;
-	grub_uint64_t rem = len;
+	grub_ssize_t ret = 0;
 	grub_vhdio_t vhdio = file->data;
 	VHDFileControl* vhdfc = vhdio->vhdfc;
-	if (file->offset + len > vhdfc->volumeSize)
-		len = (file->offset <= vhdfc->volumeSize) ? vhdfc->volumeSize - file->offset : 0;
-	while (rem)
+	if (offset + len > vhdfc->volumeSize)
+		len = (offset <= vhdfc->volumeSize) ? vhdfc->volumeSize - offset : 0;
+	while (len)
 	{
-		grub_uint32_t blockNumber = file->offset >> vhdfc->blockSizeLog2;
-		grub_uint64_t blockOffset = blockNumber << vhdfc->blockSizeLog2;
-		grub_uint32_t offsetInBlock = (grub_uint32_t)(file->offset - blockOffset);
-		grub_uint32_t txLen = (rem < vhdfc->blockSize - offsetInBlock) ?
-			rem : vhdfc->blockSize - offsetInBlock;
-		grub_uint32_t blockLBA = *(grub_uint32_t*)
-			(vhdfc->blockAllocationTable + blockNumber * 4);
-		blockLBA = grub_swap_bytes32(blockLBA);
+		grub_uint32_t blockNumber = (grub_uint32_t)(offset >> vhdfc->blockSizeLog2);
+		grub_uint64_t blockOffset = (grub_uint64_t)blockNumber << vhdfc->blockSizeLog2;
+		grub_uint32_t offsetInBlock = (grub_uint32_t)(offset - blockOffset);
+		grub_uint32_t txLen = (len < vhdfc->blockSize - offsetInBlock) ?
+			(grub_uint32_t)len : vhdfc->blockSize - offsetInBlock;
+		grub_uint32_t blockLBA;
+		if (blockNumber >= vhdfc->batEntries)
+			break;
+		blockLBA = grub_swap_bytes32(grub_get_unaligned32(vhdfc->blockAllocationTable + blockNumber * 4));
 		if (blockLBA == 0xFFFFFFFF)
 		{
 			// unused block on dynamic VHD. read zero
@@ -237,32 +229,61 @@ grub_vhdio_read(grub_file_t file, char* buf, grub_size_t len)
 		}
 		else
 		{
-			if (blockOffset != vhdfc->currentBlockOffset)
-			{
-				vhdio->file->offset = blockLBA * 512;
-				grub_uint64_t nread = grub_file_read(vhdio->file,
-					vhdfc->blockBitmapAndData, vhdfc->blockBitmapSize + vhdfc->blockSize);
-				if (nread < vhdfc->blockBitmapSize + vhdfc->blockSize)
-					break;
-				vhdfc->currentBlockOffset = blockOffset;
-			}
-			grub_memmove(buf, vhdfc->blockData + offsetInBlock, txLen);
+			// block data follows the sector bitmap
+			grub_ssize_t nread = grub_file_pread(vhdio->file, buf, txLen,
+				(grub_uint64_t)blockLBA * 512 + vhdfc->blockBitmapSize + offsetInBlock);
+			if (nread < (grub_ssize_t)txLen)
+				return ret ? ret : -1;
 		}
 		buf += txLen;
-		file->offset += txLen;
-		rem -= txLen;
+		offset += txLen;
+		len -= txLen;
 		ret += txLen;
 	}
 
 	return ret;
 }
 
+static grub_ssize_t
+grub_vhdio_read(grub_file_t file, char* buf, grub_size_t len)
+{
+	return grub_vhdio_pread(file, buf, len, file->offset);
+}
+
+/* Blocks missing from the BAT are holes.  */
+static grub_err_t
+grub_vhdio_query_allocated(grub_file_t file, grub_off_t offset,
+	grub_uint64_t len, grub_uint64_t* run, int* allocated)
+{
+	grub_vhdio_t vhdio = file->data;
+	VHDFileControl* vhdfc = vhdio->vhdfc;
+	grub_uint64_t blockNumber = offset >> vhdfc->blockSizeLog2;
+	grub_uint64_t end = (blockNumber + 1) << vhdfc->blockSizeLog2;
+	int state;
+
+	if (blockNumber >= vhdfc->batEntries)
+		return GRUB_ERR_NONE;
+	state = (grub_get_unaligned32(vhdfc->blockAllocationTable + blockNumber * 4) != 0xFFFFFFFF);
+	for (blockNumber++; blockNumber < vhdfc->batEntries && end - offset < len; blockNumber++)
+	{
+		if ((grub_get_unaligned32(vhdfc->blockAllocationTable + blockNumber * 4) != 0xFFFFFFFF) != state)
+			break;
+		end += vhdfc->blockSize;
+	}
+	*allocated = state;
+	if (end - offset < len)
+		*run = end - offset;
+	return GRUB_ERR_NONE;
+}
+
 static struct grub_fs grub_vhdio_fs = {
   .name = "vhdio",
   .fs_dir = 0,
   .fs_open = 0,
   .fs_read = grub_vhdio_read,
+  .fs_pread = grub_vhdio_pread,
   .fs_close = grub_vhdio_close,
   .fs_label = 0,
+  .fs_query_allocated = grub_vhdio_query_allocated,
   .next = 0
 };
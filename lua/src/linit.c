@@ -175,7 +175,11 @@ df_enum_file_iter(const char* name, const struct grub_dirhook_info* info, void*
 	lua_pushvalue(L, 1);
 	lua_pushstring(L, name);
 	lua_pushinteger(L, info->dir != 0);
-	lua_call(L, 2, 1);
+	if (info->sizeset)
+		lua_pushinteger(L, (lua_Integer)info->size);
+	else
+		lua_pushnil(L);
+	lua_call(L, 3, 1);
 	result = lua_tointeger(L, -1);
 	lua_pop(L, 1);
 	return (int)result;
@@ -212,6 +216,53 @@ df_enum_file(lua_State* L)
 	return push_result(L, 0);
 }
 
+static int
+df_enum_line(lua_State* L)
+{
+	const char* arg;
+	grub_file_t file;
+	grub_file_reader_t reader = NULL;
+	const char* line;
+	grub_size_t len;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	arg = luaL_checkstring(L, 2);
+	file = grub_file_open(arg, GRUB_FILE_TYPE_CAT | GRUB_FILE_TYPE_NO_DECOMPRESS);
+	if (!file)
+		return push_result(L, 0);
+	reader = grub_file_reader_new(file, (grub_size_t)luaL_optinteger(L, 3, 0));
+	if (!reader)
+	{
+		grub_file_close(file);
+		if (!grub_errno)
+			grub_error(GRUB_ERR_OUT_OF_MEMORY, "out of memory");
+		return push_result(L, 0);
+	}
+	while (1)
+	{
+		lua_Integer result;
+		line = grub_file_reader_line(reader, &len);
+		if (!line)
+			break;
+		lua_pushvalue(L, 1);
+		lua_pushlstring(L, line, len);
+		/* Close the file before passing on an error of the callback.  */
+		if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+		{
+			grub_file_reader_free(reader);
+			grub_file_close(file);
+			return lua_error(L);
+		}
+		result = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (result)
+			break;
+	}
+	grub_file_reader_free(reader);
+	grub_file_close(file);
+	return push_result(L, 0);
+}
+
 //int luaopen_winapi(lua_State* L);
 
 static luaL_Buffer df_xputs_buf;
@@ -268,6 +319,7 @@ static const luaL_Reg dflib[] =
 {
 	{"enum_device", df_enum_device},
 	{"enum_file", df_enum_file},
+	{"enum_line", df_enum_line},
 	{"cmd", df_cmd},
 	{NULL, NULL}
 };